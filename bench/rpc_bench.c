@@ -0,0 +1,312 @@
+/**
+ * Load generator for the RPC system. Opens a number of client connections spread over
+ * a number of threads and drives calls against a server, either as fast as each
+ * connection allows (closed loop) or at a fixed total rate (open loop). Reports
+ * throughput and latency percentiles once done.
+ *
+ * In open loop mode latency is measured from when a call was scheduled rather than
+ * when it was sent, so a stalled server can't hide its queueing delay.
+*/
+
+#define _GNU_SOURCE
+
+#include "rpc.h"
+#include "rpc_ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+
+#define DEFAULT_ADDR "::1"
+#define DEFAULT_PORT 3000
+#define DEFAULT_FUNC "echo"
+
+typedef struct bench_config {
+    char* addr;
+    int port;
+    char* func_name;
+    int n_connections;
+    int n_threads;
+    double duration_s;
+    double rate;
+    size_t data2_len;
+    bool serve;
+} bench_config;
+
+// State of a single benchmark thread, which owns a slice of the connections
+typedef struct bench_thread {
+    pthread_t thread;
+    bench_config* config;
+    rpc_client** clients;
+    rpc_handle** handles;
+    int n_clients;
+    uint64_t* latencies;
+    size_t n_latencies;
+    size_t capacity;
+    uint64_t errors;
+} bench_thread;
+
+static uint64_t now_ns(void);
+static void sleep_until_ns(uint64_t target_ns);
+static void record_latency(bench_thread* bt, uint64_t latency_ns);
+static int cmp_u64(const void* a, const void* b);
+static uint64_t percentile(uint64_t* sorted, size_t count, double fraction);
+static void* bench_work(void* arg);
+static void* serve_work(void* arg);
+static rpc_data* echo(rpc_data* in);
+static void usage(char* prog);
+
+int main(int argc, char* argv[]) {
+    bench_config config = {
+        .addr = DEFAULT_ADDR,
+        .port = DEFAULT_PORT,
+        .func_name = DEFAULT_FUNC,
+        .n_connections = 1,
+        .n_threads = 1,
+        .duration_s = 5,
+        .rate = 0,
+        .data2_len = 0,
+        .serve = false,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:p:f:c:t:d:r:s:Sh")) != -1) {
+        switch (opt) {
+            case 'a': config.addr = optarg; break;
+            case 'p': config.port = atoi(optarg); break;
+            case 'f': config.func_name = optarg; break;
+            case 'c': config.n_connections = atoi(optarg); break;
+            case 't': config.n_threads = atoi(optarg); break;
+            case 'd': config.duration_s = atof(optarg); break;
+            case 'r': config.rate = atof(optarg); break;
+            case 's': config.data2_len = strtoull(optarg, NULL, 10); break;
+            case 'S': config.serve = true; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (config.n_threads < 1 || config.n_connections < config.n_threads ||
+        config.duration_s <= 0 || config.rate < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // Optionally run an echo server in this process
+    rpc_server* srv = NULL;
+    pthread_t srv_thread;
+    if (config.serve) {
+        srv = rpc_init_server(config.port);
+        if (srv == NULL || rpc_register(srv, config.func_name, echo) == -1) {
+            fprintf(stderr, "Failed to start server\n");
+            return 1;
+        }
+        pthread_create(&srv_thread, NULL, serve_work, srv);
+    }
+
+    // Hand out connections to threads round robin
+    bench_thread* threads = calloc(config.n_threads, sizeof(bench_thread));
+    for (int i=0; i<config.n_threads; i++) {
+        bench_thread* bt = &threads[i];
+        bt->config = &config;
+        bt->n_clients = config.n_connections / config.n_threads +
+                        (i < config.n_connections % config.n_threads);
+        bt->clients = calloc(bt->n_clients, sizeof(rpc_client*));
+        bt->handles = calloc(bt->n_clients, sizeof(rpc_handle*));
+
+        for (int j=0; j<bt->n_clients; j++) {
+            bt->clients[j] = rpc_init_client(config.addr, config.port);
+            if (bt->clients[j] == NULL) {
+                fprintf(stderr, "Failed to connect to %s:%d\n", config.addr, config.port);
+                return 1;
+            }
+            bt->handles[j] = rpc_find(bt->clients[j], config.func_name);
+            if (bt->handles[j] == NULL) {
+                fprintf(stderr, "Function %s does not exist\n", config.func_name);
+                return 1;
+            }
+        }
+    }
+
+    uint64_t start_ns = now_ns();
+    for (int i=0; i<config.n_threads; i++)
+        pthread_create(&threads[i].thread, NULL, bench_work, &threads[i]);
+    for (int i=0; i<config.n_threads; i++)
+        pthread_join(threads[i].thread, NULL);
+    double elapsed_s = (now_ns() - start_ns) / 1e9;
+
+    // Merge every thread's samples
+    size_t n_samples = 0;
+    uint64_t n_errors = 0;
+    for (int i=0; i<config.n_threads; i++) {
+        n_samples += threads[i].n_latencies;
+        n_errors += threads[i].errors;
+    }
+
+    uint64_t* samples = malloc((n_samples + 1) * sizeof(uint64_t));
+    size_t offset = 0;
+    long double latency_sum = 0;
+    for (int i=0; i<config.n_threads; i++) {
+        memcpy(&samples[offset], threads[i].latencies, threads[i].n_latencies * sizeof(uint64_t));
+        offset += threads[i].n_latencies;
+    }
+    for (size_t i=0; i<n_samples; i++)
+        latency_sum += samples[i];
+    qsort(samples, n_samples, sizeof(uint64_t), cmp_u64);
+
+    printf("mode:           %s\n", config.rate > 0 ? "open" : "closed");
+    printf("connections:    %d\n", config.n_connections);
+    printf("threads:        %d\n", config.n_threads);
+    printf("data2_len:      %zu\n", config.data2_len);
+    printf("duration_s:     %.3f\n", elapsed_s);
+    printf("calls:          %zu\n", n_samples);
+    printf("errors:         %" PRIu64 "\n", n_errors);
+    printf("throughput_rps: %.1f\n", n_samples / elapsed_s);
+    printf("latency_mean_us: %.1f\n", n_samples ? (double)(latency_sum / n_samples) / 1e3 : 0);
+    printf("latency_p50_us:  %.1f\n", percentile(samples, n_samples, 0.5) / 1e3);
+    printf("latency_p99_us:  %.1f\n", percentile(samples, n_samples, 0.99) / 1e3);
+    printf("latency_p999_us: %.1f\n", percentile(samples, n_samples, 0.999) / 1e3);
+    printf("latency_max_us:  %.1f\n", n_samples ? samples[n_samples - 1] / 1e3 : 0);
+
+    // Cleanup
+    for (int i=0; i<config.n_threads; i++) {
+        for (int j=0; j<threads[i].n_clients; j++) {
+            free(threads[i].handles[j]);
+            rpc_close_client(threads[i].clients[j]);
+        }
+        free(threads[i].clients);
+        free(threads[i].handles);
+        free(threads[i].latencies);
+    }
+    free(threads);
+    free(samples);
+
+    if (srv != NULL) {
+        rpc_server_shutdown(srv);
+        pthread_join(srv_thread, NULL);
+        rpc_close_server(srv);
+    }
+
+    return n_errors ? 1 : 0;
+}
+
+static void* bench_work(void* arg) {
+    bench_thread* bt = arg;
+    bench_config* config = bt->config;
+
+    uint8_t* data2 = config->data2_len ? malloc(config->data2_len) : NULL;
+    for (size_t i=0; i<config->data2_len; i++)
+        data2[i] = i;
+
+    rpc_data payload = {
+        .data1 = 0,
+        .data2_len = config->data2_len,
+        .data2 = data2,
+    };
+
+    // Open loop threads each take an equal share of the total rate
+    uint64_t interval_ns = config->rate > 0 ?
+                           (uint64_t)(1e9 * config->n_threads / config->rate) : 0;
+    uint64_t start_ns = now_ns();
+    uint64_t end_ns = start_ns + (uint64_t)(config->duration_s * 1e9);
+    uint64_t scheduled_ns = start_ns;
+
+    for (uint64_t i=0; ; i++) {
+        uint64_t sent_ns;
+        if (interval_ns) {
+            scheduled_ns += interval_ns;
+            if (scheduled_ns >= end_ns)
+                break;
+            sleep_until_ns(scheduled_ns);
+            sent_ns = scheduled_ns;
+        } else {
+            sent_ns = now_ns();
+            if (sent_ns >= end_ns)
+                break;
+        }
+
+        int index = i % bt->n_clients;
+        payload.data1 = i & 0x7F;
+        rpc_data* response = rpc_call(bt->clients[index], bt->handles[index], &payload);
+        if (response == NULL) {
+            bt->errors++;
+            continue;
+        }
+        record_latency(bt, now_ns() - sent_ns);
+        rpc_data_free(response);
+    }
+
+    free(data2);
+    return NULL;
+}
+
+static void* serve_work(void* arg) {
+    rpc_serve_all(arg);
+    return NULL;
+}
+
+static rpc_data* echo(rpc_data* in) {
+    rpc_data* out = rpc_data_alloc();
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    if (in->data2_len) {
+        out->data2 = rpc_buf_alloc(in->data2_len);
+        memcpy(out->data2, in->data2, in->data2_len);
+    }
+    return out;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void sleep_until_ns(uint64_t target_ns) {
+    struct timespec target = {
+        .tv_sec = target_ns / 1000000000ULL,
+        .tv_nsec = target_ns % 1000000000ULL,
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) != 0);
+}
+
+static void record_latency(bench_thread* bt, uint64_t latency_ns) {
+    if (bt->n_latencies == bt->capacity) {
+        bt->capacity = bt->capacity ? bt->capacity * 2 : 4096;
+        bt->latencies = realloc(bt->latencies, bt->capacity * sizeof(uint64_t));
+    }
+    bt->latencies[bt->n_latencies++] = latency_ns;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t* sorted, size_t count, double fraction) {
+    if (count == 0)
+        return 0;
+    size_t rank = (size_t)(fraction * count);
+    return sorted[rank < count ? rank : count - 1];
+}
+
+static void usage(char* prog) {
+    fprintf(stderr,
+        "usage: %s [options]\n"
+        "  -a addr   server address (default " DEFAULT_ADDR ")\n"
+        "  -p port   server port (default %d)\n"
+        "  -f name   function to call, must echo its input (default " DEFAULT_FUNC ")\n"
+        "  -c n      number of connections (default 1)\n"
+        "  -t n      number of threads, at most one per connection (default 1)\n"
+        "  -d secs   duration of the run (default 5)\n"
+        "  -r rps    total request rate for open loop, 0 for closed loop (default 0)\n"
+        "  -s bytes  size of data2 in each request (default 0)\n"
+        "  -S        serve the echo function from this process as well\n",
+        prog, DEFAULT_PORT);
+}
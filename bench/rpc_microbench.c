@@ -0,0 +1,284 @@
+/**
+ * Microbenchmarks for the internals that sit on the hot path of every call. Each
+ * benchmark is calibrated to run for roughly the target time and is repeated a few
+ * times, reporting the fastest repeat. Results are printed one JSON object per line:
+ *
+ *   {"bench":"<name>","param":<n>,"iters":<n>,"ns_per_op":<x>}
+ *
+ * so that runs can be diffed or fed into whatever tracks regressions.
+*/
+
+#include "defines.h"
+#include "rpc.h"
+#include "rpc_types.h"
+#include "helper.h"
+#include "hashtable.h"
+#include "linked_list.h"
+#include "byteorder.h"
+
+#include <getopt.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define DEFAULT_TARGET_MS 200
+#define DEFAULT_REPEATS 3
+
+// A benchmark runs iters operations on its context
+typedef void (*bench_fn)(void* ctx, uint64_t iters);
+
+typedef struct data_ctx {
+    int fds[2];
+    rpc_data data;
+} data_ctx;
+
+typedef struct ht_ctx {
+    char** names;
+    uint64_t* hashes;
+    size_t n_names;
+    hash_table* ht;
+} ht_ctx;
+
+typedef struct swap_ctx {
+    uint8_t* bytes;
+    size_t nbytes;
+    unsigned width;
+} swap_ctx;
+
+static uint64_t target_ns;
+static int n_repeats;
+static volatile uint64_t sink;
+
+static uint64_t now_ns(void);
+static void run_bench(const char* name, uint64_t param, bench_fn fn, void* ctx);
+
+static void bench_send_recv_data(void* ctx, uint64_t iters);
+static void bench_ht_insert(void* ctx, uint64_t iters);
+static void bench_ht_index_with_hash(void* ctx, uint64_t iters);
+static void bench_list_insert_pop(void* ctx, uint64_t iters);
+static void bench_check_data(void* ctx, uint64_t iters);
+static void bench_byteorder_swap(void* ctx, uint64_t iters);
+static void bench_hton64_loop(void* ctx, uint64_t iters);
+
+static rpc_data* noop_handler(rpc_data* in);
+
+int main(int argc, char* argv[]) {
+    uint64_t target_ms = DEFAULT_TARGET_MS;
+    n_repeats = DEFAULT_REPEATS;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:r:h")) != -1) {
+        switch (opt) {
+            case 't': target_ms = strtoull(optarg, NULL, 10); break;
+            case 'r': n_repeats = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-t target_ms] [-r repeats]\n", argv[0]);
+                return opt == 'h' ? 0 : 1;
+        }
+    }
+    target_ns = target_ms * 1000000ULL;
+    if (n_repeats < 1)
+        n_repeats = 1;
+
+    // Serialisation round trip over a socketpair, payloads small enough
+    // to fit in the socket buffer so one thread can do both ends
+    size_t data2_sizes[] = { 0, 16, 256, 4096, 65536 };
+    for (int i=0; i<sizeof(data2_sizes)/sizeof(size_t); i++) {
+        data_ctx ctx;
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctx.fds) < 0) {
+            perror("socketpair() failed!\n");
+            return 1;
+        }
+        int buff_size = 4 * 65536;
+        setsockopt(ctx.fds[0], SOL_SOCKET, SO_SNDBUF, &buff_size, sizeof(int));
+        setsockopt(ctx.fds[1], SOL_SOCKET, SO_RCVBUF, &buff_size, sizeof(int));
+
+        ctx.data.data1 = 42;
+        ctx.data.data2_len = data2_sizes[i];
+        ctx.data.data2 = data2_sizes[i] ? calloc(1, data2_sizes[i]) : NULL;
+        run_bench("socket_send_recv_data", data2_sizes[i], bench_send_recv_data, &ctx);
+
+        free(ctx.data.data2);
+        close(ctx.fds[0]);
+        close(ctx.fds[1]);
+    }
+
+    // Registry at different sizes
+    size_t registry_sizes[] = { 1, 10, 100, 1000 };
+    for (int i=0; i<sizeof(registry_sizes)/sizeof(size_t); i++) {
+        ht_ctx ctx = { .n_names = registry_sizes[i] };
+        ctx.names = calloc(ctx.n_names, sizeof(char*));
+        ctx.hashes = calloc(ctx.n_names, sizeof(uint64_t));
+        ctx.ht = ht_create();
+        for (size_t j=0; j<ctx.n_names; j++) {
+            ctx.names[j] = malloc(32);
+            snprintf(ctx.names[j], 32, "function_%zu", j);
+            ht_insert(ctx.ht, ctx.names[j], noop_handler);
+        }
+        for (size_t j=0; j<ctx.n_names; j++)
+            ctx.hashes[j] = ht_item_at(ctx.ht, j)->hash_value;
+
+        run_bench("ht_insert", ctx.n_names, bench_ht_insert, &ctx);
+        run_bench("ht_index_with_hash", ctx.n_names, bench_ht_index_with_hash, &ctx);
+
+        ht_destroy(ctx.ht);
+        for (size_t j=0; j<ctx.n_names; j++)
+            free(ctx.names[j]);
+        free(ctx.names);
+        free(ctx.hashes);
+    }
+
+    // Client queue, at a few different depths
+    size_t queue_depths[] = { 0, 16, 1024 };
+    for (int i=0; i<sizeof(queue_depths)/sizeof(size_t); i++) {
+        list* pList = list_create(true);
+        for (size_t j=0; j<queue_depths[i]; j++)
+            list_insert_tail(pList, malloc(sizeof(int)));
+        run_bench("list_insert_tail_pop_head", queue_depths[i], bench_list_insert_pop, pList);
+        list_destroy(pList);
+    }
+
+    // Validation of outgoing data
+    run_bench("check_data", 0, bench_check_data, NULL);
+
+    // Typed array conversion of a 64KiB payload, against swapping one value at a time
+    unsigned widths[] = { 2, 4, 8 };
+    for (int i=0; i<sizeof(widths)/sizeof(unsigned); i++) {
+        swap_ctx ctx = { .nbytes = 65536, .width = widths[i] };
+        ctx.bytes = calloc(1, ctx.nbytes);
+        run_bench("byteorder_swap_64KiB", ctx.width, bench_byteorder_swap, &ctx);
+        if (ctx.width == 8)
+            run_bench("hton64_loop_64KiB", ctx.width, bench_hton64_loop, &ctx);
+        free(ctx.bytes);
+    }
+
+    return 0;
+}
+
+static void run_bench(const char* name, uint64_t param, bench_fn fn, void* ctx) {
+
+    // Double the iterations until a single run takes long enough to time
+    uint64_t iters = 1;
+    uint64_t elapsed_ns = 0;
+    while (true) {
+        uint64_t start_ns = now_ns();
+        fn(ctx, iters);
+        elapsed_ns = now_ns() - start_ns;
+        if (elapsed_ns >= target_ns / 4 || iters >= (1ULL << 40))
+            break;
+        iters *= 2;
+    }
+
+    // Scale to the target time, then keep the fastest of the repeats
+    if (elapsed_ns > 0 && elapsed_ns < target_ns)
+        iters = iters * target_ns / elapsed_ns;
+    if (iters == 0)
+        iters = 1;
+
+    double best_ns_per_op = -1;
+    for (int i=0; i<n_repeats; i++) {
+        uint64_t start_ns = now_ns();
+        fn(ctx, iters);
+        double ns_per_op = (double)(now_ns() - start_ns) / iters;
+        if (best_ns_per_op < 0 || ns_per_op < best_ns_per_op)
+            best_ns_per_op = ns_per_op;
+    }
+
+    printf("{\"bench\":\"%s\",\"param\":%lu,\"iters\":%lu,\"ns_per_op\":%.2f}\n",
+           name, (unsigned long)param, (unsigned long)iters, best_ns_per_op);
+    fflush(stdout);
+}
+
+static void bench_send_recv_data(void* ctx, uint64_t iters) {
+    data_ctx* dctx = ctx;
+    for (uint64_t i=0; i<iters; i++) {
+        rpc_data* output = NULL;
+        if (!socket_send_data(dctx->fds[0], &dctx->data) ||
+            !socket_recv_data(dctx->fds[1], &output)) {
+            fprintf(stderr, "socketpair closed unexpectedly\n");
+            exit(EXIT_FAILURE);
+        }
+        sink += output->data1;
+        rpc_data_free(output);
+    }
+}
+
+static void bench_ht_insert(void* ctx, uint64_t iters) {
+    ht_ctx* hctx = ctx;
+
+    // Names are registered into a fresh table that is thrown away once it
+    // holds every name, so inserts see every size up to n_names
+    hash_table* ht = ht_create();
+    for (uint64_t i=0; i<iters; i++) {
+        size_t index = i % hctx->n_names;
+        if (index == 0 && i > 0) {
+            ht_destroy(ht);
+            ht = ht_create();
+        }
+        ht_insert(ht, hctx->names[index], noop_handler);
+    }
+    ht_destroy(ht);
+}
+
+static void bench_ht_index_with_hash(void* ctx, uint64_t iters) {
+    ht_ctx* hctx = ctx;
+    for (uint64_t i=0; i<iters; i++) {
+        rpc_handler handler = ht_index_with_hash(hctx->ht, hctx->hashes[i % hctx->n_names]);
+        sink += (handler != NULL);
+    }
+}
+
+static void bench_list_insert_pop(void* ctx, uint64_t iters) {
+    list* pList = ctx;
+    for (uint64_t i=0; i<iters; i++) {
+        int* fd = malloc(sizeof(int));
+        *fd = i;
+        list_insert_tail(pList, fd);
+        list_pop_head(pList);
+    }
+}
+
+static void bench_check_data(void* ctx, uint64_t iters) {
+    hw_profile profile = {
+        .int_max = MAX_SINT(sizeof(int)),
+        .int_min = -MAX_SINT(sizeof(int)) - 1,
+        .size_max = MAX_UINT(sizeof(size_t)),
+        .initialised = true,
+    };
+    uint8_t byte = 0;
+    rpc_data data = { .data1 = 0, .data2_len = 1, .data2 = &byte };
+    for (uint64_t i=0; i<iters; i++) {
+        data.data1 = i;
+        sink += check_data(&profile, &data);
+    }
+}
+
+static void bench_byteorder_swap(void* ctx, uint64_t iters) {
+    swap_ctx* sctx = ctx;
+    for (uint64_t i=0; i<iters; i++)
+        byteorder_swap(sctx->bytes, sctx->nbytes / sctx->width, sctx->width);
+    sink += sctx->bytes[0];
+}
+
+static void bench_hton64_loop(void* ctx, uint64_t iters) {
+    swap_ctx* sctx = ctx;
+    for (uint64_t i=0; i<iters; i++) {
+        for (size_t j=0; j<sctx->nbytes; j+=sizeof(uint64_t)) {
+            uint64_t value;
+            memcpy(&value, sctx->bytes + j, sizeof(uint64_t));
+            value = hton64(value);
+            memcpy(sctx->bytes + j, &value, sizeof(uint64_t));
+        }
+    }
+    sink += sctx->bytes[0];
+}
+
+static rpc_data* noop_handler(rpc_data* in) {
+    return NULL;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
@@ -0,0 +1,835 @@
+/**
+ * Replays the scenario scripts under cases/ as load. Every case directory given is
+ * run in turn: a number of threads each play all of the case's client*.in scripts
+ * a number of times over, each session on fresh connections, against a live server
+ * or against the case's own server.in played in this process. Every line a session
+ * prints is checked against the script's .out as it is produced, so the run reports
+ * divergence from the expected output alongside throughput and call latency.
+ *
+ * Sessions print the address and port written in the script, so the .out files
+ * still match when -a and -o point the connections somewhere else.
+*/
+
+#define _GNU_SOURCE
+
+#include "rpc.h"
+#include "rpc_ext.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <getopt.h>
+#include <glob.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+// Bounds on what a script may use
+#define MAX_INSTANCES 16
+#define MAX_LINE 1024
+
+// Digits of sha256 printed for data2, as in the .out files
+#define DIGEST_PREFIX 7
+
+typedef struct replay_config {
+    char* addr;
+    int port_offset;
+    int n_threads;
+    int repeat;
+    bool serve;
+} replay_config;
+
+typedef enum step_kind {
+    STEP_INIT,
+    STEP_FIND,
+    STEP_CALL,
+    STEP_SWITCH,
+    STEP_CLOSE,
+    STEP_REGISTER,
+    STEP_SERVE,
+} step_kind;
+
+// How a call builds its payload and prints its result
+typedef enum call_kind {
+    CALL_ADD2,
+    CALL_SLEEP,
+    CALL_ECHO2,
+    CALL_BAD_NULL,
+    CALL_BAD_DATA2_1,
+    CALL_BAD_DATA2_2,
+} call_kind;
+
+// One command of a script, along with the argument lines that follow it
+typedef struct replay_step {
+    step_kind kind;
+    call_kind call;
+    char* name;
+    char* handler;
+    char* addr;
+    int port;
+    int instance;
+    int data1;
+    int arg2;
+    uint8_t* data2;
+    size_t data2_len;
+} replay_step;
+
+typedef struct replay_script {
+    char* path;
+    replay_step* steps;
+    size_t n_steps;
+
+    // Lines of the matching .out, without their newlines
+    char** expected;
+    size_t n_expected;
+} replay_script;
+
+typedef struct replay_case {
+    char* dir;
+    replay_script* clients;
+    size_t n_clients;
+    replay_script server;
+    bool has_server;
+
+    // First divergence seen by any thread, kept for the report
+    pthread_mutex_t mutex;
+    char* divergence;
+} replay_case;
+
+// State of a single replay thread, which plays every script of a case in turn
+typedef struct replay_thread {
+    pthread_t thread;
+    replay_config* config;
+    replay_case* rcase;
+    int index;
+    uint64_t* latencies;
+    size_t n_latencies;
+    size_t capacity;
+    uint64_t sessions;
+    uint64_t divergent;
+} replay_thread;
+
+// Output of a session as it's compared against the expected lines
+typedef struct replay_session {
+    replay_case* rcase;
+    replay_script* script;
+    size_t line;
+    bool is_divergent;
+} replay_session;
+
+// Handlers a server.in may register by name
+typedef struct replay_handler {
+    char* name;
+    rpc_handler handler;
+    unsigned flags;
+} replay_handler;
+
+static bool load_case(char* dir, replay_case* rcase);
+static bool load_script(char* path, replay_script* script);
+static bool parse_step(char* line, FILE* file, replay_step* step);
+static char* read_line(FILE* file, char* buffer);
+static void free_script(replay_script* script);
+static void* replay_work(void* arg);
+static void replay_session_run(replay_thread* rt, replay_script* script);
+static void replay_call(replay_thread* rt, replay_session* session, int instance,
+                        rpc_client* cl, rpc_handle* h, replay_step* step);
+static void emit(replay_session* session, char* format, ...);
+static void diverge(replay_session* session, char* got);
+static int start_servers(replay_config* config, replay_case* rcase,
+                         rpc_server** servers, pthread_t* threads, bool* is_serving);
+static void* serve_work(void* arg);
+static rpc_handler find_handler(char* name, unsigned* flags);
+static rpc_data* add2_i8(rpc_data* in);
+static rpc_data* add2_2(rpc_data* in);
+static rpc_data* sleep2(rpc_data* in);
+static rpc_data* echo2(rpc_data* in);
+static rpc_data* bad_null(rpc_data* in);
+static rpc_data* bad_data2_1(rpc_data* in);
+static rpc_data* bad_data2_2(rpc_data* in);
+static void sha256_hex(uint8_t* data, size_t len, char* hex);
+static uint64_t now_ns(void);
+static void record_latency(replay_thread* rt, uint64_t latency_ns);
+static int cmp_u64(const void* a, const void* b);
+static uint64_t percentile(uint64_t* sorted, size_t count, double fraction);
+static void usage(char* prog);
+
+static replay_handler handlers[] = {
+    { "add2", add2_i8, RPC_FUNC_PURE },
+    { "add2_2", add2_2, RPC_FUNC_PURE },
+    { "sleep", sleep2, RPC_FUNC_BLOCKING },
+    { "echo2", echo2, RPC_FUNC_PURE },
+    { "bad_null", bad_null, 0 },
+    { "bad_data2_1", bad_data2_1, 0 },
+    { "bad_data2_2", bad_data2_2, 0 },
+};
+
+int main(int argc, char* argv[]) {
+    replay_config config = {
+        .addr = NULL,
+        .port_offset = 0,
+        .n_threads = 1,
+        .repeat = 1,
+        .serve = false,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "a:o:t:n:Sh")) != -1) {
+        switch (opt) {
+            case 'a': config.addr = optarg; break;
+            case 'o': config.port_offset = atoi(optarg); break;
+            case 't': config.n_threads = atoi(optarg); break;
+            case 'n': config.repeat = atoi(optarg); break;
+            case 'S': config.serve = true; break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    if (config.n_threads < 1 || config.repeat < 1 || optind == argc) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    uint64_t total_divergent = 0;
+    for (int arg=optind; arg<argc; arg++) {
+        replay_case rcase;
+        if (!load_case(argv[arg], &rcase)) {
+            fprintf(stderr, "Failed to load case %s\n", argv[arg]);
+            return 1;
+        }
+
+        // Optionally play the case's server in this process
+        rpc_server* servers[MAX_INSTANCES] = { NULL };
+        pthread_t serve_threads[MAX_INSTANCES];
+        bool is_serving[MAX_INSTANCES] = { false };
+        if (config.serve && start_servers(&config, &rcase, servers, serve_threads, is_serving) == -1) {
+            fprintf(stderr, "Failed to start the server of %s\n", rcase.dir);
+            return 1;
+        }
+
+        replay_thread* threads = calloc(config.n_threads, sizeof(replay_thread));
+        uint64_t start_ns = now_ns();
+        for (int i=0; i<config.n_threads; i++) {
+            threads[i].config = &config;
+            threads[i].rcase = &rcase;
+            threads[i].index = i;
+            pthread_create(&threads[i].thread, NULL, replay_work, &threads[i]);
+        }
+        for (int i=0; i<config.n_threads; i++)
+            pthread_join(threads[i].thread, NULL);
+        double elapsed_s = (now_ns() - start_ns) / 1e9;
+
+        for (int i=0; i<MAX_INSTANCES; i++) {
+            if (is_serving[i]) {
+                rpc_server_shutdown(servers[i]);
+                pthread_join(serve_threads[i], NULL);
+            }
+            rpc_close_server(servers[i]);
+        }
+
+        // Merge every thread's samples
+        size_t n_samples = 0;
+        uint64_t n_sessions = 0, n_divergent = 0;
+        for (int i=0; i<config.n_threads; i++) {
+            n_samples += threads[i].n_latencies;
+            n_sessions += threads[i].sessions;
+            n_divergent += threads[i].divergent;
+        }
+
+        uint64_t* samples = malloc((n_samples + 1) * sizeof(uint64_t));
+        size_t offset = 0;
+        long double latency_sum = 0;
+        for (int i=0; i<config.n_threads; i++) {
+            memcpy(&samples[offset], threads[i].latencies, threads[i].n_latencies * sizeof(uint64_t));
+            offset += threads[i].n_latencies;
+            free(threads[i].latencies);
+        }
+        for (size_t i=0; i<n_samples; i++)
+            latency_sum += samples[i];
+        qsort(samples, n_samples, sizeof(uint64_t), cmp_u64);
+
+        printf("case:            %s\n", rcase.dir);
+        printf("scripts:         %zu\n", rcase.n_clients);
+        printf("threads:         %d\n", config.n_threads);
+        printf("repeat:          %d\n", config.repeat);
+        printf("duration_s:      %.3f\n", elapsed_s);
+        printf("sessions:        %" PRIu64 "\n", n_sessions);
+        printf("divergent:       %" PRIu64 "\n", n_divergent);
+        printf("calls:           %zu\n", n_samples);
+        printf("throughput_sps:  %.1f\n", n_sessions / elapsed_s);
+        printf("throughput_rps:  %.1f\n", n_samples / elapsed_s);
+        printf("latency_mean_us: %.1f\n", n_samples ? (double)(latency_sum / n_samples) / 1e3 : 0);
+        printf("latency_p50_us:  %.1f\n", percentile(samples, n_samples, 0.5) / 1e3);
+        printf("latency_p99_us:  %.1f\n", percentile(samples, n_samples, 0.99) / 1e3);
+        printf("latency_max_us:  %.1f\n", n_samples ? samples[n_samples - 1] / 1e3 : 0);
+        if (rcase.divergence != NULL)
+            printf("first_divergence: %s\n", rcase.divergence);
+        printf("\n");
+        total_divergent += n_divergent;
+
+        // Cleanup
+        free(samples);
+        free(threads);
+        for (size_t i=0; i<rcase.n_clients; i++)
+            free_script(&rcase.clients[i]);
+        free(rcase.clients);
+        free_script(&rcase.server);
+        free(rcase.divergence);
+        pthread_mutex_destroy(&rcase.mutex);
+    }
+
+    return total_divergent ? 1 : 0;
+}
+
+static void* replay_work(void* arg) {
+    replay_thread* rt = arg;
+    replay_case* rcase = rt->rcase;
+
+    // Threads start at different scripts so that every script runs alongside the others
+    for (int i=0; i<rt->config->repeat; i++) {
+        for (size_t j=0; j<rcase->n_clients; j++) {
+            replay_script* script = &rcase->clients[(rt->index + j) % rcase->n_clients];
+            replay_session_run(rt, script);
+        }
+    }
+    return NULL;
+}
+
+static void replay_session_run(replay_thread* rt, replay_script* script) {
+    replay_session session = {
+        .rcase = rt->rcase,
+        .script = script,
+        .line = 0,
+        .is_divergent = false,
+    };
+
+    rpc_client* clients[MAX_INSTANCES] = { NULL };
+    rpc_handle** handles = calloc(script->n_steps, sizeof(rpc_handle*));
+    int* owners = calloc(script->n_steps, sizeof(int));
+    int instance = 0;
+
+    for (size_t i=0; i<script->n_steps; i++) {
+        replay_step* step = &script->steps[i];
+        switch (step->kind) {
+            case STEP_SWITCH:
+                instance = step->instance;
+                emit(&session, "switch: instance %d", instance);
+                break;
+
+            case STEP_INIT: {
+                char* addr = rt->config->addr ? rt->config->addr : step->addr;
+                emit(&session, "rpc_init_client: instance %d, addr %s, port %d",
+                     instance, step->addr, step->port);
+                rpc_close_client(clients[instance]);
+                clients[instance] = rpc_init_client(addr, step->port + rt->config->port_offset);
+                if (clients[instance] == NULL)
+                    emit(&session, "rpc_init_client: instance %d, failed", instance);
+                break;
+            }
+
+            case STEP_FIND:
+                emit(&session, "rpc_find: instance %d, %s", instance, step->name);
+                handles[i] = rpc_find(clients[instance], step->name);
+                owners[i] = instance;
+                if (handles[i] == NULL)
+                    emit(&session, "rpc_find: instance %d, wasn't able to find function %s",
+                         instance, step->name);
+                else
+                    emit(&session, "rpc_find: instance %d, returned handle for function %s",
+                         instance, step->name);
+                break;
+
+            case STEP_CALL: {
+
+                // Calls go through the handle of the latest find on this instance
+                rpc_handle* h = NULL;
+                for (size_t j=i; j-- > 0 && h == NULL; ) {
+                    replay_step* find = &script->steps[j];
+                    if (find->kind == STEP_FIND && owners[j] == instance &&
+                        strcmp(find->name, step->name) == 0)
+                        h = handles[j];
+                }
+                replay_call(rt, &session, instance, clients[instance], h, step);
+                break;
+            }
+
+            case STEP_CLOSE:
+                emit(&session, "rpc_close_client: instance %d", instance);
+                rpc_close_client(clients[instance]);
+                clients[instance] = NULL;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    for (int i=0; i<MAX_INSTANCES; i++)
+        rpc_close_client(clients[i]);
+    for (size_t i=0; i<script->n_steps; i++)
+        free(handles[i]);
+    free(handles);
+    free(owners);
+
+    // Whatever the session didn't get round to printing is a divergence too
+    if (session.line < script->n_expected)
+        diverge(&session, "(end of output)");
+
+    rt->sessions++;
+    rt->divergent += session.is_divergent;
+}
+
+static void replay_call(replay_thread* rt, replay_session* session, int instance,
+                        rpc_client* cl, rpc_handle* h, replay_step* step) {
+    uint8_t arg2 = step->arg2;
+    char hex[65];
+    rpc_data payload = { .data1 = step->data1 };
+
+    switch (step->call) {
+        case CALL_ADD2:
+            payload.data2_len = 1;
+            payload.data2 = &arg2;
+            emit(session, "rpc_call: instance %d, calling %s, with arguments %d %d...",
+                 instance, step->name, step->data1, step->arg2);
+            break;
+
+        case CALL_SLEEP:
+            emit(session, "rpc_call: instance %d, calling %s, with argument %d...",
+                 instance, step->name, step->data1);
+            break;
+
+        case CALL_ECHO2:
+            payload.data2_len = step->data2_len;
+            payload.data2 = step->data2;
+            sha256_hex(step->data2, step->data2_len, hex);
+            emit(session, "rpc_call: instance %d, calling %s, data1 = %d, data2 sha256 = %.*s...",
+                 instance, step->name, step->data1, DIGEST_PREFIX, hex);
+            break;
+
+        // Payloads that break the protocol, which the client should refuse to send
+        case CALL_BAD_NULL:
+            break;
+
+        case CALL_BAD_DATA2_1:
+            payload.data2_len = 1;
+            break;
+
+        case CALL_BAD_DATA2_2:
+            payload.data2 = &arg2;
+            break;
+    }
+
+    uint64_t sent_ns = now_ns();
+    rpc_data* response = rpc_call(cl, h, step->call == CALL_BAD_NULL ? NULL : &payload);
+    record_latency(rt, now_ns() - sent_ns);
+
+    if (step->call == CALL_BAD_NULL || step->call == CALL_BAD_DATA2_1 ||
+        step->call == CALL_BAD_DATA2_2) {
+        emit(session, "rpc_call: instance %d, incorrect call of %s %s",
+             instance, step->name, response == NULL ? "failed" : "succeeded");
+    } else if (response == NULL) {
+        emit(session, "rpc_call: instance %d, call of %s failed", instance, step->name);
+    } else if (step->call == CALL_ECHO2) {
+        sha256_hex(response->data2, response->data2_len, hex);
+        emit(session, "rpc_call: instance %d, call of %s received data1 = %d, data2 sha256 = %.*s",
+             instance, step->name, response->data1, DIGEST_PREFIX, hex);
+    } else {
+        emit(session, "rpc_call: instance %d, call of %s received result %d",
+             instance, step->name, response->data1);
+    }
+    rpc_data_free(response);
+}
+
+static void emit(replay_session* session, char* format, ...) {
+    char line[MAX_LINE];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+
+    replay_script* script = session->script;
+    if (session->line >= script->n_expected || strcmp(line, script->expected[session->line]) != 0)
+        diverge(session, line);
+    session->line++;
+}
+
+static void diverge(replay_session* session, char* got) {
+    if (session->is_divergent)
+        return;
+    session->is_divergent = true;
+
+    // Only the first divergence of the whole case is kept, later ones are counted
+    replay_case* rcase = session->rcase;
+    replay_script* script = session->script;
+    pthread_mutex_lock(&rcase->mutex);
+    if (rcase->divergence == NULL) {
+        char* expected = session->line < script->n_expected ?
+                         script->expected[session->line] : "(end of output)";
+        if (asprintf(&rcase->divergence, "%s, output line %zu, expected \"%s\", got \"%s\"",
+                     script->path, session->line + 1, expected, got) == -1)
+            rcase->divergence = NULL;
+    }
+    pthread_mutex_unlock(&rcase->mutex);
+}
+
+static int start_servers(replay_config* config, replay_case* rcase,
+                         rpc_server** servers, pthread_t* threads, bool* is_serving) {
+    if (!rcase->has_server)
+        return -1;
+
+    int instance = 0;
+    for (size_t i=0; i<rcase->server.n_steps; i++) {
+        replay_step* step = &rcase->server.steps[i];
+        switch (step->kind) {
+            case STEP_SWITCH:
+                instance = step->instance;
+                break;
+
+            case STEP_INIT:
+                servers[instance] = rpc_init_server(step->port + config->port_offset);
+                if (servers[instance] == NULL)
+                    return -1;
+                break;
+
+            case STEP_REGISTER: {
+                unsigned flags;
+                rpc_handler handler = find_handler(step->handler, &flags);
+                if (handler == NULL ||
+                    rpc_register_ex(servers[instance], step->name, handler, flags) == -1)
+                    return -1;
+                break;
+            }
+
+            case STEP_SERVE:
+                if (servers[instance] == NULL || is_serving[instance])
+                    return -1;
+                pthread_create(&threads[instance], NULL, serve_work, servers[instance]);
+                is_serving[instance] = true;
+                break;
+
+            default:
+                return -1;
+        }
+    }
+    return 0;
+}
+
+static void* serve_work(void* arg) {
+    rpc_serve_all(arg);
+    return NULL;
+}
+
+static rpc_handler find_handler(char* name, unsigned* flags) {
+    for (size_t i=0; i<sizeof(handlers) / sizeof(handlers[0]); i++) {
+        if (strcmp(handlers[i].name, name) == 0) {
+            *flags = handlers[i].flags;
+            return handlers[i].handler;
+        }
+    }
+    return NULL;
+}
+
+static bool load_case(char* dir, replay_case* rcase) {
+    memset(rcase, 0, sizeof(replay_case));
+    rcase->dir = dir;
+    pthread_mutex_init(&rcase->mutex, NULL);
+
+    char path[MAX_LINE];
+    snprintf(path, sizeof(path), "%s/client*.in", dir);
+    glob_t found;
+    if (glob(path, 0, NULL, &found) != 0)
+        return false;
+
+    rcase->n_clients = found.gl_pathc;
+    rcase->clients = calloc(found.gl_pathc, sizeof(replay_script));
+    bool is_loaded = true;
+    for (size_t i=0; i<found.gl_pathc && is_loaded; i++)
+        is_loaded = load_script(found.gl_pathv[i], &rcase->clients[i]);
+    globfree(&found);
+
+    snprintf(path, sizeof(path), "%s/server.in", dir);
+    if (is_loaded && access(path, R_OK) == 0)
+        is_loaded = rcase->has_server = load_script(path, &rcase->server);
+    return is_loaded;
+}
+
+static bool load_script(char* path, replay_script* script) {
+    script->path = strdup(path);
+    FILE* file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    char buffer[MAX_LINE];
+    bool is_parsed = true;
+    for (char* line; is_parsed && (line = read_line(file, buffer)) != NULL; ) {
+        if (*line == '\0')
+            continue;
+        script->steps = realloc(script->steps, (script->n_steps + 1) * sizeof(replay_step));
+        replay_step* step = &script->steps[script->n_steps++];
+        memset(step, 0, sizeof(replay_step));
+        is_parsed = parse_step(line, file, step);
+    }
+    fclose(file);
+    if (!is_parsed) {
+        fprintf(stderr, "%s: bad command after line %zu\n", path, script->n_steps);
+        return false;
+    }
+
+    // The expected output sits next to the script, missing only for servers
+    char out_path[MAX_LINE];
+    snprintf(out_path, sizeof(out_path), "%.*s.out", (int)(strlen(path) - 3), path);
+    file = fopen(out_path, "r");
+    if (file == NULL)
+        return true;
+    for (char* line; (line = read_line(file, buffer)) != NULL; ) {
+        script->expected = realloc(script->expected, (script->n_expected + 1) * sizeof(char*));
+        script->expected[script->n_expected++] = strdup(line);
+    }
+    fclose(file);
+    return true;
+}
+
+static bool parse_step(char* line, FILE* file, replay_step* step) {
+    char command[32], first[256], second[256];
+    int n_fields = sscanf(line, "%31s %255s %255s", command, first, second);
+
+    if (strcmp(command, "init") == 0 && n_fields == 3) {
+        step->kind = STEP_INIT;
+        step->addr = strdup(first);
+        step->port = atoi(second);
+    } else if (strcmp(command, "init") == 0 && n_fields == 2) {
+        step->kind = STEP_INIT;
+        step->port = atoi(first);
+    } else if (strcmp(command, "find") == 0 && n_fields >= 2) {
+        step->kind = STEP_FIND;
+        step->name = strdup(first);
+    } else if (strcmp(command, "register") == 0 && n_fields == 3) {
+        step->kind = STEP_REGISTER;
+        step->name = strdup(first);
+        step->handler = strdup(second);
+    } else if (strcmp(command, "switch") == 0 && n_fields >= 2) {
+        step->kind = STEP_SWITCH;
+        step->instance = atoi(first);
+        return step->instance >= 0 && step->instance < MAX_INSTANCES;
+    } else if (strcmp(command, "serve") == 0) {
+        step->kind = STEP_SERVE;
+    } else if (strcmp(command, "close") == 0) {
+        step->kind = STEP_CLOSE;
+    } else if (strcmp(command, "call") == 0 && n_fields == 3) {
+        step->kind = STEP_CALL;
+        step->name = strdup(second);
+
+        // The first word says how to build the payload, from the lines that follow
+        char buffer[MAX_LINE];
+        if (strncmp(first, "add2", 4) == 0) {
+            step->call = CALL_ADD2;
+            char* args = read_line(file, buffer);
+            return args != NULL && sscanf(args, "%d %d", &step->data1, &step->arg2) == 2;
+        } else if (strcmp(first, "sleep") == 0) {
+            step->call = CALL_SLEEP;
+            char* args = read_line(file, buffer);
+            return args != NULL && sscanf(args, "%d", &step->data1) == 1;
+        } else if (strcmp(first, "echo2") == 0) {
+            step->call = CALL_ECHO2;
+            char* args = read_line(file, buffer);
+            if (args == NULL || sscanf(args, "%d %zu", &step->data1, &step->data2_len) != 2)
+                return false;
+
+            // data2 is the next line, padded with zeroes if it falls short
+            char* bytes = read_line(file, buffer);
+            if (bytes == NULL)
+                return false;
+            step->data2 = step->data2_len ? calloc(1, step->data2_len) : NULL;
+            size_t len = strlen(bytes);
+            if (step->data2_len)
+                memcpy(step->data2, bytes, len < step->data2_len ? len : step->data2_len);
+        } else if (strcmp(first, "bad_null") == 0) {
+            step->call = CALL_BAD_NULL;
+        } else if (strcmp(first, "bad_data2_1") == 0) {
+            step->call = CALL_BAD_DATA2_1;
+        } else if (strcmp(first, "bad_data2_2") == 0) {
+            step->call = CALL_BAD_DATA2_2;
+        } else {
+            return false;
+        }
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static char* read_line(FILE* file, char* buffer) {
+    if (fgets(buffer, MAX_LINE, file) == NULL)
+        return NULL;
+    buffer[strcspn(buffer, "\r\n")] = '\0';
+    return buffer;
+}
+
+static void free_script(replay_script* script) {
+    for (size_t i=0; i<script->n_steps; i++) {
+        free(script->steps[i].name);
+        free(script->steps[i].handler);
+        free(script->steps[i].addr);
+        free(script->steps[i].data2);
+    }
+    for (size_t i=0; i<script->n_expected; i++)
+        free(script->expected[i]);
+    free(script->steps);
+    free(script->expected);
+    free(script->path);
+}
+
+/* Adds 2 signed 8 bit numbers, data1 and the single byte of data2 */
+static rpc_data* add2_i8(rpc_data* in) {
+    if (in->data2 == NULL || in->data2_len != 1)
+        return NULL;
+
+    rpc_data* out = rpc_data_alloc();
+    out->data1 = (int8_t)in->data1 + ((int8_t*)in->data2)[0];
+    return out;
+}
+
+/* As add2_i8, but with all of data1 */
+static rpc_data* add2_2(rpc_data* in) {
+    if (in->data2 == NULL || in->data2_len != 1)
+        return NULL;
+
+    rpc_data* out = rpc_data_alloc();
+    out->data1 = in->data1 + ((int8_t*)in->data2)[0];
+    return out;
+}
+
+/* Sleeps for data1 seconds and returns it */
+static rpc_data* sleep2(rpc_data* in) {
+    sleep(in->data1);
+    rpc_data* out = rpc_data_alloc();
+    out->data1 = in->data1;
+    return out;
+}
+
+static rpc_data* echo2(rpc_data* in) {
+    rpc_data* out = rpc_data_alloc();
+    out->data1 = in->data1;
+    out->data2_len = in->data2_len;
+    if (in->data2_len) {
+        out->data2 = rpc_buf_alloc(in->data2_len);
+        memcpy(out->data2, in->data2, in->data2_len);
+    }
+    return out;
+}
+
+static rpc_data* bad_null(rpc_data* in) {
+    return NULL;
+}
+
+/* Claims a byte of data2 without one */
+static rpc_data* bad_data2_1(rpc_data* in) {
+    rpc_data* out = rpc_data_alloc();
+    out->data2_len = 1;
+    return out;
+}
+
+/* Hands back data2 with a length of zero */
+static rpc_data* bad_data2_2(rpc_data* in) {
+    rpc_data* out = rpc_data_alloc();
+    out->data2 = rpc_buf_alloc(1);
+    return out;
+}
+
+static void sha256_hex(uint8_t* data, size_t len, char* hex) {
+    static const uint32_t k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+    };
+    uint32_t h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    #define ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+    // The message is followed by a single set bit, zeroes and its length in bits
+    size_t n_blocks = (len + 9 + 63) / 64;
+    for (size_t block=0; block<n_blocks; block++) {
+        uint8_t chunk[64];
+        for (size_t i=0; i<64; i++) {
+            size_t pos = block * 64 + i;
+            if (pos < len)
+                chunk[i] = data[pos];
+            else if (pos == len)
+                chunk[i] = 0x80;
+            else if (pos >= n_blocks * 64 - 8)
+                chunk[i] = (uint64_t)len * 8 >> (8 * (n_blocks * 64 - 1 - pos));
+            else
+                chunk[i] = 0;
+        }
+
+        uint32_t w[64];
+        for (int i=0; i<16; i++)
+            w[i] = (uint32_t)chunk[4*i] << 24 | chunk[4*i + 1] << 16 | chunk[4*i + 2] << 8 | chunk[4*i + 3];
+        for (int i=16; i<64; i++) {
+            uint32_t s0 = ROTR(w[i-15], 7) ^ ROTR(w[i-15], 18) ^ (w[i-15] >> 3);
+            uint32_t s1 = ROTR(w[i-2], 17) ^ ROTR(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16] + s0 + w[i-7] + s1;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], f = h[5], g = h[6], hh = h[7];
+        for (int i=0; i<64; i++) {
+            uint32_t t1 = hh + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            hh = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+        h[4] += e; h[5] += f; h[6] += g; h[7] += hh;
+    }
+    #undef ROTR
+
+    for (int i=0; i<8; i++)
+        sprintf(hex + 8*i, "%08x", h[i]);
+}
+
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void record_latency(replay_thread* rt, uint64_t latency_ns) {
+    if (rt->n_latencies == rt->capacity) {
+        rt->capacity = rt->capacity ? rt->capacity * 2 : 4096;
+        rt->latencies = realloc(rt->latencies, rt->capacity * sizeof(uint64_t));
+    }
+    rt->latencies[rt->n_latencies++] = latency_ns;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static uint64_t percentile(uint64_t* sorted, size_t count, double fraction) {
+    if (count == 0)
+        return 0;
+    size_t rank = (size_t)(fraction * count);
+    return sorted[rank < count ? rank : count - 1];
+}
+
+static void usage(char* prog) {
+    fprintf(stderr,
+        "usage: %s [options] case_dir...\n"
+        "  -a addr   connect here instead of the address in the scripts\n"
+        "  -o n      add n to every port in the scripts (default 0)\n"
+        "  -t n      number of threads, each playing every client script (default 1)\n"
+        "  -n n      times each thread plays each script (default 1)\n"
+        "  -S        serve each case's server.in from this process as well\n",
+        prog);
+}
@@ -0,0 +1,62 @@
+/**
+ * A bump allocator for memory that all dies at once. Each worker owns one, handlers
+ * allocate their results from it through rpc_data_alloc() and rpc_buf_alloc(), and
+ * the worker resets it once the reply is built. Allocating is then a pointer bump
+ * on memory that belongs to the thread, with no locking in malloc, and resetting
+ * gives everything back in one go while keeping the first block around for the
+ * next call.
+*/
+
+#ifndef ARENA_H
+#define ARENA_H
+
+#include "defines.h"
+
+// Size of the block kept between resets, larger allocations get their own block
+#define ARENA_BLOCK_SIZE 65536
+
+// Every allocation is aligned to this, enough for any scalar type
+#define ARENA_ALIGNMENT 16
+
+typedef struct arena_block arena_block;
+struct arena_block {
+    arena_block* next;
+    size_t size;
+    size_t used;
+    _Alignas(ARENA_ALIGNMENT) uint8_t data[];
+};
+
+typedef struct arena {
+
+    // Newest block first, so the first block is always at the tail
+    arena_block* blocks;
+} arena;
+
+/**
+ * @brief
+ * Allocates and creates an arena. Ensure to destroy this with arena_destroy().
+ * @return NULL if the memory could not be allocated
+*/
+arena* arena_create(void);
+
+// Destroys the arena along with everything allocated from it
+void arena_destroy(arena* ar);
+
+/**
+ * @brief
+ * Allocates memory from the arena. It can't be freed on its own, only all at once
+ * by arena_reset()
+ * @param ar Arena to allocate from
+ * @param size Number of bytes
+ * @return
+ * Memory aligned to ARENA_ALIGNMENT, or NULL if it could not be allocated.
+*/
+void* arena_alloc(arena* ar, size_t size);
+
+// Whether the memory was allocated from the arena since it was last reset
+bool arena_owns(arena* ar, void* ptr);
+
+// Frees everything allocated from the arena
+void arena_reset(arena* ar);
+
+#endif
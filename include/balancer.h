@@ -0,0 +1,75 @@
+/**
+ * Choosing which of several identical servers a client sends each request to.
+ * The balancer only keeps the books: how many requests each backend has
+ * outstanding and how often it has failed lately. Connecting and sending is left
+ * to whoever owns the backends.
+ *
+ * A backend that fails BALANCER_MAX_FAILURES times in a row is ejected, and not
+ * picked again until its ejection runs out. Each ejection in a row lasts twice as
+ * long as the last, and a single success clears the backend's record.
+*/
+
+#ifndef BALANCER_H
+#define BALANCER_H
+
+#include "defines.h"
+#include "rpc_ext.h"
+
+#include <pthread.h>
+
+// Consecutive failures after which a backend is ejected
+#define BALANCER_MAX_FAILURES 3
+
+// How long the first ejection of a backend lasts, and the longest any may last
+#define BALANCER_EJECT_BASE_NS 1000000000ULL
+#define BALANCER_EJECT_MAX_NS 30000000000ULL
+
+// Passed to balancer_pick() when there is no backend to avoid
+#define BALANCER_NO_BACKEND SIZE_MAX
+
+typedef struct balancer_backend {
+    size_t n_outstanding;
+    unsigned n_failures;
+    unsigned n_ejections;
+    uint64_t ejected_until_ns;
+} balancer_backend;
+
+typedef struct balancer {
+    pthread_mutex_t mutex;
+    unsigned policy;
+    size_t n_backends;
+    balancer_backend* backends;
+
+    // Where round robin continues from, and the state of the random picks
+    size_t next;
+    unsigned seed;
+} balancer;
+
+/**
+ * @brief
+ * Allocates and creates a balancer. Ensure to destroy this with balancer_destroy().
+ * @param n_backends Number of backends to choose between, must be at least 1
+ * @param policy One of the RPC_BALANCE_* policies
+*/
+balancer* balancer_create(size_t n_backends, unsigned policy);
+
+// Destroys the balancer
+void balancer_destroy(balancer* bal);
+
+/**
+ * @brief
+ * Picks the backend to send the next request to, and counts the request as
+ * outstanding on it. Ejected backends are only picked if every backend is ejected
+ * @param bal Balancer of the client
+ * @param avoid Backend to pass over if there is any other choice, such as one that
+ * just failed the same request, or BALANCER_NO_BACKEND
+ * @return
+ * Index of the backend. Report the outcome with balancer_done().
+*/
+size_t balancer_pick(balancer* bal, size_t avoid);
+
+// Finishes a request sent to the backend picked by balancer_pick(). Failures
+// are counted towards ejecting the backend
+void balancer_done(balancer* bal, size_t index, bool is_failure);
+
+#endif
@@ -0,0 +1,72 @@
+/**
+ * A growable byte buffer for building up a packet in memory so that it can be sent
+ * with a single write, and for parsing a packet that has already been read in. All
+ * multi-byte values are written and read in network byte order, apart from varints,
+ * which are written 7 bits at a time starting from the least significant.
+*/
+
+#ifndef BUFFER_H
+#define BUFFER_H
+
+#include "defines.h"
+
+#define BUFFER_DEFAULT_CAPACITY 64
+
+// A 64-bit value takes at most this many bytes as a varint
+#define BUFFER_VARINT_MAX 10
+
+typedef struct byte_buffer {
+    uint8_t* data;
+    size_t len;
+    size_t capacity;
+    size_t read_pos;
+} byte_buffer;
+
+/**
+ * @brief
+ * Initialises an empty buffer. Ensure to deinitialise this buffer with
+ * buffer_deinit() when you're done with it.
+ * @param pBuf Pointer to buffer
+*/
+void buffer_init(byte_buffer* pBuf);
+
+/**
+ * @brief
+ * Frees the memory used by the buffer and zeroes it.
+ * @param pBuf Pointer to buffer
+*/
+void buffer_deinit(byte_buffer* pBuf);
+
+/**
+ * @brief
+ * Empties the buffer without giving back its memory.
+ * @param pBuf Pointer to buffer
+*/
+void buffer_clear(byte_buffer* pBuf);
+
+/**
+ * @brief
+ * Makes sure at least nbytes more can be written without reallocating.
+ * @param pBuf Pointer to buffer
+ * @param nbytes Number of bytes
+*/
+void buffer_reserve(byte_buffer* pBuf, size_t nbytes);
+
+// Appends values to the end of the buffer
+void buffer_put_bytes(byte_buffer* pBuf, const void* bytes, size_t nbytes);
+void buffer_put_u8(byte_buffer* pBuf, uint8_t value);
+void buffer_put_u16(byte_buffer* pBuf, uint16_t value);
+void buffer_put_u32(byte_buffer* pBuf, uint32_t value);
+void buffer_put_u64(byte_buffer* pBuf, uint64_t value);
+void buffer_put_varint(byte_buffer* pBuf, uint64_t value);
+
+// Reads values starting at the read position of the buffer
+// Returns whether or not there were enough bytes left to read
+bool buffer_get_bytes(byte_buffer* pBuf, void* bytes, size_t nbytes);
+bool buffer_get_u8(byte_buffer* pBuf, uint8_t* value);
+bool buffer_get_u16(byte_buffer* pBuf, uint16_t* value);
+bool buffer_get_u32(byte_buffer* pBuf, uint32_t* value);
+bool buffer_get_u64(byte_buffer* pBuf, uint64_t* value);
+bool buffer_get_varint(byte_buffer* pBuf, uint64_t* value);
+
+#endif
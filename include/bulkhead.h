@@ -0,0 +1,49 @@
+/**
+ * Per-function concurrency limits. A bulkhead lets a fixed number of calls to a
+ * function run at once and parks a bounded number more until one of them finishes.
+ * Anything past that is turned away, so a slow function can only ever tie up
+ * max_active + max_waiting threads and the rest of the server keeps serving.
+*/
+
+#ifndef BULKHEAD_H
+#define BULKHEAD_H
+
+#include "defines.h"
+
+#include <pthread.h>
+
+typedef struct bulkhead {
+    pthread_mutex_t mutex;
+    pthread_cond_t slot_cond;
+    size_t max_active;
+    size_t max_waiting;
+    size_t n_active;
+    size_t n_waiting;
+} bulkhead;
+
+/**
+ * @brief
+ * Allocates and creates a bulkhead. Ensure to destroy this with bulkhead_destroy().
+ * @param max_active Number of calls allowed to run at once, must be at least 1
+ * @param max_waiting Number of calls allowed to wait for one of those to finish
+*/
+bulkhead* bulkhead_create(size_t max_active, size_t max_waiting);
+
+// Destroys the bulkhead. No calls may be inside of it
+void bulkhead_destroy(bulkhead* bh);
+
+/**
+ * @brief
+ * Takes a slot in the bulkhead, waiting for one if they are all taken and
+ * there is still room to wait
+ * @param bh Bulkhead of the function being called, may be NULL
+ * @return
+ * true if a slot was taken, which must be given back with bulkhead_leave().
+ * false if the call was turned away.
+*/
+bool bulkhead_enter(bulkhead* bh);
+
+// Gives back a slot taken by bulkhead_enter()
+void bulkhead_leave(bulkhead* bh);
+
+#endif
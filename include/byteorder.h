@@ -0,0 +1,30 @@
+/**
+ * Bulk byte swapping of arrays, for typed array payloads. The widest kernel the CPU
+ * supports is picked the first time it is needed (AVX2, then SSSE3, then plain
+ * bswap instructions), so one binary runs everywhere and still gets the vector
+ * kernels on machines that have them.
+*/
+
+#ifndef BYTEORDER_H
+#define BYTEORDER_H
+
+#include "defines.h"
+#include "rpc_types.h"
+
+// Byte order of this machine, as advertised during the handshake
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define RPC_ORDER_NATIVE RPC_ORDER_BIG
+#else
+#define RPC_ORDER_NATIVE RPC_ORDER_LITTLE
+#endif
+
+/**
+ * @brief
+ * Reverses the bytes of every element of an array, in place
+ * @param data Start of the array, needs no particular alignment
+ * @param count Number of elements in the array
+ * @param width Size of each element in bytes, one of 2, 4 or 8
+*/
+void byteorder_swap(void* data, size_t count, unsigned width);
+
+#endif
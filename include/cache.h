@@ -0,0 +1,60 @@
+/**
+ * Bounded LRU cache of function results, for functions registered as pure. The cache
+ * is split into shards that each have their own lock and their own share of the
+ * bounds, so concurrent calls to different inputs rarely wait on each other.
+ *
+ * Entries are keyed on the function hash, data1 and a hash of data2, but a copy of
+ * data2 is kept as well so a hash collision can never return the wrong result.
+*/
+
+#ifndef CACHE_H
+#define CACHE_H
+
+#include "defines.h"
+#include "rpc.h"
+
+#define CACHE_NUM_SHARDS 16
+#define CACHE_DEFAULT_MAX_ENTRIES 4096
+#define CACHE_DEFAULT_MAX_BYTES (64 * 1024 * 1024)
+
+typedef struct result_cache result_cache;
+
+/**
+ * @brief
+ * Allocates and creates a result cache. Ensure to destroy this cache with
+ * cache_destroy().
+ * @param max_entries Maximum number of results kept
+ * @param max_bytes Maximum number of data2 bytes kept, inputs and outputs included
+*/
+result_cache* cache_create(size_t max_entries, size_t max_bytes);
+
+// Destroys the cache and every result inside of it
+void cache_destroy(result_cache* cache);
+
+/**
+ * @brief
+ * Looks up the result of calling the given function on the given input
+ * @param cache Pointer to cache
+ * @param func_hash Hash of the function that was called
+ * @param input Input given to the function
+ * @return
+ * A heap allocated copy of the result, to be freed with rpc_data_free(), or NULL
+ * if the result is not cached.
+*/
+rpc_data* cache_lookup(result_cache* cache, uint64_t func_hash, rpc_data* input);
+
+/**
+ * @brief
+ * Stores a copy of the result of calling the given function on the given input,
+ * evicting the least recently used results of the shard if it is full
+ * @param cache Pointer to cache
+ * @param func_hash Hash of the function that was called
+ * @param input Input given to the function
+ * @param output Output returned by the function
+*/
+void cache_insert(result_cache* cache, uint64_t func_hash, rpc_data* input, rpc_data* output);
+
+// Drops every result of the given function, for when it has been replaced
+void cache_invalidate(result_cache* cache, uint64_t func_hash);
+
+#endif
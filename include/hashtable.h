@@ -9,13 +9,28 @@
 
 #include "rpc.h"
 #include "defines.h"
+#include "rpc_ext.h"
+#include "stats.h"
+#include "bulkhead.h"
 
 #define DEFAULT_CAPACITY 10
 #define RESIZE_FACTOR 2
 
-typedef struct hash_item hash_item;
 typedef struct hash_table hash_table;
 
+// A registered function. Everything but the handler is owned by the hashtable
+// and survives the handler being replaced
+typedef struct hash_item {
+    uint64_t hash_value;
+    rpc_handler handler;
+    rpc_async_handler async_handler;
+    rpc_stream_handler stream_handler;
+    char* name;
+    func_stats* stats;
+    bulkhead* bulkhead;
+    uint32_t flags;
+} hash_item;
+
 /**
  * @brief
  * Allocates and creates a hashtable.
@@ -38,12 +53,16 @@ void _ht_destroy(hash_table** ppHt);
  * Inserts a new string-handler pair into the given hashtable
  * @param pHt Pointer to a hashtable
  * @param string Null-terminated string
- * @param handler Function linked to the given string
+ * @param handler Function linked to the given string, NULL for functions that
+ * are given an async or stream handler instead
+ * @return
+ * Pointer to the item linked to the string, or NULL if nothing was inserted.
+ * The pointer is invalidated by the next ht_insert() or ht_delete().
  * @note
  * If the string already exists inside the hashtable, the given handler
  * will replace the previous handler linked to the string.
 */
-void ht_insert(hash_table* pHt, char* string, rpc_handler handler);
+hash_item* ht_insert(hash_table* pHt, char* string, rpc_handler handler);
 
 /**
  * @brief
@@ -90,6 +109,28 @@ uint64_t ht_retrieve_hash(hash_table* pHt, rpc_handler handler);
 */
 rpc_handler ht_index_with_hash(hash_table* pHt, uint64_t hash_value);
 
+/**
+ * @brief
+ * Retrieves the registered function linked to the given hash
+ * @param pHt Pointer to a hashtable
+ * @param hash_value 64-bit hash
+ * @return
+ * If the hash is linked to a function, this function will return a pointer to it.
+ * Otherwise, this function will return NULL.
+ * @note
+ * The pointer is invalidated by the next ht_insert() or ht_delete().
+*/
+hash_item* ht_find_with_hash(hash_table* pHt, uint64_t hash_value);
+
+// Same as ht_find_with_hash(), but using the name of the function
+hash_item* ht_find(hash_table* pHt, char* string);
+
+// Number of functions stored in the hashtable
+size_t ht_count(hash_table* pHt);
+
+// Retrieves the index-th function stored in the hashtable, for iterating
+hash_item* ht_item_at(hash_table* pHt, size_t index);
+
 // Creates hashtable with default capacity
 #define ht_create() _ht_create(DEFAULT_CAPACITY)
 
@@ -4,6 +4,8 @@
 #include "defines.h"
 #include "rpc.h"
 #include "rpc_types.h"
+#include "buffer.h"
+#include "byteorder.h"
 
 /**
  * This header contains many miscellaneous functions and macros that make coding a whole 
@@ -15,6 +17,10 @@
 #define hton64(host64) htobe64(host64)
 #define ntoh64(net64) be64toh(net64) 
 
+// Maps signed values onto unsigned ones so that small negatives stay small as varints
+#define zigzag_encode(value) (((uint64_t)(value) << 1) ^ (uint64_t)((int64_t)(value) >> 63))
+#define zigzag_decode(value) ((int64_t)((value) >> 1) ^ -(int64_t)((value) & 1))
+
 // For calculating interger limits
 #define MAX_SINT(nbytes) (1ULL << (8*nbytes - 1)) - 1
 #define MAX_UINT(nbytes) nbytes < 8 ? (1ULL << 8*nbytes) - 1 : UINT64_MAX
@@ -42,6 +48,10 @@ char* int_to_string(int integer);
 // Returns whether or not this procedure was succesful
 bool socket_recv(int fd, void* buff, size_t nbytes);
 
+// Reads in a varint laid out the same way buffer_put_varint() writes it
+// Returns whether or not this procedure was succesful
+bool socket_recv_varint(int fd, uint64_t* value);
+
 // Wrapper around send()
 // Returns whether or not this procedure was succesful
 bool socket_send(int fd, void* buff, size_t nbytes);
@@ -54,11 +64,112 @@ rpc_data_flags gen_data_flags(rpc_data* data);
 // if *output is NULL, this function has failed terribly
 bool socket_recv_data(int fd, rpc_data** output);
 
+// Asked with the length of data2 before any memory is set aside for it. If
+// fn returns false, data2 is skipped over rather than read in and is_refused
+// is set, so the rest of the packet can still be read
+typedef struct data_admit {
+    bool (*fn)(void* arg, uint64_t data2_len);
+    void* arg;
+    bool is_refused;
+} data_admit;
+
+// Same as socket_recv_data(), but also hands back the data flags it was sent with.
+// admit may be NULL, otherwise *output is left NULL if it refuses data2
+bool socket_recv_data_flags(int fd, rpc_data** output, rpc_data_flags* flags, data_admit* admit);
+
+// Same as socket_recv_data_flags(), but parses the rpc_data out of a buffer
+// that has already been read in, starting at its read position
+bool buffer_get_data_flags(byte_buffer* pBuf, rpc_data** output, rpc_data_flags* flags, 
+                           data_admit* admit);
+
+// Same as socket_recv_data_flags() and buffer_get_data_flags(), but fills in the
+// given rpc_data instead of allocating one. data2 is read into *buff, which is
+// grown to fit with realloc() when it holds less than *capacity bytes, so a
+// buffer that is reused stops being reallocated once it's big enough
+bool socket_recv_data_into(int fd, rpc_data* output, rpc_data_flags* flags, 
+                           void** buff, size_t* capacity, data_admit* admit);
+bool buffer_get_data_into(byte_buffer* pBuf, rpc_data* output, rpc_data_flags* flags, 
+                          void** buff, size_t* capacity, data_admit* admit);
+
 // Sends in an rpc_data through the given socket
 // Returns whether or not this procedure was succesful
 bool socket_send_data(int fd, rpc_data* input);
 
+// Appends an rpc_data to the given buffer, laid out the same way socket_send_data()
+// would send it
+void buffer_put_data(byte_buffer* pBuf, rpc_data* input);
+
+/**
+ * @brief
+ * Appends an rpc_data whose data2 is an array of elements in native byte order. 
+ * Peers that negotiated RPC_CAP_TYPED_ARRAY receive the elements untouched along with
+ * their width, everyone else receives them in network byte order as a plain buffer.
+ * Peers that negotiated RPC_CAP_VARINT receive data1 and data2_len as varints.
+ * @param pBuf Buffer to append to
+ * @param input Data to append
+ * @param width Size of each element of data2 in bytes, 0 if data2 is not an array
+ * @param peer Profile of the receiving end
+*/
+void buffer_put_array(byte_buffer* pBuf, rpc_data* input, unsigned width, hw_profile* peer);
+
+/**
+ * @brief
+ * Puts the elements of a received array into native byte order, in place
+ * @param data Data read in by socket_recv_data_flags()
+ * @param flags Data flags it was sent with
+ * @param width Size of each element of data2 in bytes, 0 if data2 is not an array
+ * @param peer Profile of the sending end
+ * @return
+ * false if data2 does not hold whole elements of the expected width
+*/
+bool data_array_to_native(rpc_data* data, rpc_data_flags flags, unsigned width, hw_profile* peer);
+
+// Checks data2 holds a whole number of width-byte elements
+rpc_error check_array(rpc_data* data, unsigned width);
+
+// Converts between element widths and the RPC_DATA_ARRAY* flags
+rpc_data_flags array_data_flag(unsigned width);
+unsigned array_flag_width(rpc_data_flags flags);
+
 // Scans the data for any possible issues
 rpc_error check_data(hw_profile* profile, rpc_data* data);
 
+// Fixed header in front of every v2 frame, see RPC_CAP_FRAMES
+typedef struct rpc_frame_header {
+    rpc_message type;
+    uint16_t flags;
+    uint32_t request_id;
+    uint64_t body_len;
+} rpc_frame_header;
+
+// Converts a frame header to and from the bytes sent over the wire. Decoding
+// fails if the bytes do not start with RPC_MSG_FRAME
+void frame_header_encode(rpc_frame_header* header, uint8_t bytes[RPC_FRAME_HEADER_SIZE]);
+bool frame_header_decode(uint8_t bytes[RPC_FRAME_HEADER_SIZE], rpc_frame_header* header);
+
+/**
+ * @brief
+ * Sends a frame header followed by its body, in a single write where possible
+ * @param fd Socket to send the frame through
+ * @param header Header of the frame, body_len bytes of body are sent after it
+ * @param body Body of the frame
+ * @return
+ * Whether or not this procedure was succesful
+*/
+bool socket_send_frame(int fd, rpc_frame_header* header, void* body);
+
+// Replaces the contents of the buffer with the next nbytes read from the socket.
+// Returns false without reading anything if the memory can't be found for them
+bool socket_recv_buffer(int fd, byte_buffer* pBuf, size_t nbytes);
+
+// Reads in and throws away the next nbytes, a little at a time
+bool socket_skip(int fd, uint64_t nbytes);
+
+// Whether something can be read from the socket straight away, including
+// the peer hanging up
+bool socket_is_readable(int fd);
+
+// Fills in the profile of this machine
+void init_local_profile(hw_profile* profile);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+/**
+ * An elastic pool of threads for work that blocks. A thread is started whenever work
+ * arrives and every existing thread is busy, up to a limit, and exits again once it
+ * has sat idle for a while. A burst of slow calls gets as many threads as it needs
+ * without the threads that serve connections ever waiting on them, and without those
+ * threads being kept around once the burst is over.
+*/
+
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include "defines.h"
+#include "linked_list.h"
+
+#include <pthread.h>
+
+// Default bound on the number of threads
+#define OFFLOAD_DEFAULT_MAX_THREADS 64
+
+// How long a thread waits for more work before exiting
+#define OFFLOAD_IDLE_TIMEOUT_NS 5000000000ULL
+
+typedef void (*offload_fn)(void* arg);
+
+typedef struct offload_pool {
+    pthread_mutex_t mutex;
+    pthread_cond_t task_cond;
+    pthread_cond_t done_cond;
+    size_t max_threads;
+    size_t n_threads;
+    size_t n_idle;
+    bool is_closing;
+
+    // Work not yet picked up by a thread, oldest at the head
+    list* tasks;
+    size_t n_tasks;
+} offload_pool;
+
+/**
+ * @brief
+ * Allocates and creates a pool with no threads. Ensure to destroy this with
+ * offload_destroy().
+ * @param max_threads Number of threads allowed to run at once, must be at least 1
+*/
+offload_pool* offload_create(size_t max_threads);
+
+// Runs everything that was submitted, then destroys the pool once its threads exit
+void offload_destroy(offload_pool* pool);
+
+/**
+ * @brief
+ * Runs fn(arg) on a thread of the pool, starting a thread for it if none are
+ * idle and the pool is not at its limit. Otherwise it queues until a thread
+ * frees up, unless as many tasks as the pool has threads are already queued.
+ * @param pool Pool to run the work on
+ * @param fn Work to run
+ * @param arg Handed to fn as is
+ * @return false if the work was not taken, in which case the caller should run
+ * it itself
+*/
+bool offload_submit(offload_pool* pool, offload_fn fn, void* arg);
+
+// Waits until everything submitted so far has finished running
+void offload_wait(offload_pool* pool);
+
+#endif
@@ -0,0 +1,43 @@
+/**
+ * Consistent hashing of keys onto servers. Every server is placed on a ring of
+ * 64-bit hashes at RING_VNODES points, derived from its address rather than its
+ * position in the list, and a key belongs to the server at the first point at or
+ * after the hash of the key. Adding a server to a list of N therefore only moves
+ * the keys landing just before its points, about 1/(N+1) of them, and many points
+ * per server keep each server's share close to even.
+*/
+
+#ifndef RING_H
+#define RING_H
+
+#include "defines.h"
+
+// Points each server is placed at
+#define RING_VNODES 128
+
+typedef struct ring_point {
+    uint64_t hash;
+    size_t index;
+} ring_point;
+
+typedef struct hash_ring {
+    size_t n_points;
+    ring_point* points;
+} hash_ring;
+
+/**
+ * @brief
+ * Allocates and creates a ring. Ensure to destroy this with ring_destroy().
+ * @param addrs Address of each server
+ * @param ports Port of each server
+ * @param count Number of servers, must be at least 1
+*/
+hash_ring* ring_create(char** addrs, int* ports, size_t count);
+
+// Destroys the ring
+void ring_destroy(hash_ring* ring);
+
+// Finds the index of the server that owns the key
+size_t ring_lookup(hash_ring* ring, uint64_t key);
+
+#endif
@@ -0,0 +1,359 @@
+/* Extensions to the RPC system */
+/* rpc.h is fixed by the project spec, so anything beyond it is declared here */
+
+#ifndef RPC_EXT_H
+#define RPC_EXT_H
+
+#include "rpc.h"
+#include <stdint.h>
+
+/* Number of error counters kept per function, one for each RPC_ERROR_* bit */
+#define RPC_STATS_NUM_ERRORS 16
+
+/* Counters and latency percentiles of a single registered function */
+/* Calls that did not resolve to a registered function have an empty name */
+typedef struct {
+    char* name;
+    uint64_t calls;
+    uint64_t bytes_in;
+    uint64_t bytes_out;
+    uint64_t errors[RPC_STATS_NUM_ERRORS];
+    uint64_t cache_hits;
+    uint64_t cache_misses;
+    uint64_t latency_mean_ns;
+    uint64_t latency_p50_ns;
+    uint64_t latency_p90_ns;
+    uint64_t latency_p99_ns;
+    uint64_t latency_p999_ns;
+    uint64_t latency_max_ns;
+} rpc_stats;
+
+/* How busy a server is. Rejections are totals, the rest are current values */
+typedef struct {
+    uint64_t queued_clients;    /* Connections accepted but waiting for a thread */
+    uint64_t inflight_calls;    /* Calls currently being served */
+    uint64_t rejected_clients;  /* Connections turned away because the queue was full */
+    uint64_t rejected_calls;    /* Calls turned away because too many were in flight */
+    uint64_t inbound_bytes;     /* Memory held by requests read in but not yet answered */
+    uint64_t rejected_payloads; /* Requests turned away for not fitting the memory budget */
+} rpc_load;
+
+/* Flags for rpc_register_ex, describing a registered function */
+#define RPC_FUNC_PURE 0x1       /* Output depends only on the input, results may be cached */
+#define RPC_FUNC_INTERACTIVE 0x2    /* Latency sensitive, served first when the server is busy */
+#define RPC_FUNC_BULK 0x4       /* Expensive or batch work, served last when the server is busy */
+
+/* data2 of both the input and output is an array of 16, 32 or 64-bit elements */
+/* (integers or doubles) in native byte order. Clients learn this when they */
+/* find the function and convert their payloads to match, so neither end */
+/* writes its own byte swapping. Conversion is skipped when both ends share */
+/* the same byte order */
+#define RPC_FUNC_ARRAY16 0x8
+#define RPC_FUNC_ARRAY32 0x10
+#define RPC_FUNC_ARRAY64 0x20
+
+/* Running the function twice with the same input does no more than running */
+/* it once, so clients may send the call again if the connection drops before */
+/* the reply arrives. Implied by RPC_FUNC_PURE */
+#define RPC_FUNC_IDEMPOTENT 0x40
+
+/* The handler spends its time waiting (sleeping, on disks or on other servers) */
+/* rather than computing. Its calls run on a separate pool of threads that grows */
+/* as needed, and the thread serving the connection goes on to serve other */
+/* clients until the reply has been sent */
+#define RPC_FUNC_BLOCKING 0x80
+
+/* The function streams its result back, see rpc_register_stream. Set by the */
+/* server, not by callers of rpc_register_ex */
+#define RPC_FUNC_STREAM 0x100
+
+/* ---------------- */
+/* Server functions */
+/* ---------------- */
+
+/* Registers a function (mapping from name to handler) along with RPC_FUNC_* flags */
+/* RETURNS: -1 on failure */
+int rpc_register_ex(rpc_server* srv, char* name, rpc_handler handler, unsigned flags);
+
+/* The pending reply to a call made to an async handler */
+typedef struct rpc_completion rpc_completion;
+
+/* A handler that answers later rather than returning the answer. It passes */
+/* the result to rpc_complete exactly once, from any thread, and may return */
+/* well before doing so. input stays valid until then */
+typedef void (*rpc_async_handler)(rpc_data* input, rpc_completion* completion);
+
+/* Registers a function with an async handler, along with RPC_FUNC_* flags */
+/* No thread is held while a call is pending, so handlers that wait on I/O or */
+/* on other servers can keep many calls going on a few threads. Each connection */
+/* gets its next request read once its reply has gone out. Limits set with */
+/* rpc_server_set_func_limit hold until the call completes, RPC_FUNC_BLOCKING */
+/* has no effect */
+/* RETURNS: -1 on failure */
+int rpc_register_async(rpc_server* srv, char* name, rpc_async_handler handler, unsigned flags);
+
+/* Sends output as the reply to an async call and frees it, as the server does */
+/* with the result of a handler. A NULL output is sent back as an error. The */
+/* completion is freed too and must not be used again. Shutdown waits for */
+/* every pending call to be completed */
+void rpc_complete(rpc_completion* completion, rpc_data* output);
+
+/* The reply to a call made to a stream handler, sent one item at a time */
+typedef struct rpc_stream rpc_stream;
+
+/* A handler that sends its result as any number of items through */
+/* rpc_stream_send, the stream ending when the handler returns. Returning -1 */
+/* ends it with an error instead, after whatever items were already sent */
+typedef int (*rpc_stream_handler)(rpc_data* input, rpc_stream* stream);
+
+/* Registers a function with a stream handler, along with RPC_FUNC_* flags */
+/* Clients read the items with rpc_call_stream. Results are never cached, and */
+/* the handler runs on the connection's own thread for as long as it streams */
+/* RETURNS: -1 on failure */
+int rpc_register_stream(rpc_server* srv, char* name, rpc_stream_handler handler, unsigned flags);
+
+/* Sends item as the next item of the stream, waiting while the client has */
+/* as many unread items as it allows. item is left to the handler, so it can */
+/* be reused for the next item. Only call from within the stream handler */
+/* RETURNS: -1 once the client has cancelled the stream or hung up, or if item */
+/* is invalid, in which case the handler should stop and return */
+int rpc_stream_send(rpc_stream* stream, rpc_data* item);
+
+/* Bounds the cache of results of RPC_FUNC_PURE functions. Setting either bound */
+/* to 0 disables caching. Call before rpc_serve_all */
+/* RETURNS: -1 on failure */
+int rpc_server_set_cache(rpc_server* srv, size_t max_entries, size_t max_bytes);
+
+/* Lets at most max_concurrent calls to the named function run at once, and */
+/* at most max_waiting more wait for one of them to finish. Calls beyond that */
+/* are sent RPC_ERROR_OVERLOADED. A max_concurrent of 0 removes the limit */
+/* Register the function first, and call before rpc_serve_all */
+/* RETURNS: -1 on failure */
+int rpc_server_set_func_limit(rpc_server* srv, char* name, 
+                              size_t max_concurrent, size_t max_waiting);
+
+/* Lets at most max_running handlers run at once, a good value being the */
+/* number of cores. Once they are all running, waiting calls are served */
+/* RPC_FUNC_INTERACTIVE first and RPC_FUNC_BULK last, though calls that */
+/* have waited long enough are served regardless of their class */
+/* A max_running of 0 (the default) runs every call as soon as it arrives */
+/* Call before rpc_serve_all */
+/* RETURNS: -1 on failure */
+int rpc_server_set_scheduler(rpc_server* srv, size_t max_running);
+
+/* Bounds the number of connections waiting for a thread and the number of */
+/* calls being served at once, 0 meaning unbounded. Beyond either bound the */
+/* client is immediately sent RPC_ERROR_OVERLOADED instead of being made to wait */
+/* Call before rpc_serve_all */
+/* RETURNS: -1 on failure */
+int rpc_server_set_limits(rpc_server* srv, size_t max_queued_clients, size_t max_inflight_calls);
+
+/* Bounds the memory held by requests that have been read in but not yet */
+/* answered, to max_conn_bytes for any one connection and max_total_bytes for */
+/* the whole server. A request is checked against both by the length of its */
+/* frame, or of its data2 if it isn't framed, before any memory is set aside */
+/* for it. One that doesn't fit is read past and answered with */
+/* RPC_ERROR_MEM_BUDGET. A bound of 0 removes it */
+/* RETURNS: -1 on failure */
+int rpc_server_set_mem_budget(rpc_server* srv, size_t max_conn_bytes, size_t max_total_bytes);
+
+/* Bounds the threads running RPC_FUNC_BLOCKING handlers, 64 by default. Threads */
+/* are started when calls need them and exit after idling for a few seconds. A */
+/* max_threads of 0 runs blocking handlers on the connection's own thread */
+/* Call before rpc_serve_all */
+/* RETURNS: -1 on failure */
+int rpc_server_set_offload(rpc_server* srv, size_t max_threads);
+
+/* Where the worker threads run */
+#define RPC_AFFINITY_NONE 0     /* Anywhere, taking any client (the default) */
+#define RPC_AFFINITY_NODE 1     /* Each pinned to the cores of one NUMA node */
+#define RPC_AFFINITY_CORE 2     /* Each pinned to a single core */
+
+/* Places worker threads according to one of the RPC_AFFINITY_* options. Workers */
+/* are spread evenly across NUMA nodes, and once placed, each connection is */
+/* served by a worker on the node that received its packets, so its buffers */
+/* and its handlers stay on the same node. Connections only move to another */
+/* node when no worker there is free */
+/* Call before rpc_serve_all */
+/* RETURNS: -1 on failure */
+int rpc_server_set_affinity(rpc_server* srv, unsigned affinity);
+
+/* Reads the current load of the server into output */
+/* RETURNS: -1 on failure */
+int rpc_server_load(rpc_server* srv, rpc_load* output);
+
+/* Stops accepting clients and makes rpc_serve_all return once every call */
+/* that is already in flight has been answered. Idle connections are closed, */
+/* as are those still partway through a request after 10 seconds */
+/* Safe to call from a signal handler or from another thread */
+void rpc_server_shutdown(rpc_server* srv);
+
+/* Listens on the Unix socket at path for a replacement process. When one */
+/* connects, the listening socket is handed over and this server drains as */
+/* if rpc_server_shutdown had been called */
+/* RETURNS: -1 on failure */
+int rpc_server_enable_handoff(rpc_server* srv, char* path);
+
+/* Initialises server state using the listening socket of the server that */
+/* called rpc_server_enable_handoff with the same path. The old server stops */
+/* accepting straight away, and new connections wait in the backlog of the */
+/* socket until rpc_serve_all is called, so register functions before that */
+/* RETURNS: rpc_server* on success, NULL on error */
+rpc_server* rpc_init_server_handoff(char* path);
+
+/* Cleans up server state. Only call this after rpc_serve_all has returned */
+void rpc_close_server(rpc_server* srv);
+
+/* Collects the stats of every registered function */
+/* RETURNS: array of *count rpc_stats on success, NULL on error */
+/* Free the result with rpc_stats_free() */
+rpc_stats* rpc_server_stats(rpc_server* srv, size_t* count);
+
+/* Allocates a zeroed rpc_data for a handler to return, from memory owned by */
+/* the thread running the handler. The server takes it back once the reply */
+/* has been built, so handlers must neither free it nor keep it. Outside of a */
+/* handler this is calloc(1, sizeof(rpc_data)), to be freed with rpc_data_free */
+/* Async handlers get the latter, since their results outlive the handler */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data* rpc_data_alloc(void);
+
+/* Allocates size bytes for data2 of the rpc_data a handler returns, in the */
+/* same way. Results may mix these with memory from malloc, which the server */
+/* frees as usual */
+/* RETURNS: pointer on success, NULL on error or if size is 0 */
+void* rpc_buf_alloc(size_t size);
+
+/* ---------------- */
+/* Client functions */
+/* ---------------- */
+
+/* Makes the client reconnect when the connection to the server drops, trying */
+/* up to max_attempts times and waiting twice as long after each failed try, */
+/* starting at base_delay_ms and capped at max_delay_ms. The request that found */
+/* the connection dead is sent again once reconnected, unless it was a call to */
+/* a function not registered with RPC_FUNC_IDEMPOTENT or RPC_FUNC_PURE. Handles */
+/* stay valid as long as the server registers the same functions again */
+/* A max_attempts of 0 (the default) leaves the client disconnected */
+/* RETURNS: -1 on failure */
+int rpc_client_set_reconnect(rpc_client* cl, unsigned max_attempts, 
+                             unsigned base_delay_ms, unsigned max_delay_ms);
+
+/* The reply to a call, kept by the caller so that its memory can be reused */
+/* from one call to the next. Start from { 0 } and free with rpc_response_free */
+typedef struct {
+    rpc_data data;      /* The reply, valid until the next call made with it */
+    void* buffer;       /* Memory behind data.data2, grown only when too small */
+    size_t capacity;    /* Size of buffer in bytes */
+} rpc_response;
+
+/* Same as rpc_call, but the reply is read into response rather than into a */
+/* newly allocated rpc_data, and data.data2 points into its buffer. A loop of */
+/* calls made with the same response allocates nothing once the buffer has */
+/* grown to fit the largest reply */
+/* RETURNS: -1 on failure, with the contents of response->data unspecified */
+int rpc_call_into(rpc_client* cl, rpc_handle* h, rpc_data* payload, rpc_response* response);
+
+/* Frees the buffer of a response, leaving it ready to be used again */
+void rpc_response_free(rpc_response* response);
+
+/* Asks the server for the stats of every registered function */
+/* RETURNS: array of *count rpc_stats on success, NULL on error */
+/* Free the result with rpc_stats_free() */
+rpc_stats* rpc_fetch_stats(rpc_client* cl, size_t* count);
+
+/* Asks the server how busy it is. Servers too old to report their memory */
+/* leave inbound_bytes and rejected_payloads at 0 */
+/* RETURNS: -1 on failure */
+int rpc_fetch_load(rpc_client* cl, rpc_load* output);
+
+/* RPC_ERROR_* flags (see rpc_types.h) sent back for the last request this thread */
+/* made, so that callers can tell an overloaded server apart from other failures */
+/* RETURNS: 0 if the last request succeeded or failed without a reply */
+unsigned rpc_last_error(void);
+
+/* Items of a stream being read by a client */
+typedef struct rpc_iter rpc_iter;
+
+/* Number of items a stream may send ahead of the client reading them, unless */
+/* the client asks for another window */
+#define RPC_STREAM_DEFAULT_WINDOW 64
+
+/* Calls a function registered with rpc_register_stream. The server sends up */
+/* to window items ahead of rpc_iter_next, and is held back once they are */
+/* unread, so large results arrive at the speed of the link without piling up */
+/* in memory. A window of 0 uses RPC_STREAM_DEFAULT_WINDOW. The client can't */
+/* make other requests until the iterator is closed */
+/* RETURNS: rpc_iter* on success, NULL on error */
+rpc_iter* rpc_call_stream(rpc_client* cl, rpc_handle* h, rpc_data* payload, uint32_t window);
+
+/* Reads the next item of the stream, to be freed with rpc_data_free */
+/* RETURNS: rpc_data* on success, NULL once the stream has ended or failed, */
+/* with rpc_last_error() being 0 only if it ended normally */
+rpc_data* rpc_iter_next(rpc_iter* it);
+
+/* Frees the iterator. A stream that hasn't ended yet is cancelled, and */
+/* whatever the server had already sent is skipped over */
+void rpc_iter_close(rpc_iter* it);
+
+/* -------------- */
+/* Pool functions */
+/* -------------- */
+
+/* A client of several identical servers, sending each request to one of them */
+typedef struct rpc_pool rpc_pool;
+
+/* How a pool picks the server for each request */
+#define RPC_BALANCE_ROUND_ROBIN 0       /* Each server in turn */
+#define RPC_BALANCE_LEAST_OUTSTANDING 1 /* The server with the fewest requests in progress */
+#define RPC_BALANCE_P2C 2               /* The less busy of two servers picked at random */
+
+/* Treats the servers as shards of partitioned state, sending each call to the */
+/* server that owns payload->data1 on a consistent hash ring. Adding a server */
+/* only moves about 1/N of the keys, and servers are placed on the ring by */
+/* address and port, so their order in the list doesn't matter. Calls are */
+/* never sent to any other server, and are never hedged */
+#define RPC_BALANCE_CONSISTENT_HASH 3
+
+/* Initialises a pool of count servers, the i-th at addrs[i] and ports[i], */
+/* balancing requests with one of the RPC_BALANCE_* policies. Servers that */
+/* fail repeatedly are left out for a while, for longer each time. Calls are */
+/* sent to a second server if the first turns them away as overloaded, or if */
+/* the connection drops and the function is RPC_FUNC_IDEMPOTENT or RPC_FUNC_PURE */
+/* Pools are safe to use from several threads at once */
+/* RETURNS: rpc_pool* on success, NULL if no server could be reached */
+rpc_pool* rpc_init_pool(char** addrs, int* ports, size_t count, unsigned policy);
+
+/* Same as rpc_find, on any server of the pool. The handle can be used with */
+/* every server of the pool, as they all register the same functions */
+/* RETURNS: rpc_handle* on success, NULL on error */
+/* rpc_handle* will be freed with a single call to free(3) */
+rpc_handle* rpc_pool_find(rpc_pool* pool, char* name);
+
+/* Same as rpc_call, on the server picked for it */
+/* RETURNS: rpc_data* on success, NULL on error */
+rpc_data* rpc_pool_call(rpc_pool* pool, rpc_handle* h, rpc_data* payload);
+
+/* Sends calls to RPC_FUNC_IDEMPOTENT or RPC_FUNC_PURE functions to a second */
+/* server as well if the first hasn't answered once the call has taken longer */
+/* than the given percentile (such as 0.95) of recent calls to the function, */
+/* or min_delay_us if that is longer. The first answer is used and the other */
+/* connection is dropped. A percentile of 0 (the default) turns hedging off */
+/* Call before using the pool */
+/* RETURNS: -1 on failure */
+int rpc_pool_set_hedging(rpc_pool* pool, double percentile, uint64_t min_delay_us);
+
+/* Disconnects from every server and cleans up pool state */
+void rpc_close_pool(rpc_pool* pool);
+
+/* ---------------- */
+/* Shared functions */
+/* ---------------- */
+
+/* Frees an array of rpc_stats */
+void rpc_stats_free(rpc_stats* stats, size_t count);
+
+/* Writes the phase timings of recent requests to a binary file (see trace.h) */
+/* RETURNS: number of records written, -1 on error or if built without TRACE=1 */
+int64_t rpc_trace_dump(char* path);
+
+#endif
@@ -5,31 +5,78 @@
 
 typedef uint8_t rpc_message;
 typedef uint8_t rpc_data_flags;
-typedef uint8_t rpc_error;
+typedef uint16_t rpc_error;
+typedef uint8_t rpc_byte_order;
+typedef uint32_t rpc_capabilities;
 
 typedef struct hw_profile {
     int64_t int_max;
     int64_t int_min;
     uint64_t size_max;
     bool initialised;
+
+    // Only known if the peer connected with RPC_MSG_CONNECT_EXT. Capabilities
+    // are those that both ends support
+    rpc_byte_order byte_order;
+    rpc_capabilities capabilities;
 } hw_profile;
 
 enum RPC_MESSAGE {
     RPC_MSG_CONNECT = 0xCC,
+    RPC_MSG_CONNECT_EXT = 0xCE,
     RPC_MSG_FUNC_FIND = 0xFF,
     RPC_MSG_FUNC_CALL = 0xFC,
     RPC_MSG_DISCONNECT = 0xDC,
+    RPC_MSG_STATS = 0x5C,
+    RPC_MSG_LOAD = 0x1D,
     RPC_MSG_END = 0xED,
+    RPC_MSG_FRAME = 0xF2,
+    RPC_MSG_STREAM_CALL = 0xF5,
+    RPC_MSG_STREAM_CREDIT = 0xC5,
     RPC_RTN_SUCCESS = 0x55,
     RPC_RTN_ERROR = 0xEE,
+    RPC_RTN_ITEM = 0x5A,
+    RPC_RTN_STREAM_END = 0x5E,
 };
 
+// A v2 frame is RPC_MSG_FRAME, the message it carries, 16 bits of flags, a
+// 32-bit request ID and a 64-bit body length, followed by the body
+#define RPC_FRAME_HEADER_SIZE 16
+
 enum RPC_DATA_FLAG {
     RPC_DATA_NONE = 0x0,
     RPC_DATA_INT = 0x1,
+    RPC_DATA_ARRAY16 = 0x2,
+    RPC_DATA_ARRAY32 = 0x4,
+    RPC_DATA_ARRAY64 = 0x8,
+    RPC_DATA_VARINT = 0x40,
     RPC_DATA_BUFF = 0x80,
 };
 
+#define RPC_DATA_ARRAY (RPC_DATA_ARRAY16 | RPC_DATA_ARRAY32 | RPC_DATA_ARRAY64)
+
+enum RPC_BYTE_ORDER {
+    RPC_ORDER_UNKNOWN = 0x0,
+    RPC_ORDER_BIG = 0x1,
+    RPC_ORDER_LITTLE = 0x2,
+};
+
+enum RPC_CAPABILITY {
+    RPC_CAP_NONE = 0x0,
+    RPC_CAP_TYPED_ARRAY = 0x1,
+    RPC_CAP_FUNC_FLAGS = 0x2,
+    RPC_CAP_FRAMES = 0x4,
+    RPC_CAP_VARINT = 0x8,
+    RPC_CAP_STREAMS = 0x10,
+    RPC_CAP_LOAD_MEMORY = 0x20,
+    RPC_CAP_WIDE_ERRORS = 0x40,
+};
+
+// Everything this build understands
+#define RPC_CAPS_SUPPORTED (RPC_CAP_TYPED_ARRAY | RPC_CAP_FUNC_FLAGS | RPC_CAP_FRAMES | \
+                            RPC_CAP_VARINT | RPC_CAP_STREAMS | RPC_CAP_LOAD_MEMORY | \
+                            RPC_CAP_WIDE_ERRORS)
+
 enum RPC_ERROR {
     RPC_ERROR_NONE = 0x0,
     RPC_ERROR_CXN_INVALID = 0x1,
@@ -40,6 +87,12 @@ enum RPC_ERROR {
     RPC_ERROR_HNDL_INVALID = 0x20,
     RPC_ERROR_MSG_INVALID = 0x40,
     RPC_ERROR_PQT_INVALID = 0x80,
+    RPC_ERROR_OVERLOADED = 0x100,
+    RPC_ERROR_MEM_BUDGET = 0x200,
 };
 
+// Peers that didn't negotiate RPC_CAP_WIDE_ERRORS are sent errors in a single
+// byte. No single error is ever sent as this pair, so it stands in for overload
+#define RPC_ERROR_LEGACY_OVERLOADED (RPC_ERROR_CXN_INVALID | RPC_ERROR_PQT_INVALID)
+
 #endif 
\ No newline at end of file
@@ -0,0 +1,63 @@
+/**
+ * Priority scheduling of calls. Each connection has its own thread, so rather than
+ * reorder a run queue the scheduler hands out a fixed number of run slots, and once
+ * they are all taken, calls wait for one in order of their deadline.
+ *
+ * A call's deadline is when it arrived plus the slack of its class, so an interactive
+ * call jumps ahead of bulk calls that arrived shortly before it. Waiting work still
+ * ages: a bulk call that has waited longer than its slack goes ahead of any
+ * interactive call that arrives after that, so it cannot be starved.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "defines.h"
+#include "linked_list.h"
+
+#include <pthread.h>
+
+typedef enum sched_class {
+    SCHED_CLASS_INTERACTIVE,
+    SCHED_CLASS_NORMAL,
+    SCHED_CLASS_BULK,
+    SCHED_NUM_CLASSES,
+} sched_class;
+
+// How long a call of each class can wait before it goes ahead of newer calls
+#define SCHED_SLACK_INTERACTIVE_NS 0ULL
+#define SCHED_SLACK_NORMAL_NS 10000000ULL
+#define SCHED_SLACK_BULK_NS 100000000ULL
+
+typedef struct scheduler {
+    pthread_mutex_t mutex;
+    size_t max_running;
+    size_t n_running;
+
+    // Waiting calls, earliest deadline at the head
+    list* waiting;
+} scheduler;
+
+/**
+ * @brief
+ * Allocates and creates a scheduler. Ensure to destroy this with sched_destroy().
+ * @param max_running Number of calls allowed to run at once, must be at least 1
+*/
+scheduler* sched_create(size_t max_running);
+
+// Destroys the scheduler. No calls may be running or waiting
+void sched_destroy(scheduler* sched);
+
+/**
+ * @brief
+ * Takes a run slot, waiting for one if they are all taken
+ * @param sched Scheduler of the server, may be NULL
+ * @param class Class of the function being called
+*/
+void sched_enter(scheduler* sched, sched_class class);
+
+// Gives back a run slot taken by sched_enter(), passing it to the waiting call
+// with the earliest deadline
+void sched_leave(scheduler* sched);
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * Per-function counters and latency histograms. Each thread records into its own
+ * shard so the hot path never shares a cache line with another thread, and the shards
+ * are only summed up when somebody actually asks for the numbers.
+*/
+
+#ifndef STATS_H
+#define STATS_H
+
+#include "defines.h"
+#include "rpc_ext.h"
+#include "rpc_types.h"
+
+#include <stdatomic.h>
+
+// Threads beyond this many share shards, which is still correct, just slower
+#define STATS_NUM_SHARDS 16
+
+// Latency histogram is log-linear (like HDR histograms): every power of two
+// is split into 2^STATS_SUB_BITS linear buckets, giving ~12.5% precision
+#define STATS_SUB_BITS 3
+#define STATS_SUB_COUNT (1 << STATS_SUB_BITS)
+#define STATS_NUM_BUCKETS ((64 - STATS_SUB_BITS + 1) * STATS_SUB_COUNT)
+
+typedef struct stats_shard {
+    atomic_uint_fast64_t calls;
+    atomic_uint_fast64_t bytes_in;
+    atomic_uint_fast64_t bytes_out;
+    atomic_uint_fast64_t errors[RPC_STATS_NUM_ERRORS];
+    atomic_uint_fast64_t cache_hits;
+    atomic_uint_fast64_t cache_misses;
+    atomic_uint_fast64_t latency_sum;
+    atomic_uint_fast64_t latency_max;
+    atomic_uint_fast64_t latency_buckets[STATS_NUM_BUCKETS];
+} __attribute__((aligned(64))) stats_shard;
+
+typedef struct func_stats {
+    stats_shard shards[STATS_NUM_SHARDS];
+} func_stats;
+
+/**
+ * @brief
+ * Allocates and zeroes the stats of a function. Ensure to destroy these with
+ * stats_destroy().
+*/
+func_stats* stats_create(void);
+
+// Frees the stats of a function
+void stats_destroy(func_stats* stats);
+
+// Monotonic timestamp in nanoseconds
+uint64_t stats_now_ns(void);
+
+/**
+ * @brief
+ * Records a finished call into the calling thread's shard
+ * @param stats Stats of the function that was called
+ * @param latency_ns Time taken to serve the call
+ * @param bytes_in Size of the payload sent by the client
+ * @param bytes_out Size of the payload sent back to the client
+*/
+void stats_record_call(func_stats* stats, uint64_t latency_ns,
+                       uint64_t bytes_in, uint64_t bytes_out);
+
+// Records each flag set in error into the calling thread's shard
+void stats_record_error(func_stats* stats, rpc_error error);
+
+// Records a lookup in the result cache into the calling thread's shard
+void stats_record_cache(func_stats* stats, bool is_hit);
+
+/**
+ * @brief
+ * Sums every shard of the given stats into output. Does not touch output->name.
+ * @param stats Stats of a function
+ * @param output rpc_stats to write into
+*/
+void stats_snapshot(func_stats* stats, rpc_stats* output);
+
+#endif
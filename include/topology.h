@@ -0,0 +1,41 @@
+/**
+ * Which CPUs this process may run on, and which NUMA node each belongs to, as
+ * read from sysfs. Nodes are numbered from 0 in the order they are found, and
+ * only nodes with at least one usable CPU are kept, so on machines without NUMA
+ * (or without sysfs) everything ends up on a single node 0.
+*/
+
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include "defines.h"
+
+#include <sched.h>
+
+typedef struct topology {
+    size_t n_nodes;
+
+    // Usable CPUs of each node, n_node_cpus[i] of them in node_cpus[i]
+    int** node_cpus;
+    size_t* n_node_cpus;
+
+    // Node of each CPU by its number, -1 for CPUs that can't be used
+    int* cpu_node;
+    int n_cpu_ids;
+} topology;
+
+/**
+ * @brief
+ * Reads the topology of the machine. Ensure to destroy this with topology_destroy().
+ * @return
+ * The topology, or NULL if the CPUs this process may run on can't be found.
+*/
+topology* topology_create(void);
+
+// Destroys the topology
+void topology_destroy(topology* topo);
+
+// Finds the node of a CPU, or -1 if the CPU is unknown or can't be used
+int topology_cpu_node(topology* topo, int cpu);
+
+#endif
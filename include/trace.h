@@ -0,0 +1,97 @@
+/**
+ * Phase-level tracing of the request path. Only compiled in when RPC_TRACE is defined
+ * (make TRACE=1), otherwise every trace_xyz macro expands to nothing.
+ *
+ * Each thread records into its own ring buffer so recording never takes a lock. A
+ * record marks the END of a phase, so the time spent in a phase is the difference
+ * between its timestamp and the one before it within the same request. A request
+ * is identified by its thread_id and request_id, even when its later phases are
+ * recorded by another thread.
+*/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "defines.h"
+
+// Number of records kept per thread, must be a power of two
+#define TRACE_RING_SIZE (1 << 16)
+
+// Dump file layout: trace_file_header followed by count trace_records,
+// both in the byte order of the machine that wrote them
+#define TRACE_FILE_MAGIC "RPCTRACE"
+#define TRACE_FILE_VERSION 1
+
+enum TRACE_PHASE {
+    TRACE_PHASE_RECV_HEADER = 0,    // Message byte has been read in
+    TRACE_PHASE_DECODE = 1,         // Request payload has been decoded
+    TRACE_PHASE_DISPATCH = 2,       // Handler has been looked up
+    TRACE_PHASE_HANDLER = 3,        // Handler has returned
+    TRACE_PHASE_CHECK = 4,          // Output has been validated
+    TRACE_PHASE_ENCODE = 5,         // Reply has been serialised
+    TRACE_PHASE_SEND = 6,           // Reply has been written to the socket
+};
+
+typedef struct trace_record {
+    uint64_t timestamp_ns;
+    uint32_t request_id;
+    uint16_t thread_id;
+    uint8_t phase;
+    uint8_t message;
+} trace_record;
+
+// The request a thread is recording against, so that a request begun on one
+// thread can be carried on by another
+typedef struct trace_context {
+    uint32_t request_id;
+    uint16_t thread_id;
+    uint8_t message;
+} trace_context;
+
+typedef struct trace_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t count;
+} trace_file_header;
+
+#ifdef RPC_TRACE
+
+// Starts a new request on the calling thread
+void trace_request_begin(uint8_t message);
+
+// Records the end of a phase of the calling thread's current request
+void trace_record_phase(uint8_t phase);
+
+// The calling thread's current request
+trace_context trace_request_current(void);
+
+// Swaps the calling thread's current request with the given one. Swapping
+// again with the same context goes back to the request the thread was on
+void trace_request_swap(trace_context* context);
+
+#define trace_begin(message) trace_request_begin(message)
+#define trace_mark(phase) trace_record_phase(phase)
+#define trace_save(context) ((context) = trace_request_current())
+#define trace_swap(context) trace_request_swap(&(context))
+
+#else
+
+#define trace_begin(message)
+#define trace_mark(phase)
+#define trace_save(context)
+#define trace_swap(context)
+
+#endif
+
+/**
+ * @brief
+ * Writes the contents of every thread's ring buffer to the given file.
+ * @param path Path of the file to write
+ * @return
+ * Number of records written, or -1 if tracing was not compiled in or the
+ * file could not be written.
+*/
+int64_t trace_dump(const char* path);
+
+#endif
@@ -1,10 +1,19 @@
 #include "rpc.h"
+#include "rpc_ext.h"
 #include <assert.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 rpc_data* add2_i8(rpc_data* in);
 
+static rpc_server* server_state = NULL;
+
+/* Finish in-flight calls before exiting */
+static void on_terminate(int signum) {
+    rpc_server_shutdown(server_state);
+}
+
 int main(int argc, char *argv[]) {
     rpc_server *state;
 
@@ -19,7 +28,12 @@ int main(int argc, char *argv[]) {
         exit(EXIT_FAILURE);
     }
 
+    server_state = state;
+    signal(SIGINT, on_terminate);
+    signal(SIGTERM, on_terminate);
+
     rpc_serve_all(state);
+    rpc_close_server(state);
 
     return 0;
 }
@@ -0,0 +1,85 @@
+#include "arena.h"
+
+// Allocates a block with room for at least size bytes
+static arena_block* arena_block_create(size_t size);
+
+arena* arena_create(void) {
+    arena* ar = calloc(1, sizeof(arena));
+    if (ar == NULL)
+        return NULL;
+
+    ar->blocks = arena_block_create(ARENA_BLOCK_SIZE);
+    if (ar->blocks == NULL) {
+        free(ar);
+        return NULL;
+    }
+    return ar;
+}
+
+void arena_destroy(arena* ar) {
+    if (ar == NULL)
+        return;
+
+    arena_reset(ar);
+    free(ar->blocks);
+    free(ar);
+}
+
+void* arena_alloc(arena* ar, size_t size) {
+    if (ar == NULL)
+        return NULL;
+
+    size_t aligned = (size + ARENA_ALIGNMENT - 1) & ~(size_t)(ARENA_ALIGNMENT - 1);
+    if (aligned < size)
+        return NULL;
+
+    // Only the newest block has room left, older ones were full when it was made
+    arena_block* block = ar->blocks;
+    if (block->size - block->used < aligned) {
+        block = arena_block_create(aligned > ARENA_BLOCK_SIZE ? aligned : ARENA_BLOCK_SIZE);
+        if (block == NULL)
+            return NULL;
+        block->next = ar->blocks;
+        ar->blocks = block;
+    }
+
+    void* ptr = block->data + block->used;
+    block->used += aligned;
+    return ptr;
+}
+
+bool arena_owns(arena* ar, void* ptr) {
+    if (ar == NULL || ptr == NULL)
+        return false;
+
+    uint8_t* byte = ptr;
+    for (arena_block* block = ar->blocks; block != NULL; block = block->next) {
+        if (byte >= block->data && byte < block->data + block->used)
+            return true;
+    }
+    return false;
+}
+
+void arena_reset(arena* ar) {
+    if (ar == NULL)
+        return;
+
+    // Keep only the first block, which every call gets to use
+    while (ar->blocks->next != NULL) {
+        arena_block* block = ar->blocks;
+        ar->blocks = block->next;
+        free(block);
+    }
+    ar->blocks->used = 0;
+}
+
+static arena_block* arena_block_create(size_t size) {
+    arena_block* block = malloc(sizeof(arena_block) + size);
+    if (block == NULL)
+        return NULL;
+
+    block->next = NULL;
+    block->size = size;
+    block->used = 0;
+    return block;
+}
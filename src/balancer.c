@@ -0,0 +1,105 @@
+#include "balancer.h"
+#include "stats.h"
+
+// Whether the backend can be picked, given whether ejected backends can be
+static bool balancer_is_eligible(balancer* bal, size_t index, size_t avoid, 
+                                 bool allow_ejected, uint64_t now_ns);
+
+balancer* balancer_create(size_t n_backends, unsigned policy) {
+    if (n_backends == 0)
+        return NULL;
+
+    balancer* bal = calloc(1, sizeof(balancer));
+    pthread_mutex_init(&bal->mutex, NULL);
+    bal->policy = policy;
+    bal->n_backends = n_backends;
+    bal->backends = calloc(n_backends, sizeof(balancer_backend));
+    bal->seed = stats_now_ns();
+    return bal;
+}
+
+void balancer_destroy(balancer* bal) {
+    if (bal == NULL)
+        return;
+
+    pthread_mutex_destroy(&bal->mutex);
+    free(bal->backends);
+    free(bal);
+}
+
+size_t balancer_pick(balancer* bal, size_t avoid) {
+    uint64_t now_ns = stats_now_ns();
+
+    pthread_mutex_lock(&bal->mutex);
+
+    // Relax what counts as eligible until something is. Sending to the backend
+    // that just failed, or to an ejected one, beats not sending at all
+    size_t eligible[bal->n_backends];
+    size_t n_eligible = 0;
+    for (int pass=0; pass<3 && n_eligible == 0; pass++) {
+        for (size_t i=0; i<bal->n_backends; i++) {
+            if (balancer_is_eligible(bal, i, pass == 0 ? avoid : BALANCER_NO_BACKEND, pass == 2, now_ns))
+                eligible[n_eligible++] = i;
+        }
+    }
+
+    // Round robin goes through them in order. The other policies also start
+    // from a rotating point so that ties don't always go to the same backend
+    size_t start = bal->next++ % n_eligible;
+    size_t chosen = eligible[start];
+
+    if (bal->policy == RPC_BALANCE_LEAST_OUTSTANDING) {
+        for (size_t i=1; i<n_eligible; i++) {
+            size_t candidate = eligible[(start + i) % n_eligible];
+            if (bal->backends[candidate].n_outstanding < bal->backends[chosen].n_outstanding)
+                chosen = candidate;
+        }
+    } else if (bal->policy == RPC_BALANCE_P2C && n_eligible > 1) {
+
+        // Two distinct backends at random, keeping the less busy of them
+        size_t first = rand_r(&bal->seed) % n_eligible;
+        size_t second = (first + 1 + rand_r(&bal->seed) % (n_eligible - 1)) % n_eligible;
+        chosen = eligible[first];
+        if (bal->backends[eligible[second]].n_outstanding < bal->backends[chosen].n_outstanding)
+            chosen = eligible[second];
+    }
+
+    bal->backends[chosen].n_outstanding++;
+    pthread_mutex_unlock(&bal->mutex);
+    return chosen;
+}
+
+void balancer_done(balancer* bal, size_t index, bool is_failure) {
+    if (index >= bal->n_backends)
+        return;
+
+    pthread_mutex_lock(&bal->mutex);
+    balancer_backend* backend = &bal->backends[index];
+    backend->n_outstanding--;
+
+    if (!is_failure) {
+        backend->n_failures = 0;
+        backend->n_ejections = 0;
+        pthread_mutex_unlock(&bal->mutex);
+        return;
+    }
+
+    // A backend coming back from ejection stays on its last strike, so a
+    // single failure is enough to eject it again, for twice as long
+    if (++backend->n_failures >= BALANCER_MAX_FAILURES) {
+        backend->n_failures = BALANCER_MAX_FAILURES - 1;
+        uint64_t eject_ns = BALANCER_EJECT_BASE_NS << (backend->n_ejections < 5 ? backend->n_ejections : 5);
+        if (eject_ns > BALANCER_EJECT_MAX_NS)
+            eject_ns = BALANCER_EJECT_MAX_NS;
+        backend->n_ejections++;
+        backend->ejected_until_ns = stats_now_ns() + eject_ns;
+    }
+    pthread_mutex_unlock(&bal->mutex);
+}
+
+static bool balancer_is_eligible(balancer* bal, size_t index, size_t avoid, 
+                                 bool allow_ejected, uint64_t now_ns) {
+    if (index == avoid)
+        return false;
+    return allow_ejected || bal->backends[index].ejected_until_ns <= now_ns;
+}
@@ -0,0 +1,123 @@
+#include "buffer.h"
+#include "helper.h"
+
+void buffer_init(byte_buffer* pBuf) {
+    pBuf->data = NULL;
+    pBuf->len = 0;
+    pBuf->capacity = 0;
+    pBuf->read_pos = 0;
+}
+
+void buffer_deinit(byte_buffer* pBuf) {
+    if (pBuf == NULL)
+        return;
+    FREE(pBuf->data);
+    memset(pBuf, 0, sizeof(byte_buffer));
+}
+
+void buffer_clear(byte_buffer* pBuf) {
+    pBuf->len = 0;
+    pBuf->read_pos = 0;
+}
+
+void buffer_reserve(byte_buffer* pBuf, size_t nbytes) {
+    if (pBuf->len + nbytes <= pBuf->capacity)
+        return;
+
+    // Grow geometrically so appending stays cheap
+    size_t new_capacity = pBuf->capacity ? pBuf->capacity : BUFFER_DEFAULT_CAPACITY;
+    while (new_capacity < pBuf->len + nbytes)
+        new_capacity *= 2;
+
+    pBuf->data = realloc(pBuf->data, new_capacity);
+    assert(pBuf->data != NULL);
+    pBuf->capacity = new_capacity;
+}
+
+void buffer_put_bytes(byte_buffer* pBuf, const void* bytes, size_t nbytes) {
+    if (nbytes == 0)
+        return;
+    buffer_reserve(pBuf, nbytes);
+    memcpy(&pBuf->data[pBuf->len], bytes, nbytes);
+    pBuf->len += nbytes;
+}
+
+void buffer_put_u8(byte_buffer* pBuf, uint8_t value) {
+    buffer_put_bytes(pBuf, &value, sizeof(uint8_t));
+}
+
+void buffer_put_u16(byte_buffer* pBuf, uint16_t value) {
+    uint16_t be_value = htons(value);
+    buffer_put_bytes(pBuf, &be_value, sizeof(uint16_t));
+}
+
+void buffer_put_u32(byte_buffer* pBuf, uint32_t value) {
+    uint32_t be_value = htonl(value);
+    buffer_put_bytes(pBuf, &be_value, sizeof(uint32_t));
+}
+
+void buffer_put_u64(byte_buffer* pBuf, uint64_t value) {
+    uint64_t be_value = hton64(value);
+    buffer_put_bytes(pBuf, &be_value, sizeof(uint64_t));
+}
+
+void buffer_put_varint(byte_buffer* pBuf, uint64_t value) {
+    buffer_reserve(pBuf, BUFFER_VARINT_MAX);
+
+    // The top bit of each byte says whether another one follows
+    while (value >= 0x80) {
+        pBuf->data[pBuf->len++] = (value & 0x7F) | 0x80;
+        value >>= 7;
+    }
+    pBuf->data[pBuf->len++] = value;
+}
+
+bool buffer_get_bytes(byte_buffer* pBuf, void* bytes, size_t nbytes) {
+    if (pBuf->len - pBuf->read_pos < nbytes)
+        return false;
+    memcpy(bytes, &pBuf->data[pBuf->read_pos], nbytes);
+    pBuf->read_pos += nbytes;
+    return true;
+}
+
+bool buffer_get_u8(byte_buffer* pBuf, uint8_t* value) {
+    return buffer_get_bytes(pBuf, value, sizeof(uint8_t));
+}
+
+bool buffer_get_u16(byte_buffer* pBuf, uint16_t* value) {
+    quick_check(buffer_get_bytes(pBuf, value, sizeof(uint16_t)));
+    *value = ntohs(*value);
+    return true;
+}
+
+bool buffer_get_u32(byte_buffer* pBuf, uint32_t* value) {
+    quick_check(buffer_get_bytes(pBuf, value, sizeof(uint32_t)));
+    *value = ntohl(*value);
+    return true;
+}
+
+bool buffer_get_u64(byte_buffer* pBuf, uint64_t* value) {
+    quick_check(buffer_get_bytes(pBuf, value, sizeof(uint64_t)));
+    *value = ntoh64(*value);
+    return true;
+}
+
+bool buffer_get_varint(byte_buffer* pBuf, uint64_t* value) {
+    uint64_t result = 0;
+    for (int i=0; i<BUFFER_VARINT_MAX; i++) {
+        uint8_t byte;
+        quick_check(buffer_get_u8(pBuf, &byte));
+
+        // The last byte only has room left for the top bit of the value
+        if (i == BUFFER_VARINT_MAX - 1 && byte > 1)
+            return false;
+        result |= (uint64_t)(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+
+    // Too long to be a 64-bit value
+    return false;
+}
@@ -0,0 +1,54 @@
+#include "bulkhead.h"
+
+bulkhead* bulkhead_create(size_t max_active, size_t max_waiting) {
+    if (max_active == 0)
+        return NULL;
+
+    bulkhead* bh = calloc(1, sizeof(bulkhead));
+    pthread_mutex_init(&bh->mutex, NULL);
+    pthread_cond_init(&bh->slot_cond, NULL);
+    bh->max_active = max_active;
+    bh->max_waiting = max_waiting;
+    return bh;
+}
+
+void bulkhead_destroy(bulkhead* bh) {
+    if (bh == NULL)
+        return;
+
+    pthread_mutex_destroy(&bh->mutex);
+    pthread_cond_destroy(&bh->slot_cond);
+    free(bh);
+}
+
+bool bulkhead_enter(bulkhead* bh) {
+    if (bh == NULL)
+        return true;
+
+    pthread_mutex_lock(&bh->mutex);
+
+    // Turn the call away if it can neither run nor wait
+    if (bh->n_active >= bh->max_active && bh->n_waiting >= bh->max_waiting) {
+        pthread_mutex_unlock(&bh->mutex);
+        return false;
+    }
+
+    bh->n_waiting++;
+    while (bh->n_active >= bh->max_active)
+        pthread_cond_wait(&bh->slot_cond, &bh->mutex);
+    bh->n_waiting--;
+    bh->n_active++;
+
+    pthread_mutex_unlock(&bh->mutex);
+    return true;
+}
+
+void bulkhead_leave(bulkhead* bh) {
+    if (bh == NULL)
+        return;
+
+    pthread_mutex_lock(&bh->mutex);
+    bh->n_active--;
+    pthread_cond_signal(&bh->slot_cond);
+    pthread_mutex_unlock(&bh->mutex);
+}
@@ -0,0 +1,128 @@
+#include "byteorder.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define BYTEORDER_X86
+#include <immintrin.h>
+#endif
+
+typedef enum byteorder_level {
+    BYTEORDER_UNKNOWN,
+    BYTEORDER_SCALAR,
+    BYTEORDER_SSSE3,
+    BYTEORDER_AVX2,
+} byteorder_level;
+
+// Resolved once, racing threads all come to the same answer
+static byteorder_level swap_level = BYTEORDER_UNKNOWN;
+
+static byteorder_level byteorder_detect(void);
+
+// Each kernel swaps as many whole vectors as fit and returns the bytes it covered
+#ifdef BYTEORDER_X86
+static size_t byteorder_swap_avx2(uint8_t* bytes, size_t nbytes, unsigned width);
+static size_t byteorder_swap_ssse3(uint8_t* bytes, size_t nbytes, unsigned width);
+static void byteorder_shuffle_mask(uint8_t mask[16], unsigned width);
+#endif
+static void byteorder_swap_scalar(uint8_t* bytes, size_t count, unsigned width);
+
+void byteorder_swap(void* data, size_t count, unsigned width) {
+    if (data == NULL || count == 0 || width < 2)
+        return;
+
+    if (swap_level == BYTEORDER_UNKNOWN)
+        swap_level = byteorder_detect();
+
+    uint8_t* bytes = data;
+    size_t nbytes = count * width;
+    size_t done = 0;
+
+#ifdef BYTEORDER_X86
+    if (swap_level == BYTEORDER_AVX2)
+        done = byteorder_swap_avx2(bytes, nbytes, width);
+    else if (swap_level == BYTEORDER_SSSE3)
+        done = byteorder_swap_ssse3(bytes, nbytes, width);
+#endif
+
+    // Vectors always cover whole elements, so the rest is whole elements too
+    byteorder_swap_scalar(bytes + done, (nbytes - done) / width, width);
+}
+
+static byteorder_level byteorder_detect(void) {
+#ifdef BYTEORDER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        return BYTEORDER_AVX2;
+    if (__builtin_cpu_supports("ssse3"))
+        return BYTEORDER_SSSE3;
+#endif
+    return BYTEORDER_SCALAR;
+}
+
+#ifdef BYTEORDER_X86
+__attribute__((target("avx2")))
+static size_t byteorder_swap_avx2(uint8_t* bytes, size_t nbytes, unsigned width) {
+    uint8_t lane_mask[16];
+    byteorder_shuffle_mask(lane_mask, width);
+    __m128i half = _mm_loadu_si128((__m128i*)lane_mask);
+    __m256i mask = _mm256_broadcastsi128_si256(half);
+
+    // Two vectors per iteration to hide the latency of the shuffles
+    size_t i = 0;
+    for (; i + 64 <= nbytes; i += 64) {
+        __m256i a = _mm256_loadu_si256((__m256i*)(bytes + i));
+        __m256i b = _mm256_loadu_si256((__m256i*)(bytes + i + 32));
+        _mm256_storeu_si256((__m256i*)(bytes + i), _mm256_shuffle_epi8(a, mask));
+        _mm256_storeu_si256((__m256i*)(bytes + i + 32), _mm256_shuffle_epi8(b, mask));
+    }
+    for (; i + 32 <= nbytes; i += 32) {
+        __m256i a = _mm256_loadu_si256((__m256i*)(bytes + i));
+        _mm256_storeu_si256((__m256i*)(bytes + i), _mm256_shuffle_epi8(a, mask));
+    }
+    return i + byteorder_swap_ssse3(bytes + i, nbytes - i, width);
+}
+
+__attribute__((target("ssse3")))
+static size_t byteorder_swap_ssse3(uint8_t* bytes, size_t nbytes, unsigned width) {
+    uint8_t lane_mask[16];
+    byteorder_shuffle_mask(lane_mask, width);
+    __m128i mask = _mm_loadu_si128((__m128i*)lane_mask);
+
+    size_t i = 0;
+    for (; i + 16 <= nbytes; i += 16) {
+        __m128i a = _mm_loadu_si128((__m128i*)(bytes + i));
+        _mm_storeu_si128((__m128i*)(bytes + i), _mm_shuffle_epi8(a, mask));
+    }
+    return i;
+}
+
+static void byteorder_shuffle_mask(uint8_t mask[16], unsigned width) {
+
+    // Every byte takes its mirror image from within the same element
+    for (unsigned i=0; i<16; i++)
+        mask[i] = (i / width) * width + (width - 1 - i % width);
+}
+#endif
+
+static void byteorder_swap_scalar(uint8_t* bytes, size_t count, unsigned width) {
+
+    // memcpy keeps unaligned access legal and compiles down to plain moves
+    for (size_t i=0; i<count; i++) {
+        uint8_t* element = bytes + i * width;
+        if (width == 2) {
+            uint16_t value;
+            memcpy(&value, element, sizeof(value));
+            value = __builtin_bswap16(value);
+            memcpy(element, &value, sizeof(value));
+        } else if (width == 4) {
+            uint32_t value;
+            memcpy(&value, element, sizeof(value));
+            value = __builtin_bswap32(value);
+            memcpy(element, &value, sizeof(value));
+        } else if (width == 8) {
+            uint64_t value;
+            memcpy(&value, element, sizeof(value));
+            value = __builtin_bswap64(value);
+            memcpy(element, &value, sizeof(value));
+        }
+    }
+}
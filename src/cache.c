@@ -0,0 +1,274 @@
+#include "cache.h"
+
+#include <pthread.h>
+
+// FNV-1a parameters
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+// A cached result. Input and output data2 are stored right after the struct
+typedef struct cache_entry cache_entry;
+struct cache_entry {
+    uint64_t key_hash;
+    uint64_t func_hash;
+    int in_data1;
+    size_t in_data2_len;
+    int out_data1;
+    size_t out_data2_len;
+
+    cache_entry* bucket_next;
+    cache_entry* lru_prev;
+    cache_entry* lru_next;
+
+    uint8_t bytes[];
+};
+
+typedef struct cache_shard {
+    pthread_mutex_t mutex;
+    cache_entry** buckets;
+    size_t n_buckets;
+
+    // Most recently used at the head
+    cache_entry* lru_head;
+    cache_entry* lru_tail;
+
+    size_t count;
+    size_t bytes;
+    size_t max_entries;
+    size_t max_bytes;
+} __attribute__((aligned(64))) cache_shard;
+
+struct result_cache {
+    cache_shard shards[CACHE_NUM_SHARDS];
+};
+
+// Combines the parts of a key into a single hash
+static uint64_t cache_key_hash(uint64_t func_hash, rpc_data* input);
+
+// Checks an entry is for exactly the given key
+static bool cache_entry_matches(cache_entry* entry, uint64_t key_hash,
+                                uint64_t func_hash, rpc_data* input);
+
+// Intrusive LRU list and bucket chain helpers, shard must be locked
+static void cache_lru_unlink(cache_shard* shard, cache_entry* entry);
+static void cache_lru_push_head(cache_shard* shard, cache_entry* entry);
+static void cache_remove(cache_shard* shard, cache_entry* entry);
+
+result_cache* cache_create(size_t max_entries, size_t max_bytes) {
+    result_cache* cache = aligned_alloc(64, sizeof(result_cache));
+    assert(cache != NULL);
+    memset(cache, 0, sizeof(result_cache));
+
+    // Every shard gets an equal share of the bounds
+    size_t shard_entries = max_entries / CACHE_NUM_SHARDS + 1;
+    size_t shard_bytes = max_bytes / CACHE_NUM_SHARDS;
+
+    // Power of two number of buckets with a load factor of at most 1
+    size_t n_buckets = 1;
+    while (n_buckets < shard_entries)
+        n_buckets *= 2;
+
+    for (int i=0; i<CACHE_NUM_SHARDS; i++) {
+        cache_shard* shard = &cache->shards[i];
+        pthread_mutex_init(&shard->mutex, NULL);
+        shard->buckets = calloc(n_buckets, sizeof(cache_entry*));
+        shard->n_buckets = n_buckets;
+        shard->max_entries = shard_entries;
+        shard->max_bytes = shard_bytes;
+    }
+
+    return cache;
+}
+
+void cache_destroy(result_cache* cache) {
+    if (cache == NULL)
+        return;
+
+    for (int i=0; i<CACHE_NUM_SHARDS; i++) {
+        cache_shard* shard = &cache->shards[i];
+        cache_entry* entry = shard->lru_head;
+        while (entry != NULL) {
+            cache_entry* next = entry->lru_next;
+            free(entry);
+            entry = next;
+        }
+        free(shard->buckets);
+        pthread_mutex_destroy(&shard->mutex);
+    }
+
+    free(cache);
+}
+
+rpc_data* cache_lookup(result_cache* cache, uint64_t func_hash, rpc_data* input) {
+    if (cache == NULL || input == NULL)
+        return NULL;
+
+    uint64_t key_hash = cache_key_hash(func_hash, input);
+    cache_shard* shard = &cache->shards[key_hash % CACHE_NUM_SHARDS];
+    rpc_data* output = NULL;
+
+    pthread_mutex_lock(&shard->mutex);
+
+    cache_entry* entry = shard->buckets[(key_hash / CACHE_NUM_SHARDS) & (shard->n_buckets - 1)];
+    while (entry != NULL && !cache_entry_matches(entry, key_hash, func_hash, input))
+        entry = entry->bucket_next;
+
+    if (entry != NULL) {
+
+        // Copy the result out while we still hold the lock
+        output = malloc(sizeof(rpc_data));
+        output->data1 = entry->out_data1;
+        output->data2_len = entry->out_data2_len;
+        output->data2 = NULL;
+        if (entry->out_data2_len) {
+            output->data2 = malloc(entry->out_data2_len);
+            memcpy(output->data2, &entry->bytes[entry->in_data2_len], entry->out_data2_len);
+        }
+
+        // Mark as most recently used
+        cache_lru_unlink(shard, entry);
+        cache_lru_push_head(shard, entry);
+    }
+
+    pthread_mutex_unlock(&shard->mutex);
+    return output;
+}
+
+void cache_insert(result_cache* cache, uint64_t func_hash, rpc_data* input, rpc_data* output) {
+    if (cache == NULL || input == NULL || output == NULL)
+        return;
+
+    uint64_t key_hash = cache_key_hash(func_hash, input);
+    cache_shard* shard = &cache->shards[key_hash % CACHE_NUM_SHARDS];
+
+    // Results that would take up the whole shard are not worth caching
+    size_t entry_bytes = input->data2_len + output->data2_len;
+    if (entry_bytes > shard->max_bytes)
+        return;
+
+    // Build the entry before taking the lock
+    cache_entry* new_entry = malloc(sizeof(cache_entry) + entry_bytes);
+    new_entry->key_hash = key_hash;
+    new_entry->func_hash = func_hash;
+    new_entry->in_data1 = input->data1;
+    new_entry->in_data2_len = input->data2_len;
+    new_entry->out_data1 = output->data1;
+    new_entry->out_data2_len = output->data2_len;
+    if (input->data2_len)
+        memcpy(new_entry->bytes, input->data2, input->data2_len);
+    if (output->data2_len)
+        memcpy(&new_entry->bytes[input->data2_len], output->data2, output->data2_len);
+
+    pthread_mutex_lock(&shard->mutex);
+
+    // Another thread may have raced us to it, in which case replace its entry
+    size_t bucket = (key_hash / CACHE_NUM_SHARDS) & (shard->n_buckets - 1);
+    for (cache_entry* entry = shard->buckets[bucket]; entry != NULL; entry = entry->bucket_next) {
+        if (cache_entry_matches(entry, key_hash, func_hash, input)) {
+            cache_remove(shard, entry);
+            break;
+        }
+    }
+
+    // Make room by evicting from the cold end
+    while (shard->lru_tail != NULL &&
+           (shard->count + 1 > shard->max_entries ||
+            shard->bytes + entry_bytes > shard->max_bytes)) {
+        cache_remove(shard, shard->lru_tail);
+    }
+
+    new_entry->bucket_next = shard->buckets[bucket];
+    shard->buckets[bucket] = new_entry;
+    cache_lru_push_head(shard, new_entry);
+    shard->count++;
+    shard->bytes += entry_bytes;
+
+    pthread_mutex_unlock(&shard->mutex);
+}
+
+void cache_invalidate(result_cache* cache, uint64_t func_hash) {
+    if (cache == NULL)
+        return;
+
+    for (int i=0; i<CACHE_NUM_SHARDS; i++) {
+        cache_shard* shard = &cache->shards[i];
+        pthread_mutex_lock(&shard->mutex);
+        cache_entry* entry = shard->lru_head;
+        while (entry != NULL) {
+            cache_entry* next = entry->lru_next;
+            if (entry->func_hash == func_hash)
+                cache_remove(shard, entry);
+            entry = next;
+        }
+        pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+static uint64_t cache_key_hash(uint64_t func_hash, rpc_data* input) {
+
+    // FNV-1a over data2
+    uint64_t hash_value = FNV_OFFSET_BASIS;
+    uint8_t* bytes = input->data2;
+    for (size_t i=0; i<input->data2_len; i++) {
+        hash_value ^= bytes[i];
+        hash_value *= FNV_PRIME;
+    }
+
+    // Then mix in the function and data1 so they spread across shards
+    hash_value ^= func_hash + 0x9e3779b97f4a7c15ULL + (hash_value << 6) + (hash_value >> 2);
+    hash_value ^= (uint64_t)(int64_t)input->data1 * 0xbf58476d1ce4e5b9ULL;
+    hash_value ^= hash_value >> 31;
+    hash_value *= 0x94d049bb133111ebULL;
+    hash_value ^= hash_value >> 29;
+    return hash_value;
+}
+
+static bool cache_entry_matches(cache_entry* entry, uint64_t key_hash,
+                                uint64_t func_hash, rpc_data* input) {
+    return entry->key_hash == key_hash &&
+           entry->func_hash == func_hash &&
+           entry->in_data1 == input->data1 &&
+           entry->in_data2_len == input->data2_len &&
+           (input->data2_len == 0 ||
+            memcmp(entry->bytes, input->data2, input->data2_len) == 0);
+}
+
+static void cache_lru_unlink(cache_shard* shard, cache_entry* entry) {
+    if (entry->lru_prev != NULL)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        shard->lru_head = entry->lru_next;
+
+    if (entry->lru_next != NULL)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        shard->lru_tail = entry->lru_prev;
+
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+static void cache_lru_push_head(cache_shard* shard, cache_entry* entry) {
+    entry->lru_prev = NULL;
+    entry->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL)
+        shard->lru_head->lru_prev = entry;
+    shard->lru_head = entry;
+    if (shard->lru_tail == NULL)
+        shard->lru_tail = entry;
+}
+
+static void cache_remove(cache_shard* shard, cache_entry* entry) {
+
+    // Unlink from its bucket
+    size_t bucket = (entry->key_hash / CACHE_NUM_SHARDS) & (shard->n_buckets - 1);
+    cache_entry** pNext = &shard->buckets[bucket];
+    while (*pNext != entry)
+        pNext = &(*pNext)->bucket_next;
+    *pNext = entry->bucket_next;
+
+    cache_lru_unlink(shard, entry);
+    shard->count--;
+    shard->bytes -= entry->in_data2_len + entry->out_data2_len;
+    free(entry);
+}
@@ -3,11 +3,6 @@
 // This is what the hashing function is based on
 #define CHOSEN_PRIME 97
 
-typedef struct hash_item {
-    uint64_t hash_value;
-    rpc_handler handler;
-} hash_item;
-
 typedef struct hash_table {
     size_t capacity;
     size_t count;
@@ -52,6 +47,14 @@ void _ht_destroy(hash_table** ppHt) {
     if (ppHt == NULL) 
         return;
 
+    // Free what each item owns
+    for (int i=0; i<(*ppHt)->count; i++) {
+        hash_item* item = &(*ppHt)->table[i];
+        FREE(item->name);
+        stats_destroy(item->stats);
+        bulkhead_destroy(item->bulkhead);
+    }
+
     // Deinitialise internal table
     memset((*ppHt)->table, 0, sizeof(hash_item)*(*ppHt)->capacity);
     FREE((*ppHt)->table);
@@ -63,9 +66,9 @@ void _ht_destroy(hash_table** ppHt) {
     FREE(*ppHt);
 }
 
-void ht_insert(hash_table* pHt, char* string, rpc_handler handler) {
-    if (pHt == NULL || string == NULL || handler == NULL)
-        return;
+hash_item* ht_insert(hash_table* pHt, char* string, rpc_handler handler) {
+    if (pHt == NULL || string == NULL)
+        return NULL;
         
     uint64_t hash_value = generate_hash(string);
 
@@ -74,7 +77,7 @@ void ht_insert(hash_table* pHt, char* string, rpc_handler handler) {
         hash_item* item = &pHt->table[i];
         if (item->hash_value == hash_value) {
             item->handler = handler;
-            return;
+            return item;
         }
     }
 
@@ -84,7 +87,14 @@ void ht_insert(hash_table* pHt, char* string, rpc_handler handler) {
 
     pHt->table[pHt->count].hash_value = hash_value;
     pHt->table[pHt->count].handler = handler;
+    pHt->table[pHt->count].async_handler = NULL;
+    pHt->table[pHt->count].stream_handler = NULL;
+    pHt->table[pHt->count].name = strdup(string);
+    pHt->table[pHt->count].stats = stats_create();
+    pHt->table[pHt->count].bulkhead = NULL;
+    pHt->table[pHt->count].flags = 0;
     pHt->count++;
+    return &pHt->table[pHt->count - 1];
 }
 
 void ht_delete(hash_table* pHt, char* string){
@@ -109,6 +119,9 @@ void ht_delete(hash_table* pHt, char* string){
     // Return if item not found in hash_table
     if (chosen == NULL) 
         return;
+    FREE(chosen->name);
+    stats_destroy(chosen->stats);
+    bulkhead_destroy(chosen->bulkhead);
 
     // Mimicking a pop in the hashtable
     if (offset == pHt->capacity - 1) {
@@ -139,12 +152,17 @@ rpc_handler ht_index(hash_table* pHt, char* string) {
 } 
 
 rpc_handler ht_index_with_hash(hash_table* pHt, uint64_t hash_value) {
+    hash_item* item = ht_find_with_hash(pHt, hash_value);
+    return item != NULL ? item->handler : NULL;
+}
+
+hash_item* ht_find_with_hash(hash_table* pHt, uint64_t hash_value) {
 
     // Search for hash_value in hashtable
     for (int i=0; i<pHt->count; i++) {
         hash_item* item = &pHt->table[i];
         if (item->hash_value == hash_value) {
-            return item->handler;
+            return item;
         }
     }
 
@@ -152,6 +170,22 @@ rpc_handler ht_index_with_hash(hash_table* pHt, uint64_t hash_value) {
     return NULL;
 }
 
+hash_item* ht_find(hash_table* pHt, char* string) {
+    if (pHt == NULL || string == NULL)
+        return NULL;
+    return ht_find_with_hash(pHt, generate_hash(string));
+}
+
+size_t ht_count(hash_table* pHt) {
+    return pHt->count;
+}
+
+hash_item* ht_item_at(hash_table* pHt, size_t index) {
+    if (index >= pHt->count)
+        return NULL;
+    return &pHt->table[index];
+}
+
 uint64_t ht_retrieve_hash(hash_table* pHt, rpc_handler handler) {
 
     // Search for handler in hash_table
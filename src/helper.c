@@ -1,5 +1,12 @@
 #include "helper.h"
 
+#include <poll.h>
+#include <sys/uio.h>
+
+// Makes room for nbytes in a buffer that is reused across reads. Sizes come off
+// the wire, so running out of memory is not a bug here
+static bool data_reserve(void** buff, size_t* capacity, size_t nbytes);
+
 bool is_valid_name(const char* name) {
 
     // Iterate over each character and check if each are valid
@@ -30,6 +37,26 @@ bool socket_recv(int socketfd, void* buff, size_t nbytes) {
     return true;
 }
 
+bool socket_recv_varint(int socketfd, uint64_t* value) {
+    uint64_t result = 0;
+    for (int i=0; i<BUFFER_VARINT_MAX; i++) {
+        uint8_t byte;
+        quick_check(socket_recv(socketfd, &byte, sizeof(uint8_t)));
+
+        // The last byte only has room left for the top bit of the value
+        if (i == BUFFER_VARINT_MAX - 1 && byte > 1)
+            return false;
+        result |= (uint64_t)(byte & 0x7F) << (7 * i);
+        if (!(byte & 0x80)) {
+            *value = result;
+            return true;
+        }
+    }
+
+    // Too long to be a 64-bit value
+    return false;
+}
+
 bool socket_send(int socketfd, void* buff, size_t nbytes) {
     uint8_t* p_buff = buff;
     size_t bytes_to_write = nbytes;
@@ -54,6 +81,15 @@ char* int_to_string(int integer) {
     return string;
 }
 
+void init_local_profile(hw_profile* profile) {
+    profile->int_max = INT_MAX;
+    profile->int_min = INT_MIN;
+    profile->size_max = SIZE_MAX;
+    profile->initialised = true;
+    profile->byte_order = RPC_ORDER_NATIVE;
+    profile->capabilities = RPC_CAPS_SUPPORTED;
+}
+
 rpc_error check_data(hw_profile* profile, rpc_data* data) {
 
     // If client hasn't completed the initialisation protocol, 
@@ -129,48 +165,355 @@ bool socket_send_data(int fd, rpc_data* input) {
     return true;
 }
 
+void buffer_put_data(byte_buffer* pBuf, rpc_data* input) {
+    if (input == NULL)
+        return;
+
+    rpc_data_flags flags_out = gen_data_flags(input);
+    buffer_reserve(pBuf, sizeof(rpc_data_flags) + 2*sizeof(uint64_t) + input->data2_len);
+    buffer_put_u8(pBuf, flags_out);
+
+    if (flags_out & RPC_DATA_INT)
+        buffer_put_u64(pBuf, (int64_t)input->data1);
+
+    if (flags_out & RPC_DATA_BUFF) {
+        buffer_put_u64(pBuf, input->data2_len);
+        buffer_put_bytes(pBuf, input->data2, input->data2_len);
+    }
+}
+
+void buffer_put_array(byte_buffer* pBuf, rpc_data* input, unsigned width, hw_profile* peer) {
+    if (input == NULL)
+        return;
+
+    // Peers that understand typed arrays convert for themselves if they need to,
+    // and those that understand varints get small values in a byte or two
+    rpc_data_flags flags_out = gen_data_flags(input);
+    bool is_array = width != 0 && (flags_out & RPC_DATA_BUFF);
+    bool is_typed = is_array && (peer->capabilities & RPC_CAP_TYPED_ARRAY);
+    bool is_varint = (peer->capabilities & RPC_CAP_VARINT) != 0;
+    if (is_typed)
+        flags_out |= array_data_flag(width);
+    if (is_varint)
+        flags_out |= RPC_DATA_VARINT;
+
+    buffer_reserve(pBuf, sizeof(rpc_data_flags) + 2*sizeof(uint64_t) + input->data2_len);
+    buffer_put_u8(pBuf, flags_out);
+
+    if (flags_out & RPC_DATA_INT) {
+        if (is_varint)
+            buffer_put_varint(pBuf, zigzag_encode(input->data1));
+        else
+            buffer_put_u64(pBuf, (int64_t)input->data1);
+    }
+
+    if (flags_out & RPC_DATA_BUFF) {
+        if (is_varint)
+            buffer_put_varint(pBuf, input->data2_len);
+        else
+            buffer_put_u64(pBuf, input->data2_len);
+        buffer_put_bytes(pBuf, input->data2, input->data2_len);
+    }
+
+    // Everyone else expects network byte order, so swap the copy in the buffer
+    if (is_array && !is_typed && RPC_ORDER_NATIVE != RPC_ORDER_BIG)
+        byteorder_swap(pBuf->data + pBuf->len - input->data2_len, input->data2_len / width, width);
+}
+
+bool data_array_to_native(rpc_data* data, rpc_data_flags flags, unsigned width, hw_profile* peer) {
+    if (data == NULL || width == 0)
+        return true;
+
+    if (check_array(data, width))
+        return false;
+
+    // Typed arrays arrive in the byte order of the peer, anything else in network order
+    rpc_byte_order order = RPC_ORDER_BIG;
+    if (flags & RPC_DATA_ARRAY) {
+        if (array_flag_width(flags) != width)
+            return false;
+        order = peer->byte_order;
+    }
+
+    if (order != RPC_ORDER_NATIVE)
+        byteorder_swap(data->data2, data->data2_len / width, width);
+    return true;
+}
+
+rpc_error check_array(rpc_data* data, unsigned width) {
+    if (data == NULL || width == 0)
+        return RPC_ERROR_NONE;
+
+    // Only whole elements make sense
+    if (data->data2_len % width != 0)
+        return RPC_ERROR_DATA_INVALID;
+
+    return RPC_ERROR_NONE;
+}
+
+rpc_data_flags array_data_flag(unsigned width) {
+    switch (width) {
+        case 2: return RPC_DATA_ARRAY16;
+        case 4: return RPC_DATA_ARRAY32;
+        case 8: return RPC_DATA_ARRAY64;
+        default: return RPC_DATA_NONE;
+    }
+}
+
+unsigned array_flag_width(rpc_data_flags flags) {
+    switch (flags & RPC_DATA_ARRAY) {
+        case RPC_DATA_ARRAY16: return 2;
+        case RPC_DATA_ARRAY32: return 4;
+        case RPC_DATA_ARRAY64: return 8;
+        default: return 0;
+    }
+}
+
 bool socket_recv_data(int fd, rpc_data** output) {
+    rpc_data_flags flags_in;
+    return socket_recv_data_flags(fd, output, &flags_in, NULL);
+}
+
+bool socket_recv_data_flags(int fd, rpc_data** output, rpc_data_flags* flags, data_admit* admit) {
 
-    if (output == NULL)
+    if (output == NULL || flags == NULL)
         return true; 
     else
         *output = NULL;
 
-    // Read in data flags
-    rpc_data_flags flags_in;
-    if (!socket_recv(fd, &flags_in, sizeof(rpc_data_flags))) {
+    // Starting from an empty buffer, data2 is allocated at exactly its size
+    rpc_data* recv_data = calloc(1, sizeof(rpc_data));
+    void* data2 = NULL;
+    size_t capacity = 0;
+    if (!socket_recv_data_into(fd, recv_data, flags, &data2, &capacity, admit)) {
+        free(data2);
+        free(recv_data);
         return false;
     }
-    
-    // Read in data payload based of data flags
+    if (admit != NULL && admit->is_refused) {
+        free(recv_data);
+        return true;
+    }
+    *output = recv_data;
+
+    return true;
+}
+
+bool buffer_get_data_flags(byte_buffer* pBuf, rpc_data** output, rpc_data_flags* flags, 
+                           data_admit* admit) {
+
+    if (output == NULL || flags == NULL)
+        return true;
+    else
+        *output = NULL;
+
     rpc_data* recv_data = calloc(1, sizeof(rpc_data));
+    void* data2 = NULL;
+    size_t capacity = 0;
+    if (!buffer_get_data_into(pBuf, recv_data, flags, &data2, &capacity, admit)) {
+        free(data2);
+        free(recv_data);
+        return false;
+    }
+    if (admit != NULL && admit->is_refused) {
+        free(recv_data);
+        return true;
+    }
+    *output = recv_data;
+
+    return true;
+}
+
+bool socket_recv_data_into(int fd, rpc_data* output, rpc_data_flags* flags, 
+                           void** buff, size_t* capacity, data_admit* admit) {
+
+    // Read in data flags
+    rpc_data_flags flags_in;
+    quick_check(socket_recv(fd, &flags_in, sizeof(rpc_data_flags)));
+    *flags = flags_in;
+    output->data1 = 0;
+    output->data2_len = 0;
+    output->data2 = NULL;
+
+    // Varints are only ever sent to peers that asked for them
+    bool is_varint = (flags_in & RPC_DATA_VARINT) != 0;
 
     if (flags_in & RPC_DATA_INT) {
-        int64_t be_data1;
-        if (!socket_recv(fd, &be_data1, sizeof(int64_t))) {
-            free(recv_data);
-            return false;
+        uint64_t wire_data1;
+        bool is_read = is_varint ?
+            socket_recv_varint(fd, &wire_data1) :
+            socket_recv(fd, &wire_data1, sizeof(int64_t));
+        quick_check(is_read);
+        output->data1 = is_varint ? zigzag_decode(wire_data1) : (int64_t)ntoh64(wire_data1);
+    }
+
+    if (flags_in & RPC_DATA_BUFF) {
+        uint64_t wire_data2_len;
+        bool is_read = is_varint ?
+            socket_recv_varint(fd, &wire_data2_len) :
+            socket_recv(fd, &wire_data2_len, sizeof(uint64_t));
+        quick_check(is_read);
+        uint64_t data2_len = is_varint ? wire_data2_len : ntoh64(wire_data2_len);
+
+        // Nothing is allocated for data2 until the length has been let through
+        if (admit != NULL && !admit->fn(admit->arg, data2_len)) {
+            admit->is_refused = true;
+            return socket_skip(fd, data2_len);
         }
-        recv_data->data1 = ntoh64(be_data1);
+
+        quick_check(data_reserve(buff, capacity, data2_len));
+        quick_check(socket_recv(fd, *buff, data2_len));
+        output->data2_len = data2_len;
+        output->data2 = data2_len > 0 ? *buff : NULL;
+    }
+
+    return true;
+}
+
+bool buffer_get_data_into(byte_buffer* pBuf, rpc_data* output, rpc_data_flags* flags, 
+                          void** buff, size_t* capacity, data_admit* admit) {
+
+    // Read in data flags
+    uint8_t flags_in;
+    quick_check(buffer_get_u8(pBuf, &flags_in));
+    *flags = flags_in;
+    output->data1 = 0;
+    output->data2_len = 0;
+    output->data2 = NULL;
+
+    bool is_varint = (flags_in & RPC_DATA_VARINT) != 0;
+
+    if (flags_in & RPC_DATA_INT) {
+        uint64_t data1;
+        bool is_read = is_varint ? buffer_get_varint(pBuf, &data1) : buffer_get_u64(pBuf, &data1);
+        quick_check(is_read);
+        output->data1 = is_varint ? zigzag_decode(data1) : (int64_t)data1;
     }
 
+    // The length has to fit in what was read in, so a bad one can't make us
+    // allocate more than the frame itself
     if (flags_in & RPC_DATA_BUFF) {
-        uint64_t be_data2_len;
-        if (!socket_recv(fd, &be_data2_len, sizeof(uint64_t))) {
-            free(recv_data);
+        uint64_t data2_len;
+        bool is_read = is_varint ? buffer_get_varint(pBuf, &data2_len) : buffer_get_u64(pBuf, &data2_len);
+        if (!is_read || data2_len > pBuf->len - pBuf->read_pos)
             return false;
+
+        if (admit != NULL && !admit->fn(admit->arg, data2_len)) {
+            admit->is_refused = true;
+            pBuf->read_pos += data2_len;
+            return true;
         }
-        recv_data->data2_len = ntoh64(be_data2_len);
 
-        uint8_t* net_data2 = malloc(recv_data->data2_len); 
-        if (!socket_recv(fd, net_data2, recv_data->data2_len)) {
-            free(net_data2);
-            free(recv_data);
+        quick_check(data_reserve(buff, capacity, data2_len));
+        if (data2_len > 0)
+            buffer_get_bytes(pBuf, *buff, data2_len);
+        output->data2_len = data2_len;
+        output->data2 = data2_len > 0 ? *buff : NULL;
+    }
+
+    return true;
+}
+
+static bool data_reserve(void** buff, size_t* capacity, size_t nbytes) {
+    if (nbytes <= *capacity)
+        return true;
+
+    void* data = realloc(*buff, nbytes);
+    if (data == NULL)
+        return false;
+    *buff = data;
+    *capacity = nbytes;
+    return true;
+}
+
+void frame_header_encode(rpc_frame_header* header, uint8_t bytes[RPC_FRAME_HEADER_SIZE]) {
+    uint16_t be_flags = htons(header->flags);
+    uint32_t be_request_id = htonl(header->request_id);
+    uint64_t be_body_len = hton64(header->body_len);
+
+    bytes[0] = RPC_MSG_FRAME;
+    bytes[1] = header->type;
+    memcpy(&bytes[2], &be_flags, sizeof(uint16_t));
+    memcpy(&bytes[4], &be_request_id, sizeof(uint32_t));
+    memcpy(&bytes[8], &be_body_len, sizeof(uint64_t));
+}
+
+bool frame_header_decode(uint8_t bytes[RPC_FRAME_HEADER_SIZE], rpc_frame_header* header) {
+    if (bytes[0] != RPC_MSG_FRAME)
+        return false;
+
+    uint16_t be_flags;
+    uint32_t be_request_id;
+    uint64_t be_body_len;
+    memcpy(&be_flags, &bytes[2], sizeof(uint16_t));
+    memcpy(&be_request_id, &bytes[4], sizeof(uint32_t));
+    memcpy(&be_body_len, &bytes[8], sizeof(uint64_t));
+
+    header->type = bytes[1];
+    header->flags = ntohs(be_flags);
+    header->request_id = ntohl(be_request_id);
+    header->body_len = ntoh64(be_body_len);
+    return true;
+}
+
+bool socket_send_frame(int fd, rpc_frame_header* header, void* body) {
+    uint8_t bytes[RPC_FRAME_HEADER_SIZE];
+    frame_header_encode(header, bytes);
+
+    struct iovec iov[2] = {
+        { .iov_base = bytes, .iov_len = sizeof(bytes) },
+        { .iov_base = body, .iov_len = header->body_len },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+
+    // Pick up where a partial write left off until both parts are out
+    while (msg.msg_iovlen > 0) {
+        ssize_t bytes_written = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (bytes_written < 0)
+            return false;
+
+        while (msg.msg_iovlen > 0 && (size_t)bytes_written >= msg.msg_iov->iov_len) {
+            bytes_written -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (uint8_t*)msg.msg_iov->iov_base + bytes_written;
+            msg.msg_iov->iov_len -= bytes_written;
         }
-        recv_data->data2 = net_data2;
     }
 
-    *output = recv_data;
+    return true;
+}
+
+bool socket_recv_buffer(int fd, byte_buffer* pBuf, size_t nbytes) {
+    buffer_clear(pBuf);
 
+    // Sizes come off the wire, so running out of memory is not a bug here
+    if (nbytes > pBuf->capacity) {
+        uint8_t* data = realloc(pBuf->data, nbytes);
+        if (data == NULL)
+            return false;
+        pBuf->data = data;
+        pBuf->capacity = nbytes;
+    }
+
+    quick_check(socket_recv(fd, pBuf->data, nbytes));
+    pBuf->len = nbytes;
+    return true;
+}
+
+bool socket_skip(int fd, uint64_t nbytes) {
+    uint8_t scratch[4096];
+    while (nbytes > 0) {
+        size_t chunk = nbytes < sizeof(scratch) ? nbytes : sizeof(scratch);
+        quick_check(socket_recv(fd, scratch, chunk));
+        nbytes -= chunk;
+    }
     return true;
-}
\ No newline at end of file
+}
+
+bool socket_is_readable(int fd) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
@@ -0,0 +1,151 @@
+#include "offload.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <time.h>
+
+typedef struct offload_task {
+    offload_fn fn;
+    void* arg;
+} offload_task;
+
+// Body of every thread of the pool
+static void* offload_thread(void* arg);
+
+offload_pool* offload_create(size_t max_threads) {
+    if (max_threads == 0)
+        return NULL;
+
+    offload_pool* pool = calloc(1, sizeof(offload_pool));
+    if (pool == NULL)
+        return NULL;
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->done_cond, NULL);
+
+    // Idle timeouts shouldn't stretch or shrink when the wall clock is changed
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&pool->task_cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    pool->max_threads = max_threads;
+    pool->tasks = list_create(true);
+    return pool;
+}
+
+void offload_destroy(offload_pool* pool) {
+    if (pool == NULL)
+        return;
+
+    // Threads run what's left and then exit rather than wait for more
+    pthread_mutex_lock(&pool->mutex);
+    pool->is_closing = true;
+    pthread_cond_broadcast(&pool->task_cond);
+    while (pool->n_threads > 0)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+
+    list_destroy(pool->tasks);
+    pthread_cond_destroy(&pool->task_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->mutex);
+    free(pool);
+}
+
+bool offload_submit(offload_pool* pool, offload_fn fn, void* arg) {
+    offload_task* task = malloc(sizeof(offload_task));
+    if (task == NULL)
+        return false;
+    task->fn = fn;
+    task->arg = arg;
+
+    // Past the bound the caller runs the work itself, which holds it up the
+    // same way the pool would if it were full
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->n_tasks >= pool->max_threads) {
+        pthread_mutex_unlock(&pool->mutex);
+        free(task);
+        return false;
+    }
+    list_insert_tail(pool->tasks, task);
+    pool->n_tasks++;
+
+    // Grow only when the idle threads can't take everything that's waiting
+    if (pool->n_tasks > pool->n_idle && pool->n_threads < pool->max_threads) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, offload_thread, pool) == 0) {
+            pthread_detach(thread);
+            pool->n_threads++;
+        }
+    }
+
+    // With no thread to ever pick it up, hand the work back
+    if (pool->n_threads == 0) {
+        list_pop_tail(pool->tasks);
+        pool->n_tasks--;
+        pthread_mutex_unlock(&pool->mutex);
+        return false;
+    }
+
+    // Otherwise one of the threads will free up eventually
+    pthread_cond_signal(&pool->task_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+void offload_wait(offload_pool* pool) {
+    if (pool == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (pool->n_tasks > 0 || pool->n_idle < pool->n_threads)
+        pthread_cond_wait(&pool->done_cond, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+static void* offload_thread(void* arg) {
+    offload_pool* pool = arg;
+
+    pthread_mutex_lock(&pool->mutex);
+    while (true) {
+
+        // Run whatever is waiting, without holding the lock
+        if (pool->tasks->head != NULL) {
+            offload_task task = *(offload_task*)pool->tasks->head->data;
+            list_pop_head(pool->tasks);
+            pool->n_tasks--;
+            pthread_mutex_unlock(&pool->mutex);
+
+            task.fn(task.arg);
+
+            pthread_mutex_lock(&pool->mutex);
+            continue;
+        }
+
+        if (pool->is_closing)
+            break;
+
+        // Nothing to do, so wait for more work, but not forever
+        uint64_t deadline_ns = stats_now_ns() + OFFLOAD_IDLE_TIMEOUT_NS;
+        struct timespec deadline = {
+            .tv_sec = deadline_ns / 1000000000ULL,
+            .tv_nsec = deadline_ns % 1000000000ULL,
+        };
+
+        pool->n_idle++;
+        pthread_cond_broadcast(&pool->done_cond);
+        int result = 0;
+        while (pool->tasks->head == NULL && !pool->is_closing && result != ETIMEDOUT)
+            result = pthread_cond_timedwait(&pool->task_cond, &pool->mutex, &deadline);
+        pool->n_idle--;
+
+        if (result == ETIMEDOUT && pool->tasks->head == NULL)
+            break;
+    }
+
+    pool->n_threads--;
+    pthread_cond_broadcast(&pool->done_cond);
+    pthread_mutex_unlock(&pool->mutex);
+    return NULL;
+}
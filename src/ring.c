@@ -0,0 +1,86 @@
+#include "ring.h"
+
+// Hashes a server's name and point number onto the ring
+static uint64_t ring_hash_point(char* addr, int port, unsigned vnode);
+
+// Spreads keys over the ring, since nearby keys would otherwise land together
+static uint64_t ring_hash_key(uint64_t key);
+
+// Orders points around the ring
+static int ring_point_cmp(const void* a, const void* b);
+
+hash_ring* ring_create(char** addrs, int* ports, size_t count) {
+    if (addrs == NULL || ports == NULL || count == 0)
+        return NULL;
+
+    hash_ring* ring = calloc(1, sizeof(hash_ring));
+    ring->n_points = count * RING_VNODES;
+    ring->points = calloc(ring->n_points, sizeof(ring_point));
+
+    for (size_t i=0; i<count; i++) {
+        for (unsigned v=0; v<RING_VNODES; v++) {
+            ring_point* point = &ring->points[i * RING_VNODES + v];
+            point->hash = ring_hash_point(addrs[i], ports[i], v);
+            point->index = i;
+        }
+    }
+    qsort(ring->points, ring->n_points, sizeof(ring_point), ring_point_cmp);
+    return ring;
+}
+
+void ring_destroy(hash_ring* ring) {
+    if (ring == NULL)
+        return;
+
+    free(ring->points);
+    free(ring);
+}
+
+size_t ring_lookup(hash_ring* ring, uint64_t key) {
+    uint64_t hash = ring_hash_key(key);
+
+    // First point at or after the hash, wrapping around past the last one
+    size_t low = 0;
+    size_t high = ring->n_points;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (ring->points[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return ring->points[low == ring->n_points ? 0 : low].index;
+}
+
+static uint64_t ring_hash_point(char* addr, int port, unsigned vnode) {
+
+    // FNV-1a over "addr:port#vnode"
+    char name[NI_MAXHOST + 32];
+    snprintf(name, sizeof(name), "%s:%d#%u", addr, port, vnode);
+
+    uint64_t hash = 14695981039346656037ULL;
+    for (char* c = name; *c; c++) {
+        hash ^= (uint8_t)*c;
+        hash *= 1099511628211ULL;
+    }
+
+    // FNV leaves similar names close together, so mix it like a key
+    return ring_hash_key(hash);
+}
+
+static uint64_t ring_hash_key(uint64_t key) {
+
+    // Finaliser of splitmix64
+    key ^= key >> 30;
+    key *= 0xbf58476d1ce4e5b9ULL;
+    key ^= key >> 27;
+    key *= 0x94d049bb133111ebULL;
+    key ^= key >> 31;
+    return key;
+}
+
+static int ring_point_cmp(const void* a, const void* b) {
+    uint64_t left = ((ring_point*)a)->hash;
+    uint64_t right = ((ring_point*)b)->hash;
+    return (left > right) - (left < right);
+}
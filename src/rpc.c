@@ -2,52 +2,436 @@
 
 #include "defines.h"
 #include "rpc.h"
+#include "rpc_ext.h"
 #include "rpc_types.h"
 #include "helper.h"
 #include "hashtable.h"
 #include "linked_list.h"
+#include "buffer.h"
+#include "stats.h"
+#include "trace.h"
+#include "cache.h"
+#include "scheduler.h"
+#include "balancer.h"
+#include "ring.h"
+#include "topology.h"
+#include "arena.h"
+#include "offload.h"
 
 #include <unistd.h>
 #include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdatomic.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
 
 #define THREAD_POOL_SIZE 10
 #define SOCKET_BACKLOG 10
 #define SOCKET_NULL_HANDLE -1
 
+typedef struct rpc_worker rpc_worker;
+
+// A connection, along with what its client told us in the handshake. Whole
+// connections are queued, since they can go back in the queue mid-session
+typedef struct queued_client {
+    int clientfd;
+    int node;
+    hw_profile profile;
+} queued_client;
+
+typedef struct rpc_pool_backend rpc_pool_backend;
+typedef struct rpc_pool_leg rpc_pool_leg;
+
 // Thread related functions
 static void* thread_work(void* arg);
-static void handle_client(int clientfd, rpc_server* srv);
+
+// Serves the client until it disconnects, or until it's handed off to another
+// thread, in which case true is returned and the connection is left open
+static bool handle_client(queued_client* client, rpc_worker* worker);
+
+// Pins the calling worker to its CPUs, if the server was asked to
+static void svr_pin_worker(rpc_worker* worker);
+
+// Frees the result of a handler, leaving whatever it took from the arena
+static void svr_release_output(arena* ar, rpc_data* output);
+
+// Arena of the worker running a handler on this thread, NULL outside handlers
+static __thread arena* svr_call_arena = NULL;
+
+// Arena of the offload thread this is, made for its first call and kept for
+// the rest, then destroyed once the thread exits
+static __thread arena* svr_offload_arena = NULL;
+static pthread_key_t svr_offload_key;
+static pthread_once_t svr_offload_key_once = PTHREAD_ONCE_INIT;
+static arena* svr_local_offload_arena(void);
+static void svr_create_offload_key(void);
+static void svr_destroy_offload_arena(void* ar);
+
+// The request being handled by this thread, if it came in a v2 frame. Its body
+// has already been read in whole, and the reply goes back in a frame too
+typedef struct svr_frame {
+    bool is_framed;
+    uint32_t request_id;
+    byte_buffer* body;
+
+    // The body didn't fit the memory budget, so was skipped rather than read in
+    bool is_over_budget;
+
+    // The client negotiated RPC_CAP_WIDE_ERRORS, so errors go back in two bytes
+    bool is_error_wide;
+} svr_frame;
+static __thread svr_frame svr_request = { 0 };
+
+// Reads in the rest of a frame's header and then its body, handing back the
+// message it carries
+static bool svr_recv_frame(int clientfd, rpc_worker* worker, rpc_message* message);
+
+// Handlers read requests and send replies through these, so they work the
+// same whether or not the request came in a frame
+static bool svr_recv(int clientfd, void* buff, size_t nbytes);
+static bool svr_recv_data_flags(int clientfd, rpc_server* srv, rpc_data** output, rpc_data_flags* flags);
+static bool svr_send_reply(int clientfd, void* reply, size_t nbytes);
+
+// Charges nbytes of a request to the memory budget of its connection and of the
+// server, or returns false without charging anything if either would overflow
+static bool svr_mem_charge(rpc_server* srv, uint64_t nbytes);
+static void svr_mem_refund(rpc_server* srv, size_t nbytes);
+
+// svr_mem_charge() in the form socket_recv_data_flags() asks with
+static bool svr_admit_data(void* arg, uint64_t data2_len);
+
+// Bytes the request being handled by this thread has been charged so far.
+// A connection only ever has one request in progress, so this is also what
+// the connection holds against its own budget
+static __thread size_t svr_mem_charged = 0;
+
+// Frame bodies up to this size are kept for the next request rather than freed
+#define SVR_REQUEST_KEEP_BYTES (64 * 1024)
+
+// How long a drain waits for requests in progress before cutting off the
+// connections they came in on
+#define SVR_DRAIN_TIMEOUT_NS 10000000000ULL
+
+// Finds the queued client a worker on the given node should take next, if any
+static node* svr_next_client(rpc_server* srv, int node_index);
+
+// Puts a connection back in the queue for the next free worker
+static void svr_requeue_client(rpc_server* srv, queued_client* client);
+
+// Shutdown and hot restart related functions
+static bool svr_accept_handoff(rpc_server* srv);
+static void svr_drain(rpc_server* srv);
+
+// Reads in the message leading the next request of an idle client. Returns
+// false if the client hung up, or if the server started draining first
+static bool svr_recv_message(rpc_server* srv, int clientfd, rpc_message* message);
+
+// Tells a client the server is too busy to take it, then hangs up
+static void svr_reject_client(rpc_server* srv, int clientfd);
+
+// Scheduling class of a function, from its RPC_FUNC_* flags
+static sched_class svr_func_class(uint32_t flags);
+
+// Element width of data2 of a function, from its RPC_FUNC_* flags. 0 if not an array
+static unsigned svr_func_width(uint32_t flags);
 
 // Each of these functions are simply a wrapper for socket reading/writing logic,
 // They return true if the one side did not disconnect from the other for the duration of the 
 // function. Otherwise they will return false and the machine is expected to close the given
 // socket
 
+// A call whose function has been found, carrying everything needed to run it
+// and reply to it, so that this can be done from another thread
+typedef struct svr_call {
+    rpc_server* srv;
+    hash_item* function;
+    rpc_data* input;
+    uint64_t hash_value;
+    unsigned width;
+    bool is_cacheable;
+    bool is_cached;
+    uint64_t start_ns;
+    uint64_t bytes_in;
+
+    // Memory the request was charged, refunded once it has been answered
+    size_t mem_charged;
+
+    // Connection to reply on, and how the request came in
+    queued_client client;
+    svr_frame request;
+
+    // Request the phases of the call are traced against, whichever thread
+    // finishes it
+    trace_context trace;
+} svr_call;
+
+// A call to an async handler, waiting for rpc_complete
+struct rpc_completion {
+    svr_call call;
+};
+
+// Takes a slot for the call within its function's concurrency limit. Returns
+// false if the call was turned away
+static bool svr_admit_call(svr_call* call);
+
+// Runs the handler of a call within its limits. Returns false if the call was
+// turned away, otherwise the result is in output
+static bool svr_run_handler(svr_call* call, arena* ar, rpc_data** output);
+
+// Hands a call to its async handler and the connection over to the call
+static bool svr_start_async(svr_call* call, rpc_worker* worker);
+
+// Checks the result of a call and sends it, then frees the call's input. The
+// reply is built in the given packet
+static bool svr_finish_call(svr_call* call, rpc_data* output, byte_buffer* packet, arena* ar);
+
+// Runs an RPC_FUNC_BLOCKING call on the offload pool, then hands the connection
+// back to the workers
+static void svr_offload_call(void* arg);
+
+// A call to a stream handler, along with how far the client lets it get ahead
+struct rpc_stream {
+    svr_call* call;
+    rpc_worker* worker;
+    uint64_t credits;
+    uint32_t window;
+
+    // Items sent since the client's socket was last checked for credit
+    uint32_t n_unpolled;
+    uint64_t bytes_out;
+    rpc_error error;
+    bool is_cancelled;
+    bool is_connected;
+};
+
+// Most items a stream sends without checking whether it was cancelled
+#define SVR_STREAM_POLL_ITEMS 64
+
+// Runs a stream handler on this thread, then ends the stream
+static bool svr_run_stream(svr_call* call, rpc_worker* worker, uint32_t window);
+
+// Reads in the next message of a stream's client, which must grant it credit
+static bool svr_stream_take_credit(rpc_stream* stream);
+
+// Reads the rest of an RPC_MSG_STREAM_CREDIT packet
+static bool svr_recv_credit(int clientfd, uint32_t* credits);
+
 // Functions called by server
-static bool svr_handle_msg_connect(int clientfd, hw_profile* cl_profile);
+static bool svr_handle_msg_connect(int clientfd, hw_profile* cl_profile, bool is_ext);
 static bool svr_handle_msg_find(int clientfd, hw_profile* cl_profile, hash_table* ht_fnc);
-static bool svr_handle_msg_call(int clientfd, hw_profile* cl_profile, hash_table* ht_fnc);
+static bool svr_handle_msg_call(int clientfd, hw_profile* cl_profile, rpc_worker* worker, bool is_stream);
+static bool svr_handle_msg_credit(int clientfd);
+static bool svr_handle_msg_stats(int clientfd, hw_profile* cl_profile, rpc_server* srv);
+static bool svr_handle_msg_load(int clientfd, hw_profile* cl_profile, rpc_server* srv);
 static bool svr_handle_rtn_error(int clientfd, rpc_error error);
 
+// The single byte an error is sent as to clients without RPC_CAP_WIDE_ERRORS
+static uint8_t svr_error_legacy(rpc_error error);
+
 // Functions called by client
-static bool cl_handle_proc_connect(int serverfd, hw_profile* svr_profile);
-static bool cl_handle_proc_find(int serverfd, char* char_buff, uint16_t length, rpc_handle** output);
-static bool cl_handle_proc_call(int serverfd, rpc_handle* handle, rpc_data* input, rpc_data** output);
-static bool cl_handle_rtn_error(int serverfd);
+static bool cl_handle_proc_find(rpc_client* cl, char* char_buff, uint16_t length, rpc_handle** output);
+static bool cl_handle_proc_call(rpc_client* cl, rpc_handle* handle, rpc_data* input, rpc_data** output);
+
+// The two halves of cl_handle_proc_call(), so that a pool can wait on several
+// servers for the same call
+static bool cl_send_call(rpc_client* cl, rpc_handle* handle, rpc_data* input);
+static bool cl_recv_call(rpc_client* cl, rpc_handle* handle, rpc_data** output);
+
+// Reads the rpc_data of a reply and the end of its packet
+static bool cl_recv_output(rpc_client* cl, unsigned elem_width, rpc_data** output);
+
+// Same as cl_recv_call() and cl_recv_output(), but into memory kept by the
+// caller. has_output is false if the reply was an error or was invalid
+static bool cl_recv_call_into(rpc_client* cl, rpc_handle* handle, 
+                              rpc_response* response, bool* has_output);
+static bool cl_recv_response(rpc_client* cl, unsigned elem_width, 
+                             rpc_response* response, bool* has_output);
+
+// A stream being read by the client, and the credit it still has to give back
+struct rpc_iter {
+    rpc_client* cl;
+    uint8_t elem_width;
+    uint32_t window;
+    uint32_t n_unacked;
+    bool is_finished;
+    bool is_cancelled;
+};
+
+// Stream counterparts of the above. Credit is handed back as items are read
+static bool cl_send_stream_call(rpc_client* cl, rpc_handle* handle, rpc_data* input, uint32_t window);
+static bool cl_recv_item(rpc_iter* it, rpc_data** output);
+static bool cl_send_credit(rpc_client* cl, uint32_t credits);
+
+// Checks that the payload of a call will not overflow on the server
+static bool cl_check_payload(rpc_client* cl, rpc_handle* h, rpc_data* payload);
+static bool cl_handle_proc_stats(rpc_client* cl, rpc_stats** output, size_t* count);
+static bool cl_handle_proc_load(rpc_client* cl, rpc_load* output);
+static bool cl_handle_rtn_connect(rpc_client* cl, hw_profile* svr_profile);
+
+// The handshake is never sent on its own. It goes out in the same write as the
+// first request, and its reply is read just before the reply to that request
+static void cl_begin_request(rpc_client* cl);
+static bool cl_send_request(rpc_client* cl);
+
+// Reads in the message leading the reply to the last request, along with the
+// rest of the reply if it came in a frame
+static bool cl_recv_rtn(rpc_client* cl, rpc_message* message);
+
+// The rest of the reply is read through these, which work the same whether
+// or not it came in a frame
+static bool cl_recv(rpc_client* cl, void* buff, size_t nbytes);
+static bool cl_recv_data_into(rpc_client* cl, rpc_response* response, rpc_data_flags* flags);
+
+// Connects to a server of the pool if it isn't already. Lock the backend first
+static bool pool_connect(rpc_pool_backend* backend);
+
+// Whether a failed request should count against the server it was sent to
+static bool pool_is_failure(bool is_ok);
+
+// Drops the connection to a server of the pool. Lock the backend first
+static void pool_disconnect(rpc_pool_backend* backend);
+
+// Works out how long to give a call before hedging it, returns false if it
+// shouldn't be hedged
+static bool pool_hedge_delay(rpc_pool* pool, rpc_handle* h, uint64_t* delay_ns);
+
+// Sends a call to one server and, if it is slow to answer, to a second one
+static rpc_data* pool_call_hedged(rpc_pool* pool, rpc_handle* h, rpc_data* payload, uint64_t delay_ns);
+
+// Sends the call for one leg of a hedged call. On failure the leg is finished
+static bool pool_leg_send(rpc_pool* pool, rpc_pool_leg* leg, rpc_handle* h, rpc_data* payload);
+
+// Reads the reply to a leg of a hedged call and finishes it
+static rpc_data* pool_leg_recv(rpc_pool* pool, rpc_pool_leg* leg, rpc_handle* h);
+
+// Cuts off a leg whose reply won't be waited for, and finishes it
+static void pool_leg_abandon(rpc_pool* pool, rpc_pool_leg* leg);
+
+// Waits for a reply on any of the legs still pending, returning its index or
+// -1 if none arrived within timeout_ns (-1 to wait forever)
+static int pool_legs_wait(rpc_pool_leg* legs, int n_legs, int64_t timeout_ns);
+
+// Keeps track of how long calls to a function take, for working out when to hedge
+static void handle_record_latency(rpc_handle* h, uint64_t latency_ns);
+static int handle_compare_samples(const void* a, const void* b);
+
+// Opens a new connection to the server, leaving the handshake pending
+static bool cl_open(rpc_client* cl);
+
+// Replaces a dead connection, backing off between attempts. Returns false if
+// the client isn't set to reconnect or the server could not be reached
+static bool cl_reconnect(rpc_client* cl);
+static bool cl_handle_rtn_error(rpc_client* cl);
+
+// Reads in the rest of an error reply into cl_last_error, without reporting it
+static bool cl_recv_rtn_error(rpc_client* cl);
 static void cl_print_rtn_error(rpc_error error);
 
-// Standardised destroy functions for client and server
+// Error flags of the last reply this thread received, see rpc_last_error()
+static __thread rpc_error cl_last_error = RPC_ERROR_NONE;
+
+// Every 64-bit field of rpc_stats, in the order they are sent in
+#define RPC_STATS_NUM_FIELDS (5 + RPC_STATS_NUM_ERRORS + 6)
+static void rpc_stats_fields(rpc_stats* stats, uint64_t* fields[RPC_STATS_NUM_FIELDS]);
+
+// Standardised create/destroy functions for client and server
+static rpc_server* rpc_create_server(void);
 static void rpc_destroy_server(rpc_server* srv);
 static void rpc_destroy_client(rpc_client* cl);
 
+// A thread from the pool
+struct rpc_worker {
+    rpc_server* srv;
+    pthread_t thread;
+
+    // Where the worker runs, see rpc_server_set_affinity()
+    int index;
+    int node;
+
+    // Reused for building replies so that each is sent with a single write
+    byte_buffer packet;
+
+    // Reused for reading in the body of framed requests
+    byte_buffer request;
+
+    // Results of handlers, reset once each reply is built
+    arena* arena;
+
+    // Socket of the connection being served, SOCKET_NULL_HANDLE between
+    // connections. Protected by mutex_list_fd, so that a drain running out of
+    // time can cut it off while it's still open
+    int clientfd;
+
+    // Client being served, and whether it has been handed off to another thread
+    queued_client* client;
+    bool is_handed_off;
+};
+
 struct rpc_server {
     hash_table* hash_table;
     list* list_fd;
     pthread_cond_t client_cond;
     pthread_mutex_t mutex_list_fd;
     int masterfd;
+
+    // Shutdown and hot restart
+    rpc_worker workers[THREAD_POOL_SIZE];
+    atomic_bool is_draining;
+    int wakefd[2];
+
+    // Becomes readable, and stays that way, once the server starts draining,
+    // so that workers waiting on idle clients notice
+    int drainfd[2];
+    int handofffd;
+    char* handoff_path;
+
+    // Limits of this machine, for checking data sent by clients
+    hw_profile profile;
+
+    // Calls that could not be linked to a registered function
+    func_stats* unmatched_stats;
+
+    // Results of RPC_FUNC_PURE functions, created when the first is registered
+    result_cache* cache;
+    size_t cache_max_entries;
+    size_t cache_max_bytes;
+
+    // Admission control, a limit of 0 means unbounded. n_queued and
+    // n_idle are protected by mutex_list_fd
+    size_t max_queued_clients;
+    size_t max_inflight_calls;
+    size_t n_queued;
+    size_t n_idle;
+    atomic_size_t n_inflight;
+    atomic_uint_fast64_t n_rejected_clients;
+    atomic_uint_fast64_t n_rejected_calls;
+
+    // Memory held by requests not yet answered, see rpc_server_set_mem_budget()
+    size_t max_conn_bytes;
+    size_t max_total_bytes;
+    atomic_size_t n_mem_bytes;
+    atomic_uint_fast64_t n_rejected_payloads;
+
+    // Run slots handed out by priority, NULL when every call runs straight away
+    scheduler* scheduler;
+
+    // Threads for RPC_FUNC_BLOCKING handlers, created when the first is registered
+    offload_pool* offload;
+    size_t offload_max_threads;
+
+    // Calls to async handlers not yet completed, protected by mutex_list_fd
+    size_t n_async_pending;
+
+    // Placement of workers, NULL when they run anywhere and take any client.
+    // Idle workers are also counted per node, under mutex_list_fd
+    unsigned affinity;
+    topology* topology;
+    size_t* n_node_idle;
 };
 
 rpc_server* rpc_init_server(int port) {
@@ -56,12 +440,9 @@ rpc_server* rpc_init_server(int port) {
         return NULL;
 
     // Allocate set server data to default
-    rpc_server* new_srv = calloc(1, sizeof(rpc_server));
-    new_srv->hash_table = ht_create();
-    new_srv->list_fd = list_create(true);
-    pthread_cond_init(&new_srv->client_cond, NULL);
-    pthread_mutex_init(&new_srv->mutex_list_fd, NULL);
-    new_srv->masterfd = SOCKET_NULL_HANDLE;
+    rpc_server* new_srv = rpc_create_server();
+    if (new_srv == NULL)
+        return NULL;
 
     // Generate information about local machine
     char* port_string = int_to_string(port);
@@ -102,6 +483,7 @@ rpc_server* rpc_init_server(int port) {
 
     // Check if we failed to socket
     if (new_srv->masterfd < 0) {
+        freeaddrinfo(svr_info);
         rpc_destroy_server(new_srv);
         perror("socket() failed!\n");
         return NULL;
@@ -116,6 +498,8 @@ rpc_server* rpc_init_server(int port) {
                             SO_REUSEADDR, 
                             &opt_val, sizeof(opt_val))) < 0) 
         {
+        freeaddrinfo(svr_info);
+        rpc_destroy_server(new_srv);
         perror("setsocketopt() failed!\n");
         return NULL;
     }
@@ -127,24 +511,35 @@ rpc_server* rpc_init_server(int port) {
                         chosen_info->ai_addr, 
                         chosen_info->ai_addrlen)) < 0) 
         {
+        freeaddrinfo(svr_info);
+        rpc_destroy_server(new_srv);
         perror("bind() failed!\n");
         return NULL;
     }
 
+    // Remember to free the linked list
+    freeaddrinfo(svr_info);
+
     // Start listening for clients
     if (listen(new_srv->masterfd, SOCKET_BACKLOG) == -1) {
+        rpc_destroy_server(new_srv);
         perror("listen() failed!\n");
         return NULL;
     }
 
-    // Remember to free the linked list
-    freeaddrinfo(svr_info);
+    // The serving loop polls before accepting, so a client that resets in
+    // between must not leave accept() blocked
+    fcntl(new_srv->masterfd, F_SETFL, fcntl(new_srv->masterfd, F_GETFL) | O_NONBLOCK);
 
     // Return server to user
     return new_srv;
 }
 
 int rpc_register(rpc_server* srv, char* name, rpc_handler handler) {
+    return rpc_register_ex(srv, name, handler, 0);
+}
+
+int rpc_register_ex(rpc_server* srv, char* name, rpc_handler handler, unsigned flags) {
     if (srv == NULL || name == NULL || handler == NULL)
         return -1;
 
@@ -152,8 +547,173 @@ int rpc_register(rpc_server* srv, char* name, rpc_handler handler) {
     if (!is_valid_name(name))
         return -1;
     
-    // Otherwise create name handler pair in hashtable
-    ht_insert(srv->hash_table, name, handler);
+    // Otherwise create name handler pair in hashtable. Results cached for a
+    // function of the same name came from the handler being replaced
+    hash_item* function = ht_insert(srv->hash_table, name, handler);
+    function->async_handler = NULL;
+    function->stream_handler = NULL;
+
+    // Only rpc_register_stream can make a stream
+    function->flags = flags & ~RPC_FUNC_STREAM;
+    cache_invalidate(srv->cache, function->hash_value);
+
+    // Only pay for a cache once something can use it
+    if ((flags & RPC_FUNC_PURE) && srv->cache == NULL &&
+        srv->cache_max_entries > 0 && srv->cache_max_bytes > 0)
+        srv->cache = cache_create(srv->cache_max_entries, srv->cache_max_bytes);
+
+    // Likewise for threads to block on
+    if ((flags & RPC_FUNC_BLOCKING) && srv->offload == NULL)
+        srv->offload = offload_create(srv->offload_max_threads);
+
+    return 1;
+}
+
+int rpc_register_async(rpc_server* srv, char* name, rpc_async_handler handler, unsigned flags) {
+    if (srv == NULL || name == NULL || handler == NULL)
+        return -1;
+
+    if (!is_valid_name(name))
+        return -1;
+
+    // Async functions never block a thread, so never need the offload pool,
+    // and reply once rather than streaming
+    hash_item* function = ht_insert(srv->hash_table, name, NULL);
+    function->async_handler = handler;
+    function->stream_handler = NULL;
+    function->flags = flags & ~(RPC_FUNC_BLOCKING | RPC_FUNC_STREAM);
+    cache_invalidate(srv->cache, function->hash_value);
+
+    if ((flags & RPC_FUNC_PURE) && srv->cache == NULL &&
+        srv->cache_max_entries > 0 && srv->cache_max_bytes > 0)
+        srv->cache = cache_create(srv->cache_max_entries, srv->cache_max_bytes);
+
+    return 1;
+}
+
+int rpc_register_stream(rpc_server* srv, char* name, rpc_stream_handler handler, unsigned flags) {
+    if (srv == NULL || name == NULL || handler == NULL)
+        return -1;
+
+    if (!is_valid_name(name))
+        return -1;
+
+    // Streams run where they are called and can't be cached, and clients
+    // need to know they're streams to call them
+    hash_item* function = ht_insert(srv->hash_table, name, NULL);
+    function->async_handler = NULL;
+    function->stream_handler = handler;
+    function->flags = (flags & ~(RPC_FUNC_PURE | RPC_FUNC_BLOCKING)) | RPC_FUNC_STREAM;
+    cache_invalidate(srv->cache, function->hash_value);
+    return 1;
+}
+
+int rpc_server_set_limits(rpc_server* srv, size_t max_queued_clients, size_t max_inflight_calls) {
+    if (srv == NULL)
+        return -1;
+
+    srv->max_queued_clients = max_queued_clients;
+    srv->max_inflight_calls = max_inflight_calls;
+    return 1;
+}
+
+int rpc_server_set_mem_budget(rpc_server* srv, size_t max_conn_bytes, size_t max_total_bytes) {
+    if (srv == NULL)
+        return -1;
+
+    srv->max_conn_bytes = max_conn_bytes;
+    srv->max_total_bytes = max_total_bytes;
+    return 1;
+}
+
+int rpc_server_set_func_limit(rpc_server* srv, char* name, 
+                              size_t max_concurrent, size_t max_waiting) {
+    if (srv == NULL || name == NULL)
+        return -1;
+
+    hash_item* function = ht_find(srv->hash_table, name);
+    if (function == NULL)
+        return -1;
+
+    bulkhead_destroy(function->bulkhead);
+    function->bulkhead = bulkhead_create(max_concurrent, max_waiting);
+    return 1;
+}
+
+int rpc_server_set_scheduler(rpc_server* srv, size_t max_running) {
+    if (srv == NULL)
+        return -1;
+
+    sched_destroy(srv->scheduler);
+    srv->scheduler = sched_create(max_running);
+    return 1;
+}
+
+int rpc_server_set_offload(rpc_server* srv, size_t max_threads) {
+    if (srv == NULL)
+        return -1;
+
+    srv->offload_max_threads = max_threads;
+
+    // Rebuild the pool with the new bound if it is in use
+    bool is_needed = false;
+    for (size_t i=0; i<ht_count(srv->hash_table); i++)
+        is_needed |= (ht_item_at(srv->hash_table, i)->flags & RPC_FUNC_BLOCKING) != 0;
+
+    offload_destroy(srv->offload);
+    srv->offload = is_needed ? offload_create(max_threads) : NULL;
+    return 1;
+}
+
+int rpc_server_set_affinity(rpc_server* srv, unsigned affinity) {
+    if (srv == NULL || affinity > RPC_AFFINITY_CORE)
+        return -1;
+
+    topology* topo = NULL;
+    if (affinity != RPC_AFFINITY_NONE && (topo = topology_create()) == NULL)
+        return -1;
+
+    topology_destroy(srv->topology);
+    srv->topology = topo;
+    srv->affinity = affinity;
+    FREE(srv->n_node_idle);
+    srv->n_node_idle = calloc(topo ? topo->n_nodes : 1, sizeof(size_t));
+    return 1;
+}
+
+int rpc_server_load(rpc_server* srv, rpc_load* output) {
+    if (srv == NULL || output == NULL)
+        return -1;
+
+    pthread_mutex_lock(&srv->mutex_list_fd);
+    output->queued_clients = srv->n_queued > srv->n_idle ? srv->n_queued - srv->n_idle : 0;
+    pthread_mutex_unlock(&srv->mutex_list_fd);
+
+    output->inflight_calls = atomic_load(&srv->n_inflight);
+    output->rejected_clients = atomic_load(&srv->n_rejected_clients);
+    output->rejected_calls = atomic_load(&srv->n_rejected_calls);
+    output->inbound_bytes = atomic_load(&srv->n_mem_bytes);
+    output->rejected_payloads = atomic_load(&srv->n_rejected_payloads);
+    return 1;
+}
+
+int rpc_server_set_cache(rpc_server* srv, size_t max_entries, size_t max_bytes) {
+    if (srv == NULL)
+        return -1;
+
+    srv->cache_max_entries = max_entries;
+    srv->cache_max_bytes = max_bytes;
+
+    // Rebuild the cache with the new bounds if it is in use
+    bool is_needed = false;
+    for (size_t i=0; i<ht_count(srv->hash_table); i++)
+        is_needed |= (ht_item_at(srv->hash_table, i)->flags & RPC_FUNC_PURE) != 0;
+
+    cache_destroy(srv->cache);
+    srv->cache = NULL;
+    if (is_needed && max_entries > 0 && max_bytes > 0)
+        srv->cache = cache_create(max_entries, max_bytes);
+
     return 1;
 }
 
@@ -162,117 +722,356 @@ void rpc_serve_all(rpc_server* srv) {
         return;
 
     // Initialise thread pool
-    pthread_t thread_pool[THREAD_POOL_SIZE];
     for (int i=0; i<THREAD_POOL_SIZE; i++) {
-        pthread_create(&thread_pool[i], NULL, thread_work, srv);
-        pthread_detach(thread_pool[i]);
+        rpc_worker* worker = &srv->workers[i];
+        worker->srv = srv;
+        worker->index = i;
+
+        // Workers are dealt out to nodes in turn, so that every node has some
+        worker->node = srv->topology ? i % srv->topology->n_nodes : 0;
+        buffer_init(&worker->packet);
+        buffer_init(&worker->request);
+        worker->clientfd = SOCKET_NULL_HANDLE;
+        pthread_create(&worker->thread, NULL, thread_work, worker);
     }
 
     while(true) {
+        struct pollfd pfds[3] = {
+            { .fd = srv->masterfd, .events = POLLIN },
+            { .fd = srv->wakefd[0], .events = POLLIN },
+            { .fd = srv->handofffd, .events = POLLIN },
+        };
+
+        // Wait for a new client, a shutdown request or a replacement process
+        if (poll(pfds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            perror("poll() failed!\n");
+            break;
+        }
+
+        if (pfds[1].revents & POLLIN)
+            break;
+
+        if ((pfds[2].revents & POLLIN) && svr_accept_handoff(srv))
+            break;
+
+        if (!(pfds[0].revents & POLLIN))
+            continue;
+
         int new_clientfd = SOCKET_NULL_HANDLE;
-        struct sockaddr_in cl_addr;
+        struct sockaddr_in6 cl_addr;
         socklen_t cl_addr_len = sizeof(cl_addr);
 
         // Accept new connections when they come
         if (((new_clientfd = accept(
                                 srv->masterfd, 
-                                &cl_addr, 
+                                (struct sockaddr*)&cl_addr, 
                                 &cl_addr_len)) < 0)) 
             {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || 
+                errno == ECONNABORTED || errno == EINTR)
+                continue;
             perror("accept() failed!\n");
             break;
         }
 
-        // Lock the list of clients so we can add a new client
+        // Every reply goes out in a single write, so there's nothing for Nagle
+        // to coalesce, only replies to hold back behind a delayed ACK
+        int opt_val = true;
+        setsockopt(new_clientfd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+
+        // The CPU that took the connection's packets off the network is the
+        // one whose node its data is already on
+        int client_node = 0;
+        if (srv->topology != NULL) {
+            int cpu = -1;
+            socklen_t cpu_len = sizeof(cpu);
+            getsockopt(new_clientfd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_len);
+            client_node = topology_cpu_node(srv->topology, cpu);
+        }
+
+        // Lock the list of clients so we can add a new client, unless so many
+        // are already waiting for a thread that this one would likely time out.
+        // Clients an idle thread is about to pick up don't count as waiting
         pthread_mutex_lock(&srv->mutex_list_fd);
-        int* temp = malloc(sizeof(int));
-        *temp = new_clientfd;
-        list_insert_tail(srv->list_fd, temp);
-        pthread_cond_signal(&srv->client_cond);
+        bool is_full = srv->max_queued_clients > 0 && 
+                       srv->n_queued >= srv->n_idle + srv->max_queued_clients;
+        if (!is_full) {
+            queued_client* temp = calloc(1, sizeof(queued_client));
+            temp->clientfd = new_clientfd;
+            temp->node = client_node;
+            list_insert_tail(srv->list_fd, temp);
+            srv->n_queued++;
+
+            // Any worker takes any client unless they're placed on nodes, in
+            // which case the one woken up might not be on the right node
+            if (srv->topology != NULL)
+                pthread_cond_broadcast(&srv->client_cond);
+            else
+                pthread_cond_signal(&srv->client_cond);
+        }
         pthread_mutex_unlock(&srv->mutex_list_fd);
+
+        if (is_full)
+            svr_reject_client(srv, new_clientfd);
     }
+
+    // Let the calls that are already running finish before returning
+    svr_drain(srv);
 }
 
-struct rpc_client {
-    int serverfd;
-    hw_profile srv_profile;
-    bool is_active;
-};
+void rpc_server_shutdown(rpc_server* srv) {
+    if (srv == NULL)
+        return;
 
-struct rpc_handle {
-    uint64_t hash_value;
-};
+    // Only write() is used here so this stays async-signal-safe
+    uint8_t wake = 1;
+    ssize_t written = write(srv->wakefd[1], &wake, sizeof(uint8_t));
+    (void)written;
+}
 
-rpc_client* rpc_init_client(char* addr, int port) {
-    if (addr == NULL || !valid_port(port)) 
-        return NULL;
+int rpc_server_enable_handoff(rpc_server* srv, char* path) {
+    if (srv == NULL || path == NULL)
+        return -1;
 
-    // Allocate and initialise memory for a new client
-    rpc_client* new_cl = calloc(1, sizeof(rpc_client));
-    new_cl->serverfd = SOCKET_NULL_HANDLE;
-    new_cl->is_active = true;
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path) || srv->handofffd != SOCKET_NULL_HANDLE)
+        return -1;
+    strcpy(addr.sun_path, path);
 
-    // Generate information about local machine
-    char* port_string = int_to_string(port);
-    struct addrinfo* svr_info = NULL; 
-    struct addrinfo hints = {
-        .ai_family = AF_INET6,
-        .ai_socktype = SOCK_STREAM,
-    };
+    int handofffd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (handofffd < 0) {
+        perror("socket() failed!\n");
+        return -1;
+    }
 
-    int ai_error;
-    if ((ai_error = getaddrinfo(addr, port_string, &hints, &svr_info)) != 0) {
-        fprintf(stderr, "%s\n", gai_strerror(ai_error));
-        return NULL;
+    // A previous server may have left its socket file behind
+    unlink(path);
+    if (bind(handofffd, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        listen(handofffd, 1) < 0) {
+        perror("bind() failed!\n");
+        close(handofffd);
+        return -1;
     }
-    FREE(port_string);
+    fcntl(handofffd, F_SETFL, fcntl(handofffd, F_GETFL) | O_NONBLOCK);
 
-    // Iterate through results to find correct addrinfo and create socket
-    for (struct addrinfo* curr_info = svr_info; curr_info != NULL; curr_info = curr_info->ai_next) {
-        
-        // Must be IPv6
-        if (curr_info->ai_family != hints.ai_family) 
-            continue;
+    srv->handofffd = handofffd;
+    srv->handoff_path = strdup(path);
+    return 1;
+}
 
-        // If we can't socket we go to the next item in the list
-        if ((new_cl->serverfd = socket(
-                                    curr_info->ai_family, 
-                                    curr_info->ai_socktype, 
-                                    curr_info->ai_protocol)) < 0) 
-            {
-            continue;
-        }
+rpc_server* rpc_init_server_handoff(char* path) {
+    if (path == NULL)
+        return NULL;
 
-        // Try to connect to the server
-        if (connect(
-                new_cl->serverfd, 
-                curr_info->ai_addr, 
-                curr_info->ai_addrlen) != -1) 
-            {
-            break;
-        }
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return NULL;
+    strcpy(addr.sun_path, path);
 
-        // Go to next info if we can't connect
-        close(new_cl->serverfd);
-        new_cl->serverfd = SOCKET_NULL_HANDLE;
+    int handofffd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (handofffd < 0) {
+        perror("socket() failed!\n");
+        return NULL;
     }
-    freeaddrinfo(svr_info);   
 
-    // We couldn't connect to the server for some reason
-    if (new_cl->serverfd == SOCKET_NULL_HANDLE) {
-        rpc_destroy_client(new_cl);
+    if (connect(handofffd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
         perror("connect() failed!\n");
+        close(handofffd);
         return NULL;
     }
 
-    // Check that connection to server was successful
-    if (!cl_handle_proc_connect(new_cl->serverfd, &new_cl->srv_profile)) {
-        rpc_destroy_client(new_cl);
+    // The listening socket arrives as ancillary data alongside a single byte
+    uint8_t byte;
+    struct iovec iov = { .iov_base = &byte, .iov_len = sizeof(uint8_t) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+
+    ssize_t bytes_read = recvmsg(handofffd, &msg, 0);
+    close(handofffd);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (bytes_read <= 0 || cmsg == NULL || 
+        cmsg->cmsg_level != SOL_SOCKET || 
+        cmsg->cmsg_type != SCM_RIGHTS) 
+        {
+        fprintf(stderr, "Listening socket was not handed over!\n");
         return NULL;
     }
 
-    // Otherwise we have successfully connected to the server
-    return new_cl;
+    rpc_server* new_srv = rpc_create_server();
+    if (new_srv == NULL)
+        return NULL;
+    memcpy(&new_srv->masterfd, CMSG_DATA(cmsg), sizeof(int));
+
+    return new_srv;
+}
+
+void rpc_close_server(rpc_server* srv) {
+    rpc_destroy_server(srv);
+}
+
+rpc_data* rpc_data_alloc(void) {
+    if (svr_call_arena == NULL)
+        return calloc(1, sizeof(rpc_data));
+
+    rpc_data* data = arena_alloc(svr_call_arena, sizeof(rpc_data));
+    if (data != NULL)
+        memset(data, 0, sizeof(rpc_data));
+    return data;
+}
+
+void* rpc_buf_alloc(size_t size) {
+    if (size == 0)
+        return NULL;
+    if (svr_call_arena == NULL)
+        return malloc(size);
+    return arena_alloc(svr_call_arena, size);
+}
+
+rpc_stats* rpc_server_stats(rpc_server* srv, size_t* count) {
+    if (srv == NULL || count == NULL)
+        return NULL;
+
+    // One entry per function, plus one for calls that matched nothing
+    size_t n_funcs = ht_count(srv->hash_table);
+    rpc_stats* stats = calloc(n_funcs + 1, sizeof(rpc_stats));
+
+    for (size_t i=0; i<n_funcs; i++) {
+        hash_item* item = ht_item_at(srv->hash_table, i);
+        stats[i].name = strdup(item->name);
+        stats_snapshot(item->stats, &stats[i]);
+    }
+    stats[n_funcs].name = strdup("");
+    stats_snapshot(srv->unmatched_stats, &stats[n_funcs]);
+
+    *count = n_funcs + 1;
+    return stats;
+}
+
+struct rpc_client {
+    int serverfd;
+    hw_profile srv_profile;
+    bool is_active;
+    bool is_handshake_pending;
+
+    // The server predates RPC_MSG_CONNECT_EXT, so is sent the plain handshake
+    // and treated as having no capabilities
+    bool is_connect_legacy;
+
+    // Where to reconnect to, and how hard to try
+    char* addr;
+    int port;
+    unsigned reconnect_attempts;
+    unsigned reconnect_base_ms;
+    unsigned reconnect_max_ms;
+
+    // Reused for building requests so that each is sent with a single write.
+    // The handshake takes up the front of it while one is pending
+    byte_buffer packet;
+    size_t handshake_len;
+
+    // Requests go out in v2 frames once the server says it understands them,
+    // and the reply to each is read in whole before being parsed
+    uint32_t next_request_id;
+    bool is_reply_framed;
+    byte_buffer reply;
+};
+
+// One of the servers of a pool. Its connection can only carry one request at
+// a time, so it is locked for the length of each
+struct rpc_pool_backend {
+    pthread_mutex_t mutex;
+    char* addr;
+    int port;
+    rpc_client* cl;
+};
+
+struct rpc_pool {
+    size_t n_backends;
+    rpc_pool_backend* backends;
+    balancer* balancer;
+
+    // Owner of each key, if the servers are shards
+    hash_ring* ring;
+
+    // Calls still unanswered at this percentile of their recent latency are
+    // sent to a second server as well, 0 meaning never
+    double hedge_percentile;
+    uint64_t hedge_min_delay_ns;
+};
+
+// One of the (at most two) servers a hedged call was sent to
+struct rpc_pool_leg {
+    size_t index;
+    rpc_pool_backend* backend;
+    bool is_pending;
+};
+
+// Calls made through a pool remember this many of their latencies
+#define HANDLE_NUM_SAMPLES 64
+
+// And are not hedged until they remember this many
+#define HANDLE_MIN_SAMPLES 16
+
+struct rpc_handle {
+    uint64_t hash_value;
+
+    // Element width of data2 if the function takes arrays, otherwise 0
+    uint8_t elem_width;
+
+    // RPC_FUNC_* flags the function was registered with, if the server said
+    uint32_t flags;
+
+    // Recent latencies in microseconds, oldest overwritten first
+    atomic_uint n_samples;
+    atomic_uint samples_us[HANDLE_NUM_SAMPLES];
+};
+
+rpc_client* rpc_init_client(char* addr, int port) {
+    if (addr == NULL || !valid_port(port)) 
+        return NULL;
+
+    cl_last_error = RPC_ERROR_NONE;
+
+    // Allocate and initialise memory for a new client
+    rpc_client* new_cl = calloc(1, sizeof(rpc_client));
+    new_cl->serverfd = SOCKET_NULL_HANDLE;
+    new_cl->is_active = true;
+    new_cl->addr = strdup(addr);
+    new_cl->port = port;
+    buffer_init(&new_cl->packet);
+    buffer_init(&new_cl->reply);
+
+    // We couldn't connect to the server for some reason
+    if (!cl_open(new_cl)) {
+        rpc_destroy_client(new_cl);
+        perror("connect() failed!\n");
+        return NULL;
+    }
+
+    // Otherwise we have successfully connected to the server
+    return new_cl;
+}
+
+int rpc_client_set_reconnect(rpc_client* cl, unsigned max_attempts, 
+                             unsigned base_delay_ms, unsigned max_delay_ms) {
+    if (cl == NULL || base_delay_ms > max_delay_ms)
+        return -1;
+
+    cl->reconnect_attempts = max_attempts;
+    cl->reconnect_base_ms = base_delay_ms;
+    cl->reconnect_max_ms = max_delay_ms;
+    return 1;
 }
 
 rpc_handle* rpc_find(rpc_client* cl, char* name) {
@@ -290,9 +1089,14 @@ rpc_handle* rpc_find(rpc_client* cl, char* name) {
     }
 
     rpc_handle* handle = NULL;
-
-    // Check that communication with server didn't cut
-    if (!cl_handle_proc_find(cl->serverfd, name, strlen(name), &handle))
+    cl_last_error = RPC_ERROR_NONE;
+
+    // Check that communication with server didn't cut. Finding a function
+    // changes nothing on the server, so it is always safe to ask again
+    bool is_ok = cl_handle_proc_find(cl, name, strlen(name), &handle);
+    if (!is_ok && cl_reconnect(cl))
+        is_ok = cl_handle_proc_find(cl, name, strlen(name), &handle);
+    if (!is_ok)
         return NULL;
 
     // Handle will be null if the procedure fails, otherwise
@@ -309,32 +1113,124 @@ rpc_data* rpc_call(rpc_client* cl, rpc_handle* h, rpc_data* payload) {
         return NULL;
 
     // Comply with protocol
-    // Check that the data will not overflow on the server
-    rpc_error error = check_data(&cl->srv_profile, payload);
-    if (error) {
+    if (!cl_check_payload(cl, h, payload))
+        return NULL;
+    
+    // Check that communication with the server did not cut. The call may have
+    // run before the connection dropped, so only send it again if that's harmless
+    rpc_data* output = NULL;
+    bool is_ok = cl_handle_proc_call(cl, h, payload, &output);
+    if (!is_ok && cl_reconnect(cl) && (h->flags & (RPC_FUNC_IDEMPOTENT | RPC_FUNC_PURE)))
+        is_ok = cl_handle_proc_call(cl, h, payload, &output);
+    if (!is_ok)
+        return NULL;
 
-        if (error & RPC_ERROR_DATA_INT_OVF)
-            fprintf(stderr, "Payload.data1 value too large for server!\n");
+    // Output will be NULL if the procedure fails, otherwise
+    // it will be a heap allocated address to an rpc_data
+    return output;
+}
 
-        if (error & RPC_ERROR_DATA_BUFF_OVF)
-            fprintf(stderr, "Payload.data2 contains too much data for the server!\n");
+int rpc_call_into(rpc_client* cl, rpc_handle* h, rpc_data* payload, rpc_response* response) {
+    if (cl == NULL || h == NULL || payload == NULL || response == NULL)
+        return -1;
 
-        if (error & RPC_ERROR_DATA_INVALID)
-            fprintf(stderr, "Payload is invalid!\n");
+    if (!cl->is_active)
+        return -1;
+
+    if (!cl_check_payload(cl, h, payload))
+        return -1;
+
+    // Same as rpc_call, the request and reply buffers of the client are
+    // reused too, so nothing here allocates once the response is big enough
+    bool has_output = false;
+    bool is_ok = cl_send_call(cl, h, payload) && 
+                 cl_recv_call_into(cl, h, response, &has_output);
+    if (!is_ok && cl_reconnect(cl) && (h->flags & (RPC_FUNC_IDEMPOTENT | RPC_FUNC_PURE))) {
+        is_ok = cl_send_call(cl, h, payload) && 
+                cl_recv_call_into(cl, h, response, &has_output);
+    }
+    return is_ok && has_output ? 1 : -1;
+}
+
+void rpc_response_free(rpc_response* response) {
+    if (response == NULL)
+        return;
+
+    FREE(response->buffer);
+    response->capacity = 0;
+    response->data.data2 = NULL;
+    response->data.data2_len = 0;
+}
+
+rpc_iter* rpc_call_stream(rpc_client* cl, rpc_handle* h, rpc_data* payload, uint32_t window) {
+    if (cl == NULL || h == NULL || payload == NULL)
+        return NULL;
+
+    if (!cl->is_active)
+        return NULL;
 
+    // A server that doesn't know streams would read the rest of the call as
+    // more messages, so don't send it one
+    if (!cl->is_handshake_pending && !(cl->srv_profile.capabilities & RPC_CAP_STREAMS)) {
+        cl_last_error = RPC_ERROR_MSG_INVALID;
         return NULL;
     }
-    
-    // Check that communication with the server did not cut
-    rpc_data* output = NULL;
-    if (!cl_handle_proc_call(cl->serverfd, h, payload, &output))
+
+    if (!cl_check_payload(cl, h, payload))
         return NULL;
 
-    // Output will be NULL if the procedure fails, otherwise
-    // it will be a heap allocated address to an rpc_data
+    if (window == 0)
+        window = RPC_STREAM_DEFAULT_WINDOW;
+
+    // Nothing has been streamed back if the call couldn't be sent, so it's
+    // sent again on the same terms as any other call
+    bool is_ok = cl_send_stream_call(cl, h, payload, window);
+    if (!is_ok && cl_reconnect(cl) && (h->flags & (RPC_FUNC_IDEMPOTENT | RPC_FUNC_PURE)))
+        is_ok = cl_send_stream_call(cl, h, payload, window);
+    if (!is_ok)
+        return NULL;
+
+    rpc_iter* it = calloc(1, sizeof(rpc_iter));
+    it->cl = cl;
+    it->elem_width = h->elem_width;
+    it->window = window;
+    return it;
+}
+
+rpc_data* rpc_iter_next(rpc_iter* it) {
+    if (it == NULL || it->is_finished)
+        return NULL;
+
+    // Once the connection is lost, so is the rest of the stream
+    rpc_data* output = NULL;
+    if (!cl_recv_item(it, &output)) {
+        it->is_finished = true;
+        cl_last_error = RPC_ERROR_CXN_INVALID;
+        return NULL;
+    }
     return output;
 }
 
+void rpc_iter_close(rpc_iter* it) {
+    if (it == NULL)
+        return;
+
+    // The server stops at its next item, but anything sent before then is
+    // still on its way and has to be read past
+    if (!it->is_finished) {
+        it->is_cancelled = true;
+        if (!cl_send_credit(it->cl, 0))
+            it->is_finished = true;
+    }
+    while (!it->is_finished) {
+        rpc_data* output = NULL;
+        if (!cl_recv_item(it, &output))
+            it->is_finished = true;
+        rpc_data_free(output);
+    }
+    free(it);
+}
+
 void rpc_close_client(rpc_client* cl) {
     if (cl == NULL)
         return;
@@ -350,6 +1246,200 @@ void rpc_close_client(rpc_client* cl) {
     rpc_destroy_client(cl);
 }
 
+rpc_stats* rpc_fetch_stats(rpc_client* cl, size_t* count) {
+    if (cl == NULL || count == NULL)
+        return NULL;
+
+    // Check that the client is active
+    if (!cl->is_active)
+        return NULL;
+
+    rpc_stats* stats = NULL;
+    cl_last_error = RPC_ERROR_NONE;
+    bool is_ok = cl_handle_proc_stats(cl, &stats, count);
+    if (!is_ok && cl_reconnect(cl))
+        is_ok = cl_handle_proc_stats(cl, &stats, count);
+    if (!is_ok)
+        return NULL;
+
+    // Stats will be NULL if the procedure fails
+    return stats;
+}
+
+int rpc_fetch_load(rpc_client* cl, rpc_load* output) {
+    if (cl == NULL || output == NULL)
+        return -1;
+
+    // Check that the client is active
+    if (!cl->is_active)
+        return -1;
+
+    // The procedure succeeds without filling output if the server errors
+    memset(output, 0, sizeof(rpc_load));
+    cl_last_error = RPC_ERROR_NONE;
+    bool is_ok = cl_handle_proc_load(cl, output);
+    if (!is_ok && cl_reconnect(cl))
+        is_ok = cl_handle_proc_load(cl, output);
+    if (!is_ok || cl_last_error)
+        return -1;
+
+    return 1;
+}
+
+rpc_pool* rpc_init_pool(char** addrs, int* ports, size_t count, unsigned policy) {
+    if (addrs == NULL || ports == NULL || count == 0 || policy > RPC_BALANCE_CONSISTENT_HASH)
+        return NULL;
+
+    for (size_t i=0; i<count; i++) {
+        if (addrs[i] == NULL || !valid_port(ports[i]))
+            return NULL;
+    }
+
+    rpc_pool* pool = calloc(1, sizeof(rpc_pool));
+    pool->n_backends = count;
+    pool->backends = calloc(count, sizeof(rpc_pool_backend));
+    pool->balancer = balancer_create(count, policy);
+    if (policy == RPC_BALANCE_CONSISTENT_HASH)
+        pool->ring = ring_create(addrs, ports, count);
+
+    // Servers that are down now are tried again whenever they're next picked
+    size_t n_connected = 0;
+    for (size_t i=0; i<count; i++) {
+        rpc_pool_backend* backend = &pool->backends[i];
+        pthread_mutex_init(&backend->mutex, NULL);
+        backend->addr = strdup(addrs[i]);
+        backend->port = ports[i];
+        if (pool_connect(backend))
+            n_connected++;
+    }
+
+    if (n_connected == 0) {
+        rpc_close_pool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+rpc_handle* rpc_pool_find(rpc_pool* pool, char* name) {
+    if (pool == NULL || name == NULL)
+        return NULL;
+
+    // Finding a function changes nothing, so a second server can always be asked
+    rpc_handle* handle = NULL;
+    size_t failed = BALANCER_NO_BACKEND;
+    for (int attempt=0; attempt<2 && handle == NULL; attempt++) {
+        size_t index = balancer_pick(pool->balancer, failed);
+        rpc_pool_backend* backend = &pool->backends[index];
+
+        pthread_mutex_lock(&backend->mutex);
+        if (pool_connect(backend))
+            handle = rpc_find(backend->cl, name);
+        pthread_mutex_unlock(&backend->mutex);
+
+        bool is_failure = pool_is_failure(handle != NULL);
+        balancer_done(pool->balancer, index, is_failure);
+        if (!is_failure)
+            break;
+        failed = index;
+    }
+    return handle;
+}
+
+int rpc_pool_set_hedging(rpc_pool* pool, double percentile, uint64_t min_delay_us) {
+    if (pool == NULL || percentile < 0 || percentile >= 1)
+        return -1;
+
+    pool->hedge_percentile = percentile;
+    pool->hedge_min_delay_ns = min_delay_us * 1000;
+    return 1;
+}
+
+rpc_data* rpc_pool_call(rpc_pool* pool, rpc_handle* h, rpc_data* payload) {
+    if (pool == NULL || h == NULL || payload == NULL)
+        return NULL;
+
+    // Shards each hold their own part of the state, so a call can only go to
+    // the one that owns its key, however busy or broken it is
+    if (pool->ring != NULL) {
+        rpc_pool_backend* backend = &pool->backends[ring_lookup(pool->ring, payload->data1)];
+        rpc_data* output = NULL;
+        pthread_mutex_lock(&backend->mutex);
+        if (pool_connect(backend))
+            output = rpc_call(backend->cl, h, payload);
+        pthread_mutex_unlock(&backend->mutex);
+        return output;
+    }
+
+    uint64_t start_ns = stats_now_ns();
+    uint64_t hedge_delay_ns;
+    if (pool_hedge_delay(pool, h, &hedge_delay_ns)) {
+        rpc_data* output = pool_call_hedged(pool, h, payload, hedge_delay_ns);
+        if (output != NULL)
+            handle_record_latency(h, stats_now_ns() - start_ns);
+        return output;
+    }
+
+    rpc_data* output = NULL;
+    size_t failed = BALANCER_NO_BACKEND;
+    for (int attempt=0; attempt<2; attempt++) {
+        size_t index = balancer_pick(pool->balancer, failed);
+        rpc_pool_backend* backend = &pool->backends[index];
+
+        pthread_mutex_lock(&backend->mutex);
+        if (pool_connect(backend))
+            output = rpc_call(backend->cl, h, payload);
+        pthread_mutex_unlock(&backend->mutex);
+
+        bool is_failure = pool_is_failure(output != NULL);
+        balancer_done(pool->balancer, index, is_failure);
+        if (!is_failure)
+            break;
+
+        // Overloaded servers turn calls away before running them, otherwise
+        // the call may have run before the connection dropped
+        if (!(cl_last_error & RPC_ERROR_OVERLOADED) && 
+            !(h->flags & (RPC_FUNC_IDEMPOTENT | RPC_FUNC_PURE)))
+            break;
+        failed = index;
+    }
+
+    if (output != NULL)
+        handle_record_latency(h, stats_now_ns() - start_ns);
+    return output;
+}
+
+void rpc_close_pool(rpc_pool* pool) {
+    if (pool == NULL)
+        return;
+
+    for (size_t i=0; i<pool->n_backends; i++) {
+        rpc_pool_backend* backend = &pool->backends[i];
+        rpc_close_client(backend->cl);
+        pthread_mutex_destroy(&backend->mutex);
+        FREE(backend->addr);
+    }
+    balancer_destroy(pool->balancer);
+    ring_destroy(pool->ring);
+    FREE(pool->backends);
+    FREE(pool);
+}
+
+unsigned rpc_last_error(void) {
+    return cl_last_error;
+}
+
+int64_t rpc_trace_dump(char* path) {
+    return trace_dump(path);
+}
+
+void rpc_stats_free(rpc_stats* stats, size_t count) {
+    if (stats == NULL)
+        return;
+    for (size_t i=0; i<count; i++)
+        free(stats[i].name);
+    free(stats);
+}
+
 void rpc_data_free(rpc_data* data) {
     if (data == NULL) {
         return;
@@ -364,63 +1454,189 @@ void rpc_data_free(rpc_data* data) {
 
 static void* thread_work(void* arg) {
 
-    rpc_server* srv = arg;
+    rpc_worker* worker = arg;
+    rpc_server* srv = worker->srv;
+
+    // Pin before anything is allocated, so that the memory this thread first
+    // touches, such as its reply buffer, comes from its own node
+    svr_pin_worker(worker);
+    worker->arena = arena_create();
 
     while(true) {
 
         // Every loop the thread processes a new client
-        int clientfd;
+        node* next = NULL;
 
         pthread_mutex_lock(&srv->mutex_list_fd);
 
         // Thread waits for main thread to add new clients
-        if (srv->list_fd->head == NULL)
+        srv->n_idle++;
+        srv->n_node_idle[worker->node]++;
+        while ((next = svr_next_client(srv, worker->node)) == NULL && !atomic_load(&srv->is_draining))
             pthread_cond_wait(&srv->client_cond, &srv->mutex_list_fd);  
+        srv->n_idle--;
+        srv->n_node_idle[worker->node]--;
+
+        // Draining servers don't pick up new clients
+        if (atomic_load(&srv->is_draining)) {
+            pthread_mutex_unlock(&srv->mutex_list_fd);
+            break;
+        }
 
         // Make sure to dequeue client from the list  
-        clientfd = *(int*)srv->list_fd->head->data;
-        list_pop_head(srv->list_fd);
+        queued_client client = *(queued_client*)next->data;
+        list_pop_node(srv->list_fd, next);
+        srv->n_queued--;
+        worker->clientfd = client.clientfd;
 
         pthread_mutex_unlock(&srv->mutex_list_fd);
 
         // Handle the client for an indeterminant amound of time
-        handle_client(clientfd, srv);
+        bool is_handed_off = handle_client(&client, worker);
 
-        // Close the socket
-        close(clientfd);
+        // Close the socket, unless another thread has it now. Either way a
+        // drain must no longer touch it
+        pthread_mutex_lock(&srv->mutex_list_fd);
+        worker->clientfd = SOCKET_NULL_HANDLE;
+        pthread_mutex_unlock(&srv->mutex_list_fd);
+        if (!is_handed_off)
+            close(client.clientfd);
     }
 
+    buffer_deinit(&worker->packet);
+    buffer_deinit(&worker->request);
+    arena_destroy(worker->arena);
     return NULL;
 }
 
-static void handle_client(int clientfd, rpc_server* srv) {
+static void svr_release_output(arena* ar, rpc_data* output) {
 
-    bool is_connected = true;
+    // Handlers may mix arena and heap memory, only the heap needs freeing
+    if (output != NULL) {
+        if (!arena_owns(ar, output->data2))
+            free(output->data2);
+        if (!arena_owns(ar, output))
+            free(output);
+    }
+}
 
-    hw_profile cl_profile = {
-        .int_max = 0,
-        .int_min = 0,
-        .size_max = 0,
-        .initialised = false,
-    };
+static void svr_pin_worker(rpc_worker* worker) {
+    rpc_server* srv = worker->srv;
+    topology* topo = srv->topology;
+    if (topo == NULL)
+        return;
+
+    // Either the whole node, or a single core of it. Workers on the same node
+    // take its cores in turn
+    int* cpus = topo->node_cpus[worker->node];
+    size_t n_cpus = topo->n_node_cpus[worker->node];
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (srv->affinity == RPC_AFFINITY_CORE) {
+        CPU_SET(cpus[(worker->index / topo->n_nodes) % n_cpus], &set);
+    } else {
+        for (size_t i=0; i<n_cpus; i++)
+            CPU_SET(cpus[i], &set);
+    }
+    pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &set);
+}
+
+static node* svr_next_client(rpc_server* srv, int node_index) {
+
+    // Oldest client from our own node first. Failing that, the oldest from a
+    // node with no idle workers of its own, rather than leave it waiting
+    node* fallback = NULL;
+    for (node* curr = srv->list_fd->head; curr != NULL; curr = curr->next) {
+        queued_client* client = curr->data;
+        if (client->node == node_index || client->node < 0)
+            return curr;
+        if (fallback == NULL && srv->n_node_idle[client->node] == 0)
+            fallback = curr;
+    }
+    return fallback;
+}
+
+static void svr_requeue_client(rpc_server* srv, queued_client* client) {
+    pthread_mutex_lock(&srv->mutex_list_fd);
+
+    // A draining server is closing its connections between calls anyway
+    if (atomic_load(&srv->is_draining)) {
+        pthread_mutex_unlock(&srv->mutex_list_fd);
+        close(client->clientfd);
+        return;
+    }
+
+    // Clients already being served are never turned away for the queue being full
+    queued_client* temp = malloc(sizeof(queued_client));
+    *temp = *client;
+    list_insert_tail(srv->list_fd, temp);
+    srv->n_queued++;
+    if (srv->topology != NULL)
+        pthread_cond_broadcast(&srv->client_cond);
+    else
+        pthread_cond_signal(&srv->client_cond);
+    pthread_mutex_unlock(&srv->mutex_list_fd);
+}
 
-    while(is_connected) {
+static bool handle_client(queued_client* client, rpc_worker* worker) {
+
+    rpc_server* srv = worker->srv;
+    int clientfd = client->clientfd;
+    hw_profile* cl_profile = &client->profile;
+    bool is_connected = true;
+    worker->client = client;
+    worker->is_handed_off = false;
+
+    while(is_connected && !worker->is_handed_off) {
         rpc_message message = 0;
 
-        // Try to read in the message
-        if (!socket_recv(clientfd, &message, sizeof(rpc_message)))
+        // Between messages the client is idle, and is let go if the server is
+        // draining. A request is either served in full or not read at all
+        if (atomic_load(&srv->is_draining))
+            break;
+
+        // Try to read in the message, and the whole of the request if it's framed
+        svr_request.is_framed = false;
+        svr_request.is_over_budget = false;
+        svr_request.is_error_wide = cl_profile->capabilities & RPC_CAP_WIDE_ERRORS;
+        if (!svr_recv_message(srv, clientfd, &message))
+            break;
+        if (message == RPC_MSG_FRAME && !svr_recv_frame(clientfd, worker, &message))
             break;
+        trace_begin(message);
+
+        // Only the error is left to send for a frame that was skipped
+        if (svr_request.is_over_budget) {
+            stats_record_error(srv->unmatched_stats, RPC_ERROR_MEM_BUDGET);
+            is_connected = svr_handle_rtn_error(clientfd, RPC_ERROR_MEM_BUDGET);
+            continue;
+        }
 
         // Handle the message
         switch(message) {
             case RPC_MSG_CONNECT:
-                is_connected = svr_handle_msg_connect(clientfd, &cl_profile);
+                is_connected = svr_handle_msg_connect(clientfd, cl_profile, false);
+                break;
+            case RPC_MSG_CONNECT_EXT:
+                is_connected = svr_handle_msg_connect(clientfd, cl_profile, true);
                 break;
             case RPC_MSG_FUNC_FIND:
-                is_connected = svr_handle_msg_find(clientfd, &cl_profile, srv->hash_table);
+                is_connected = svr_handle_msg_find(clientfd, cl_profile, srv->hash_table);
                 break;
             case RPC_MSG_FUNC_CALL:
-                is_connected = svr_handle_msg_call(clientfd,&cl_profile, srv->hash_table);
+                is_connected = svr_handle_msg_call(clientfd, cl_profile, worker, false);
+                break;
+            case RPC_MSG_STREAM_CALL:
+                is_connected = svr_handle_msg_call(clientfd, cl_profile, worker, true);
+                break;
+            case RPC_MSG_STREAM_CREDIT:
+                is_connected = svr_handle_msg_credit(clientfd);
+                break;
+            case RPC_MSG_STATS:
+                is_connected = svr_handle_msg_stats(clientfd, cl_profile, srv);
+                break;
+            case RPC_MSG_LOAD:
+                is_connected = svr_handle_msg_load(clientfd, cl_profile, srv);
                 break;
             case RPC_MSG_DISCONNECT:
                 is_connected = false;
@@ -429,52 +1645,242 @@ static void handle_client(int clientfd, rpc_server* srv) {
                 is_connected = svr_handle_rtn_error(clientfd, RPC_ERROR_MSG_INVALID);
                 break;
         }
-    }
-}
 
-static bool svr_handle_msg_connect(int clientfd, hw_profile* cl_profile) {
-    if (cl_profile == NULL)
-        return true;
+        // The request has been answered, unless it went to another thread,
+        // which then refunds it instead
+        if (!worker->is_handed_off)
+            svr_mem_refund(srv, svr_mem_charged);
+        svr_mem_charged = 0;
 
-    // Read in int_max of client
-    uint8_t sizeof_int_cl;
-    quick_check(socket_recv(clientfd, &sizeof_int_cl, sizeof(uint8_t)));
-    cl_profile->int_max = MAX_SINT(sizeof_int_cl);
-    cl_profile->int_min = -cl_profile->int_max - 1;
+        // Otherwise every worker would end up holding the largest body it has seen
+        if (worker->request.capacity > SVR_REQUEST_KEEP_BYTES) {
+            buffer_deinit(&worker->request);
+            buffer_init(&worker->request);
+        }
+    }
 
-    // Read in size_max of client
-    uint8_t sizeof_size_t_cl;
-    quick_check(socket_recv(clientfd, &sizeof_size_t_cl, sizeof(uint8_t)));
-    cl_profile->size_max = MAX_UINT(sizeof_size_t_cl);
+    // Requests cut short by the client hanging up
+    if (!worker->is_handed_off)
+        svr_mem_refund(srv, svr_mem_charged);
+    svr_mem_charged = 0;
+    return worker->is_handed_off;
+}
 
-    // Check that the client has ended the packet at this point
-    rpc_message cl_msg_end;
-    quick_check(socket_recv(clientfd, &cl_msg_end, sizeof(uint8_t)));
-    if (cl_msg_end != RPC_MSG_END)
-        return svr_handle_rtn_error(clientfd, RPC_ERROR_PQT_INVALID);
+static bool svr_accept_handoff(rpc_server* srv) {
 
-    // Client has followed the connection procedure
-    cl_profile->initialised = true;
+    int newfd = accept(srv->handofffd, NULL, NULL);
+    if (newfd < 0)
+        return false;
 
-    // Send success message to client
-    rpc_message message = RPC_RTN_SUCCESS;
-    quick_check(socket_send(clientfd, &message, sizeof(rpc_message)));
+    // Send the listening socket to the replacement process
+    uint8_t byte = 0;
+    struct iovec iov = { .iov_base = &byte, .iov_len = sizeof(uint8_t) };
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
 
-    // Write out int_max of the server
-    uint8_t sizeof_int_srv = sizeof(int);
-    quick_check(socket_send(clientfd, &sizeof_int_srv, sizeof(uint8_t)));
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &srv->masterfd, sizeof(int));
 
-    // Write out size_max of the server
-    uint8_t sizeof_size_t_srv = sizeof(size_t);
-    quick_check(socket_send(clientfd, &sizeof_size_t_srv, sizeof(uint8_t)));
-
-    // End message
-    rpc_message svr_msg_end = RPC_MSG_END;
-    quick_check(socket_send(clientfd, &svr_msg_end, sizeof(rpc_message)));
+    bool is_sent = sendmsg(newfd, &msg, MSG_NOSIGNAL) > 0;
+    close(newfd);
+    if (!is_sent) {
+        perror("sendmsg() failed!\n");
+        return false;
+    }
 
+    // The replacement owns the listening socket now, and any client still
+    // waiting in the backlog will be accepted over there. It may also want
+    // to reuse the handoff path, so leave the socket file alone
+    close(srv->masterfd);
+    srv->masterfd = SOCKET_NULL_HANDLE;
+    close(srv->handofffd);
+    srv->handofffd = SOCKET_NULL_HANDLE;
+    FREE(srv->handoff_path);
     return true;
 }
 
+static void svr_drain(rpc_server* srv) {
+
+    pthread_mutex_lock(&srv->mutex_list_fd);
+    atomic_store(&srv->is_draining, true);
+
+    // Clients that were never picked up have nothing in flight
+    while (srv->list_fd->head != NULL) {
+        close(((queued_client*)srv->list_fd->head->data)->clientfd);
+        list_pop_head(srv->list_fd);
+    }
+    srv->n_queued = 0;
+
+    // Workers waiting on idle clients let them go, those in the middle of a
+    // request are left to finish it. Nothing ever reads this, so it wakes all
+    uint8_t wake = 1;
+    ssize_t written = write(srv->drainfd[1], &wake, sizeof(uint8_t));
+    (void)written;
+
+    pthread_cond_broadcast(&srv->client_cond);
+    pthread_mutex_unlock(&srv->mutex_list_fd);
+
+    // A client that stops sending partway through a request would otherwise
+    // hold up the drain forever
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += SVR_DRAIN_TIMEOUT_NS / 1000000000ULL;
+    deadline.tv_nsec += SVR_DRAIN_TIMEOUT_NS % 1000000000ULL;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    bool is_joined[THREAD_POOL_SIZE];
+    bool has_stragglers = false;
+    for (int i=0; i<THREAD_POOL_SIZE; i++) {
+        is_joined[i] = pthread_timedjoin_np(srv->workers[i].thread, NULL, &deadline) == 0;
+        has_stragglers |= !is_joined[i];
+    }
+
+    // Cut off whatever they're still reading or writing, which fails their
+    // next socket call and sends them back to notice the drain
+    if (has_stragglers) {
+        pthread_mutex_lock(&srv->mutex_list_fd);
+        for (int i=0; i<THREAD_POOL_SIZE; i++) {
+            if (!is_joined[i] && srv->workers[i].clientfd != SOCKET_NULL_HANDLE)
+                shutdown(srv->workers[i].clientfd, SHUT_RDWR);
+        }
+        pthread_mutex_unlock(&srv->mutex_list_fd);
+
+        for (int i=0; i<THREAD_POOL_SIZE; i++) {
+            if (!is_joined[i])
+                pthread_join(srv->workers[i].thread, NULL);
+        }
+    }
+
+    // Blocking and async calls finish and close their connections on their own
+    offload_wait(srv->offload);
+    pthread_mutex_lock(&srv->mutex_list_fd);
+    while (srv->n_async_pending > 0)
+        pthread_cond_wait(&srv->client_cond, &srv->mutex_list_fd);
+    pthread_mutex_unlock(&srv->mutex_list_fd);
+}
+
+static bool svr_recv_message(rpc_server* srv, int clientfd, rpc_message* message) {
+
+    // A busy client usually has its next message waiting already
+    ssize_t bytes_read = recv(clientfd, message, sizeof(rpc_message), MSG_DONTWAIT);
+    if (bytes_read > 0)
+        return true;
+    if (bytes_read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return false;
+
+    // Otherwise wait for it, or for the server to start draining
+    struct pollfd pfds[2] = {
+        { .fd = clientfd, .events = POLLIN },
+        { .fd = srv->drainfd[0], .events = POLLIN },
+    };
+    while (poll(pfds, 2, -1) < 0) {
+        if (errno != EINTR)
+            return false;
+    }
+    if (pfds[1].revents != 0)
+        return false;
+
+    return socket_recv(clientfd, message, sizeof(rpc_message));
+}
+
+static void svr_reject_client(rpc_server* srv, int clientfd) {
+    atomic_fetch_add(&srv->n_rejected_clients, 1);
+
+    // The reply is tiny and the socket is fresh, so this never blocks the
+    // serving loop. The client reads it in place of its handshake reply, so
+    // it can't have negotiated wide errors yet
+    uint8_t packet[] = { RPC_RTN_ERROR, svr_error_legacy(RPC_ERROR_OVERLOADED), RPC_MSG_END };
+    send(clientfd, packet, sizeof(packet), MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(clientfd, SHUT_WR);
+    close(clientfd);
+}
+
+static sched_class svr_func_class(uint32_t flags) {
+    if (flags & RPC_FUNC_INTERACTIVE)
+        return SCHED_CLASS_INTERACTIVE;
+    if (flags & RPC_FUNC_BULK)
+        return SCHED_CLASS_BULK;
+    return SCHED_CLASS_NORMAL;
+}
+
+static unsigned svr_func_width(uint32_t flags) {
+    if (flags & RPC_FUNC_ARRAY16)
+        return 2;
+    if (flags & RPC_FUNC_ARRAY32)
+        return 4;
+    if (flags & RPC_FUNC_ARRAY64)
+        return 8;
+    return 0;
+}
+
+static bool svr_handle_msg_connect(int clientfd, hw_profile* cl_profile, bool is_ext) {
+    if (cl_profile == NULL)
+        return true;
+
+    // Read in int_max of client
+    uint8_t sizeof_int_cl;
+    quick_check(svr_recv(clientfd, &sizeof_int_cl, sizeof(uint8_t)));
+    cl_profile->int_max = MAX_SINT(sizeof_int_cl);
+    cl_profile->int_min = -cl_profile->int_max - 1;
+
+    // Read in size_max of client
+    uint8_t sizeof_size_t_cl;
+    quick_check(svr_recv(clientfd, &sizeof_size_t_cl, sizeof(uint8_t)));
+    cl_profile->size_max = MAX_UINT(sizeof_size_t_cl);
+
+    // The extended handshake also carries the byte order and capabilities
+    cl_profile->byte_order = RPC_ORDER_UNKNOWN;
+    cl_profile->capabilities = RPC_CAP_NONE;
+    if (is_ext) {
+        rpc_byte_order byte_order_cl;
+        rpc_capabilities be_caps_cl;
+        quick_check(svr_recv(clientfd, &byte_order_cl, sizeof(rpc_byte_order)));
+        quick_check(svr_recv(clientfd, &be_caps_cl, sizeof(rpc_capabilities)));
+        cl_profile->byte_order = byte_order_cl;
+        cl_profile->capabilities = ntohl(be_caps_cl) & RPC_CAPS_SUPPORTED;
+    }
+
+    // Check that the client has ended the packet at this point
+    rpc_message cl_msg_end;
+    quick_check(svr_recv(clientfd, &cl_msg_end, sizeof(uint8_t)));
+    if (cl_msg_end != RPC_MSG_END)
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_PQT_INVALID);
+
+    // Client has followed the connection procedure
+    cl_profile->initialised = true;
+
+    // Send success message to client along with the size of int and size_t
+    // of the server, all in one write
+    byte_buffer packet;
+    buffer_init(&packet);
+    buffer_put_u8(&packet, RPC_RTN_SUCCESS);
+    buffer_put_u8(&packet, sizeof(int));
+    buffer_put_u8(&packet, sizeof(size_t));
+    if (is_ext) {
+        buffer_put_u8(&packet, RPC_ORDER_NATIVE);
+        buffer_put_u32(&packet, RPC_CAPS_SUPPORTED);
+    }
+    buffer_put_u8(&packet, RPC_MSG_END);
+
+    bool is_sent = svr_send_reply(clientfd, packet.data, packet.len);
+    buffer_deinit(&packet);
+    return is_sent;
+}
+
 static bool svr_handle_msg_find(int clientfd, hw_profile* cl_profile, hash_table* ht_fnc) {
     if (cl_profile == NULL || ht_fnc == NULL)
         return true;
@@ -485,280 +1891,1555 @@ static bool svr_handle_msg_find(int clientfd, hw_profile* cl_profile, hash_table
 
     // Read in length of function name
     uint16_t be_len_name;
-    quick_check(socket_recv(clientfd, &be_len_name, sizeof(uint16_t)));
+    quick_check(svr_recv(clientfd, &be_len_name, sizeof(uint16_t)));
     uint16_t len_name = ntohs(be_len_name);
 
     // Read in char_buffer using length
     char* name = malloc(len_name + 1);
-    if(!socket_recv(clientfd, name, len_name)) {
+    if(!svr_recv(clientfd, name, len_name)) {
         FREE(name);
         return false;
     }
     name[len_name] = 0;
 
-    // Validate client packet
-    rpc_message cl_msg_end;
-    if(!socket_recv(clientfd, &cl_msg_end, sizeof(uint8_t))) {
-        FREE(name);
-        return false;
+    // Validate client packet
+    rpc_message cl_msg_end;
+    if(!svr_recv(clientfd, &cl_msg_end, sizeof(uint8_t))) {
+        FREE(name);
+        return false;
+    }
+    if (cl_msg_end != RPC_MSG_END)
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_PQT_INVALID);
+
+    // Attempt to find the function using name
+    hash_item* function = ht_find(ht_fnc, name);
+    FREE(name);
+
+    // Check if the function exists
+    if (function == NULL)
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_FUNC_NOT_FOUND);
+
+    // Send success message along with the function hash value
+    byte_buffer packet;
+    buffer_init(&packet);
+    buffer_put_u8(&packet, RPC_RTN_SUCCESS);
+    buffer_put_u64(&packet, function->hash_value);
+
+    // Clients that understand typed arrays are told the element width
+    if (cl_profile->capabilities & RPC_CAP_TYPED_ARRAY)
+        buffer_put_u8(&packet, svr_func_width(function->flags));
+
+    // So that clients know which calls are safe to send again
+    if (cl_profile->capabilities & RPC_CAP_FUNC_FLAGS)
+        buffer_put_u32(&packet, function->flags);
+
+    // Comply with protocol
+    buffer_put_u8(&packet, RPC_MSG_END);
+
+    bool is_sent = svr_send_reply(clientfd, packet.data, packet.len);
+    buffer_deinit(&packet);
+    return is_sent;
+}
+
+static bool svr_handle_msg_call(int clientfd, hw_profile* cl_profile, rpc_worker* worker, bool is_stream) {
+    if (cl_profile == NULL || worker == NULL)
+        return true; 
+
+    rpc_server* srv = worker->srv;
+
+    // Make sure the client has initialised the connection properly
+    if (!cl_profile->initialised) {
+        stats_record_error(srv->unmatched_stats, RPC_ERROR_CXN_INVALID);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_CXN_INVALID);
+    }
+
+    // Latency covers everything from decoding the request to sending the reply
+    uint64_t start_ns = stats_now_ns();
+
+    // Scan in data, typed arrays are converted once we know the function
+    rpc_data* input;
+    rpc_data_flags input_flags;
+    quick_check(svr_recv_data_flags(clientfd, srv, &input, &input_flags));
+
+    // Scan in function handle
+    uint64_t hash_value;
+    if (!svr_recv(clientfd, &hash_value, sizeof(uint64_t))) {
+        rpc_data_free(input);
+        return false;
+    }
+    hash_value = ntoh64(hash_value);
+
+    // Streams are told how many items they may send before the client reads any
+    uint32_t window = 0;
+    if (is_stream && !svr_recv(clientfd, &window, sizeof(uint32_t))) {
+        rpc_data_free(input);
+        return false;
+    }
+    window = ntohl(window);
+
+    // Validate client packet
+    rpc_message cl_msg_end;
+    if (!svr_recv(clientfd, &cl_msg_end, sizeof(uint8_t))) {
+        rpc_data_free(input);
+        return false;
+    }
+    if (cl_msg_end != RPC_MSG_END) {
+        rpc_data_free(input);
+        stats_record_error(srv->unmatched_stats, RPC_ERROR_PQT_INVALID);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_PQT_INVALID);
+    }
+
+    // data2 was skipped over if it didn't fit the memory budget
+    if (input == NULL) {
+        hash_item* function = ht_find_with_hash(srv->hash_table, hash_value);
+        stats_record_error(function ? function->stats : srv->unmatched_stats, RPC_ERROR_MEM_BUDGET);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_MEM_BUDGET);
+    }
+
+    // A client's first call is sent before it knows our limits, so it can't
+    // be trusted to have checked the data against them
+    rpc_error input_error;
+    if ((input_error = check_data(&srv->profile, input))) {
+        rpc_data_free(input);
+        stats_record_error(srv->unmatched_stats, input_error);
+        return svr_handle_rtn_error(clientfd, input_error);
+    }
+    trace_mark(TRACE_PHASE_DECODE);
+
+    // Find the function
+    hash_item* function = ht_find_with_hash(srv->hash_table, hash_value);
+    if (function == NULL) {
+        rpc_data_free(input);
+        stats_record_error(srv->unmatched_stats, RPC_ERROR_HNDL_INVALID);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_HNDL_INVALID);
+    }
+
+    // A stream can't be answered with a single reply, nor the other way around
+    if (is_stream != (function->stream_handler != NULL)) {
+        rpc_data_free(input);
+        stats_record_error(function->stats, RPC_ERROR_HNDL_INVALID);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_HNDL_INVALID);
+    }
+
+    // Handlers of array functions always see their elements in native order
+    unsigned width = svr_func_width(function->flags);
+    if (!data_array_to_native(input, input_flags, width, cl_profile)) {
+        rpc_data_free(input);
+        stats_record_error(function->stats, RPC_ERROR_DATA_INVALID);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_DATA_INVALID);
+    }
+    trace_mark(TRACE_PHASE_DISPATCH);
+
+    // Fail fast when too many calls are already running, so the client can go
+    // elsewhere instead of adding to the pile
+    size_t max_inflight = srv->max_inflight_calls;
+    if (atomic_fetch_add(&srv->n_inflight, 1) >= max_inflight && max_inflight > 0) {
+        atomic_fetch_sub(&srv->n_inflight, 1);
+        atomic_fetch_add(&srv->n_rejected_calls, 1);
+        rpc_data_free(input);
+        stats_record_error(function->stats, RPC_ERROR_OVERLOADED);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_OVERLOADED);
+    }
+
+    // Pure functions may already have the answer cached
+    svr_call call = {
+        .srv = srv,
+        .function = function,
+        .input = input,
+        .hash_value = hash_value,
+        .width = width,
+        .is_cacheable = (function->flags & RPC_FUNC_PURE) && srv->cache != NULL,
+        .start_ns = start_ns,
+        .bytes_in = input->data2_len,
+        .mem_charged = svr_mem_charged,
+        .client = *worker->client,
+        .request = svr_request,
+    };
+    trace_save(call.trace);
+    rpc_data* output = NULL;
+    if (call.is_cacheable) {
+        output = cache_lookup(srv->cache, hash_value, input);
+        stats_record_cache(function->stats, output != NULL);
+    }
+    call.is_cached = output != NULL;
+
+    // Async handlers reply whenever they like, from whichever thread they like.
+    // The connection waits for that reply, but this worker doesn't
+    if (!call.is_cached && function->async_handler != NULL)
+        return svr_start_async(&call, worker);
+
+    if (is_stream)
+        return svr_run_stream(&call, worker, window);
+
+    // Blocking handlers run on the offload pool, which also sends the reply.
+    // The connection goes back in the queue afterwards, and until then this
+    // worker is free to serve other clients
+    if (!call.is_cached && (function->flags & RPC_FUNC_BLOCKING) && srv->offload != NULL) {
+        svr_call* offloaded = malloc(sizeof(svr_call));
+        if (offloaded != NULL) {
+            *offloaded = call;
+            offloaded->request.body = NULL;
+            if (offload_submit(srv->offload, svr_offload_call, offloaded)) {
+                worker->is_handed_off = true;
+                return true;
+            }
+            free(offloaded);
+        }
+    }
+
+    // Otherwise run the function right here, which is also what holds back
+    // this connection when the offload pool is backed up
+    if (call.is_cached) {
+        atomic_fetch_sub(&srv->n_inflight, 1);
+    } else if (!svr_run_handler(&call, worker->arena, &output)) {
+        rpc_data_free(input);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_OVERLOADED);
+    }
+    bool is_connected = svr_finish_call(&call, output, &worker->packet, worker->arena);
+    arena_reset(worker->arena);
+    return is_connected;
+}
+
+static bool svr_admit_call(svr_call* call) {
+    rpc_server* srv = call->srv;
+    hash_item* function = call->function;
+
+    // A slow function only ever ties up as many calls as its limit allows
+    if (!bulkhead_enter(function->bulkhead)) {
+        atomic_fetch_sub(&srv->n_inflight, 1);
+        atomic_fetch_add(&srv->n_rejected_calls, 1);
+        stats_record_error(function->stats, RPC_ERROR_OVERLOADED);
+        return false;
+    }
+    return true;
+}
+
+static bool svr_run_handler(svr_call* call, arena* ar, rpc_data** output) {
+    rpc_server* srv = call->srv;
+    hash_item* function = call->function;
+
+    // Run the function, within its concurrency limit if it has one
+    if (!svr_admit_call(call))
+        return false;
+
+    // Blocking functions would sit on a run slot without using it
+    bool is_scheduled = !(function->flags & RPC_FUNC_BLOCKING);
+    if (is_scheduled)
+        sched_enter(srv->scheduler, svr_func_class(function->flags));
+    svr_call_arena = ar;
+    *output = function->handler(call->input);
+    svr_call_arena = NULL;
+    if (is_scheduled)
+        sched_leave(srv->scheduler);
+    bulkhead_leave(function->bulkhead);
+
+    atomic_fetch_sub(&srv->n_inflight, 1);
+    return true;
+}
+
+static bool svr_start_async(svr_call* call, rpc_worker* worker) {
+    rpc_server* srv = call->srv;
+    if (!svr_admit_call(call)) {
+        rpc_data_free(call->input);
+        return svr_handle_rtn_error(call->client.clientfd, RPC_ERROR_OVERLOADED);
+    }
+
+    rpc_completion* completion = malloc(sizeof(rpc_completion));
+    completion->call = *call;
+    completion->call.request.body = NULL;
+
+    pthread_mutex_lock(&srv->mutex_list_fd);
+    srv->n_async_pending++;
+    pthread_mutex_unlock(&srv->mutex_list_fd);
+
+    // The handler may complete the call before it even returns, so the
+    // connection must be handed off first. Neither can be touched after.
+    // svr_call_arena is left unset, so results come from the heap
+    worker->is_handed_off = true;
+    call->function->async_handler(call->input, completion);
+    return true;
+}
+
+void rpc_complete(rpc_completion* completion, rpc_data* output) {
+    if (completion == NULL)
+        return;
+
+    svr_call* call = &completion->call;
+    rpc_server* srv = call->srv;
+    trace_swap(call->trace);
+    bulkhead_leave(call->function->bulkhead);
+    atomic_fetch_sub(&srv->n_inflight, 1);
+
+    // Replies go out the same way the request came in. This may be running
+    // within another handler, whose request, arena and trace are left as they were
+    svr_frame outer_request = svr_request;
+    svr_request = call->request;
+    byte_buffer packet;
+    buffer_init(&packet);
+    bool is_connected = svr_finish_call(call, output, &packet, svr_call_arena);
+    buffer_deinit(&packet);
+    svr_request = outer_request;
+    trace_swap(call->trace);
+    svr_mem_refund(srv, call->mem_charged);
+
+    // The connection is ready for its next request
+    if (is_connected)
+        svr_requeue_client(srv, &call->client);
+    else
+        close(call->client.clientfd);
+
+    // Only once this is done can the server finish draining
+    pthread_mutex_lock(&srv->mutex_list_fd);
+    srv->n_async_pending--;
+    pthread_cond_broadcast(&srv->client_cond);
+    pthread_mutex_unlock(&srv->mutex_list_fd);
+    free(completion);
+}
+
+static bool svr_finish_call(svr_call* call, rpc_data* output, byte_buffer* packet, arena* ar) {
+    rpc_server* srv = call->srv;
+    func_stats* stats = call->function->stats;
+    int clientfd = call->client.clientfd;
+    hw_profile* cl_profile = &call->client.profile;
+    trace_mark(TRACE_PHASE_HANDLER);
+
+    // Check for errors in data
+    rpc_error error;
+    if ((error = check_data(cl_profile, output) | check_array(output, call->width))) {
+        rpc_data_free(call->input);
+        svr_release_output(ar, output);
+        stats_record_error(stats, error);
+        return svr_handle_rtn_error(clientfd, error);
+    }
+    trace_mark(TRACE_PHASE_CHECK);
+
+    // Only valid results are worth remembering
+    if (call->is_cacheable && !call->is_cached)
+        cache_insert(srv->cache, call->hash_value, call->input, output);
+    rpc_data_free(call->input);
+
+    // Build the success message with output from function call
+    buffer_clear(packet);
+    buffer_put_u8(packet, RPC_RTN_SUCCESS);
+    buffer_put_array(packet, output, call->width, cl_profile);
+    buffer_put_u8(packet, RPC_MSG_END);
+    uint64_t bytes_out = output->data2_len;
+    svr_release_output(ar, output);
+    trace_mark(TRACE_PHASE_ENCODE);
+
+    quick_check(svr_send_reply(clientfd, packet->data, packet->len));
+    trace_mark(TRACE_PHASE_SEND);
+
+    stats_record_call(stats, stats_now_ns() - call->start_ns, call->bytes_in, bytes_out);
+    return true;
+}
+
+static void svr_offload_call(void* arg) {
+    svr_call* call = arg;
+    trace_swap(call->trace);
+
+    // Replies go out the same way the request came in
+    svr_request = call->request;
+    arena* ar = svr_local_offload_arena();
+    byte_buffer packet;
+    buffer_init(&packet);
+
+    rpc_data* output;
+    bool is_connected;
+    if (svr_run_handler(call, ar, &output)) {
+        is_connected = svr_finish_call(call, output, &packet, ar);
+    } else {
+        rpc_data_free(call->input);
+        is_connected = svr_handle_rtn_error(call->client.clientfd, RPC_ERROR_OVERLOADED);
+    }
+    svr_request.is_framed = false;
+    trace_swap(call->trace);
+
+    buffer_deinit(&packet);
+    arena_reset(ar);
+    svr_mem_refund(call->srv, call->mem_charged);
+
+    // The connection is ready for its next request
+    if (is_connected)
+        svr_requeue_client(call->srv, &call->client);
+    else
+        close(call->client.clientfd);
+    free(call);
+}
+
+static arena* svr_local_offload_arena(void) {
+    if (svr_offload_arena != NULL)
+        return svr_offload_arena;
+
+    // Without an arena, results are allocated on their own as they would be
+    // outside of a handler
+    pthread_once(&svr_offload_key_once, svr_create_offload_key);
+    svr_offload_arena = arena_create();
+    if (svr_offload_arena != NULL)
+        pthread_setspecific(svr_offload_key, svr_offload_arena);
+    return svr_offload_arena;
+}
+
+static void svr_create_offload_key(void) {
+    pthread_key_create(&svr_offload_key, svr_destroy_offload_arena);
+}
+
+static void svr_destroy_offload_arena(void* ar) {
+    arena_destroy(ar);
+}
+
+static bool svr_run_stream(svr_call* call, rpc_worker* worker, uint32_t window) {
+    rpc_server* srv = call->srv;
+    hash_item* function = call->function;
+    int clientfd = call->client.clientfd;
+    if (!svr_admit_call(call)) {
+        rpc_data_free(call->input);
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_OVERLOADED);
+    }
+
+    // Streams skip the scheduler, since they spend much of their time waiting
+    // on the client. Items belong to the handler, so svr_call_arena is left
+    // unset rather than have the arena grow for as long as the stream runs
+    rpc_stream stream = {
+        .call = call,
+        .worker = worker,
+        .credits = window,
+        .window = window,
+        .is_connected = true,
+    };
+    int result = function->stream_handler(call->input, &stream);
+    bulkhead_leave(function->bulkhead);
+    atomic_fetch_sub(&srv->n_inflight, 1);
+    rpc_data_free(call->input);
+    trace_mark(TRACE_PHASE_HANDLER);
+    quick_check(stream.is_connected);
+
+    // A failed handler ends the stream with an error, unless the client had
+    // cancelled it, in which case the handler was only told to stop
+    if (result < 0 && !stream.is_cancelled && stream.error == RPC_ERROR_NONE)
+        stream.error = RPC_ERROR_DATA_INVALID;
+    if (stream.error) {
+        stats_record_error(function->stats, stream.error);
+        return svr_handle_rtn_error(clientfd, stream.error);
+    }
+
+    uint8_t packet[] = { RPC_RTN_STREAM_END, RPC_MSG_END };
+    quick_check(svr_send_reply(clientfd, packet, sizeof(packet)));
+    trace_mark(TRACE_PHASE_SEND);
+
+    stats_record_call(function->stats, stats_now_ns() - call->start_ns, 
+                      call->bytes_in, stream.bytes_out);
+    return true;
+}
+
+int rpc_stream_send(rpc_stream* stream, rpc_data* item) {
+    if (stream == NULL || item == NULL)
+        return -1;
+
+    if (!stream->is_connected || stream->is_cancelled || stream->error)
+        return -1;
+
+    svr_call* call = stream->call;
+    int clientfd = call->client.clientfd;
+
+    // Take in whatever credit the client has granted, waiting for some if
+    // none is left. This is also where a cancelled stream is noticed. Credit
+    // comes back half a window at a time, so until that much has been used
+    // the socket is only checked every so often
+    bool is_due = stream->credits <= stream->window / 2 ||
+                  ++stream->n_unpolled >= SVR_STREAM_POLL_ITEMS;
+    if (is_due)
+        stream->n_unpolled = 0;
+    while (stream->credits == 0 || (is_due && socket_is_readable(clientfd))) {
+        if (!svr_stream_take_credit(stream)) {
+            stream->is_connected = false;
+            return -1;
+        }
+        if (stream->is_cancelled)
+            return -1;
+    }
+
+    // Items are checked like any other result
+    rpc_error error = check_data(&call->client.profile, item) | check_array(item, call->width);
+    if (error) {
+        stream->error = error;
+        return -1;
+    }
+
+    byte_buffer* packet = &stream->worker->packet;
+    buffer_clear(packet);
+    buffer_put_u8(packet, RPC_RTN_ITEM);
+    buffer_put_array(packet, item, call->width, &call->client.profile);
+    buffer_put_u8(packet, RPC_MSG_END);
+    if (!svr_send_reply(clientfd, packet->data, packet->len)) {
+        stream->is_connected = false;
+        return -1;
+    }
+
+    stream->credits--;
+    stream->bytes_out += item->data2_len;
+    return 1;
+}
+
+static bool svr_stream_take_credit(rpc_stream* stream) {
+    int clientfd = stream->call->client.clientfd;
+
+    // Credit comes in a frame if the call did, with the same request ID
+    rpc_message message;
+    quick_check(socket_recv(clientfd, &message, sizeof(rpc_message)));
+    if (message == RPC_MSG_FRAME)
+        quick_check(svr_recv_frame(clientfd, stream->worker, &message));
+
+    // The client can't send anything else until the stream has ended
+    if (message != RPC_MSG_STREAM_CREDIT)
+        return false;
+
+    uint32_t credits;
+    quick_check(svr_recv_credit(clientfd, &credits));
+    if (credits == 0)
+        stream->is_cancelled = true;
+    stream->credits += credits;
+    return true;
+}
+
+static bool svr_recv_credit(int clientfd, uint32_t* credits) {
+    uint32_t be_credits;
+    quick_check(svr_recv(clientfd, &be_credits, sizeof(uint32_t)));
+    *credits = ntohl(be_credits);
+
+    rpc_message cl_msg_end;
+    quick_check(svr_recv(clientfd, &cl_msg_end, sizeof(rpc_message)));
+    return cl_msg_end == RPC_MSG_END;
+}
+
+static bool svr_handle_msg_credit(int clientfd) {
+
+    // Clients grant credit as they read, so some can cross the end of its
+    // stream on the wire. It's of no use by now, and needs no reply
+    uint32_t credits;
+    return svr_recv_credit(clientfd, &credits);
+}
+
+static bool svr_handle_msg_stats(int clientfd, hw_profile* cl_profile, rpc_server* srv) {
+    if (cl_profile == NULL || srv == NULL)
+        return true;
+
+    // Validate client packet
+    rpc_message cl_msg_end;
+    quick_check(svr_recv(clientfd, &cl_msg_end, sizeof(rpc_message)));
+    if (cl_msg_end != RPC_MSG_END)
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_PQT_INVALID);
+
+    // Make sure the client has initialised the connection properly
+    if (!cl_profile->initialised)
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_CXN_INVALID);
+
+    size_t count;
+    rpc_stats* stats = rpc_server_stats(srv, &count);
+
+    // There are a lot of fields, so build the packet up and send it in one go
+    byte_buffer packet;
+    buffer_init(&packet);
+    buffer_put_u8(&packet, RPC_RTN_SUCCESS);
+    buffer_put_u16(&packet, count);
+    for (size_t i=0; i<count; i++) {
+        uint16_t len_name = strlen(stats[i].name);
+        buffer_put_u16(&packet, len_name);
+        buffer_put_bytes(&packet, stats[i].name, len_name);
+
+        uint64_t* fields[RPC_STATS_NUM_FIELDS];
+        rpc_stats_fields(&stats[i], fields);
+        for (int j=0; j<RPC_STATS_NUM_FIELDS; j++)
+            buffer_put_u64(&packet, *fields[j]);
+    }
+    buffer_put_u8(&packet, RPC_MSG_END);
+    rpc_stats_free(stats, count);
+
+    bool is_sent = svr_send_reply(clientfd, packet.data, packet.len);
+    buffer_deinit(&packet);
+    return is_sent;
+}
+
+static bool svr_handle_msg_load(int clientfd, hw_profile* cl_profile, rpc_server* srv) {
+    if (cl_profile == NULL || srv == NULL)
+        return true;
+
+    // Validate client packet
+    rpc_message cl_msg_end;
+    quick_check(svr_recv(clientfd, &cl_msg_end, sizeof(rpc_message)));
+    if (cl_msg_end != RPC_MSG_END)
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_PQT_INVALID);
+
+    // Make sure the client has initialised the connection properly
+    if (!cl_profile->initialised)
+        return svr_handle_rtn_error(clientfd, RPC_ERROR_CXN_INVALID);
+
+    // Leaving out what this request was charged itself
+    rpc_load load;
+    rpc_server_load(srv, &load);
+    load.inbound_bytes -= svr_mem_charged;
+
+    byte_buffer packet;
+    buffer_init(&packet);
+    buffer_put_u8(&packet, RPC_RTN_SUCCESS);
+    buffer_put_u64(&packet, load.queued_clients);
+    buffer_put_u64(&packet, load.inflight_calls);
+    buffer_put_u64(&packet, load.rejected_clients);
+    buffer_put_u64(&packet, load.rejected_calls);
+
+    // Clients that know about memory budgets are told how they're holding up
+    if (cl_profile->capabilities & RPC_CAP_LOAD_MEMORY) {
+        buffer_put_u64(&packet, load.inbound_bytes);
+        buffer_put_u64(&packet, load.rejected_payloads);
+    }
+    buffer_put_u8(&packet, RPC_MSG_END);
+
+    bool is_sent = svr_send_reply(clientfd, packet.data, packet.len);
+    buffer_deinit(&packet);
+    return is_sent;
+}
+
+static bool svr_handle_rtn_error(int clientfd, rpc_error error) {
+
+    // Older clients only take the one byte
+    if (!svr_request.is_error_wide) {
+        uint8_t packet[] = { RPC_RTN_ERROR, svr_error_legacy(error), RPC_MSG_END };
+        quick_check(svr_send_reply(clientfd, packet, sizeof(packet)));
+        return true;
+    }
+
+    // Send error message along with the error, and comply with protocol
+    uint8_t packet[] = { RPC_RTN_ERROR, error >> 8, error & 0xFF, RPC_MSG_END };
+    quick_check(svr_send_reply(clientfd, packet, sizeof(packet)));
+    return true;
+}
+
+static uint8_t svr_error_legacy(rpc_error error) {
+    if (error & RPC_ERROR_OVERLOADED)
+        return RPC_ERROR_LEGACY_OVERLOADED;
+
+    // The payload was too big for the server, if not for the protocol
+    if (error & RPC_ERROR_MEM_BUDGET)
+        error = (error & ~RPC_ERROR_MEM_BUDGET) | RPC_ERROR_DATA_BUFF_OVF;
+    return error & 0xFF;
+}
+
+static bool svr_recv_frame(int clientfd, rpc_worker* worker, rpc_message* message) {
+
+    // The marker has been read in already
+    uint8_t bytes[RPC_FRAME_HEADER_SIZE] = { RPC_MSG_FRAME };
+    quick_check(socket_recv(clientfd, &bytes[1], RPC_FRAME_HEADER_SIZE - 1));
+    rpc_frame_header header;
+    frame_header_decode(bytes, &header);
+
+    svr_request.is_framed = true;
+    svr_request.request_id = header.request_id;
+    *message = header.type;
+
+    // Credit arrives in the middle of streams, where there's no way to turn it
+    // away, so it's held to its exact size instead of being charged
+    bool is_credit = header.type == RPC_MSG_STREAM_CREDIT;
+    if (is_credit && header.body_len != sizeof(uint32_t) + sizeof(rpc_message))
+        return false;
+
+    // A body that doesn't fit the budget is read past, so the error reply
+    // still lines up with its request and the connection stays usable
+    if (!is_credit && !svr_mem_charge(worker->srv, header.body_len)) {
+        svr_request.is_over_budget = true;
+        svr_request.body = NULL;
+        return socket_skip(clientfd, header.body_len);
+    }
+
+    // Read the body in one go, handlers then parse it out of memory
+    quick_check(socket_recv_buffer(clientfd, &worker->request, header.body_len));
+    svr_request.body = &worker->request;
+    return true;
+}
+
+static bool svr_recv(int clientfd, void* buff, size_t nbytes) {
+    if (!svr_request.is_framed)
+        return socket_recv(clientfd, buff, nbytes);
+
+    // Running off the end of a frame is as bad as the client hanging up
+    return buffer_get_bytes(svr_request.body, buff, nbytes);
+}
+
+static bool svr_recv_data_flags(int clientfd, rpc_server* srv, rpc_data** output, rpc_data_flags* flags) {
+    if (!svr_request.is_framed) {
+        data_admit admit = { .fn = svr_admit_data, .arg = srv };
+        return socket_recv_data_flags(clientfd, output, flags, &admit);
+    }
+
+    // data2 is no bigger than the body it's parsed out of, which was charged for already
+    return buffer_get_data_flags(svr_request.body, output, flags, NULL);
+}
+
+static bool svr_mem_charge(rpc_server* srv, uint64_t nbytes) {
+
+    // Lengths come off the wire, so sums are checked without overflowing
+    size_t max_conn = srv->max_conn_bytes;
+    if (max_conn > 0 && (svr_mem_charged > max_conn || nbytes > max_conn - svr_mem_charged)) {
+        atomic_fetch_add(&srv->n_rejected_payloads, 1);
+        return false;
+    }
+
+    // Other connections charge the server at the same time
+    size_t max_total = srv->max_total_bytes;
+    size_t total = atomic_load(&srv->n_mem_bytes);
+    do {
+        if ((max_total > 0 && (total > max_total || nbytes > max_total - total)) ||
+            nbytes > SIZE_MAX - total) {
+            atomic_fetch_add(&srv->n_rejected_payloads, 1);
+            return false;
+        }
+    } while (!atomic_compare_exchange_weak(&srv->n_mem_bytes, &total, total + nbytes));
+
+    svr_mem_charged += nbytes;
+    return true;
+}
+
+static void svr_mem_refund(rpc_server* srv, size_t nbytes) {
+    if (nbytes > 0)
+        atomic_fetch_sub(&srv->n_mem_bytes, nbytes);
+}
+
+static bool svr_admit_data(void* arg, uint64_t data2_len) {
+    return svr_mem_charge(arg, data2_len);
+}
+
+static bool svr_send_reply(int clientfd, void* reply, size_t nbytes) {
+    if (!svr_request.is_framed)
+        return socket_send(clientfd, reply, nbytes);
+
+    // Framed requests get framed replies with the same ID. The body is
+    // everything after the leading RPC_RTN_* message
+    uint8_t* bytes = reply;
+    rpc_frame_header header = {
+        .type = bytes[0],
+        .flags = 0,
+        .request_id = svr_request.request_id,
+        .body_len = nbytes - 1,
+    };
+    return socket_send_frame(clientfd, &header, bytes + 1);
+}
+
+static void cl_begin_request(rpc_client* cl) {
+    byte_buffer* packet = &cl->packet;
+    buffer_clear(packet);
+
+    // The connection is dropped when its handshake fails, and the request goes
+    // out on a new one. If that can't be opened, sending the request fails
+    if (cl->serverfd == SOCKET_NULL_HANDLE)
+        cl_open(cl);
+    if (!cl->is_handshake_pending)
+        return;
+
+    // Handshake with the size of int and size_t in bytes, our byte order and
+    // what we support. Being in the same write as the request also matters
+    // when the server is overloaded, since it replies and hangs up without
+    // reading anything, and a second write would fail before we see why
+    buffer_put_u8(packet, cl->is_connect_legacy ? RPC_MSG_CONNECT : RPC_MSG_CONNECT_EXT);
+    buffer_put_u8(packet, sizeof(int));
+    buffer_put_u8(packet, sizeof(size_t));
+    if (!cl->is_connect_legacy) {
+        buffer_put_u8(packet, RPC_ORDER_NATIVE);
+        buffer_put_u32(packet, RPC_CAPS_SUPPORTED);
+    }
+    buffer_put_u8(packet, RPC_MSG_END);
+    cl->handshake_len = packet->len;
+}
+
+static bool cl_send_request(rpc_client* cl) {
+
+    // Once the server says it understands frames, requests go out in them.
+    // The handshake and the request sent along with it never can
+    bool is_framed = !cl->is_handshake_pending && 
+                     (cl->srv_profile.capabilities & RPC_CAP_FRAMES);
+    cl->is_reply_framed = is_framed;
+    if (is_framed) {
+        rpc_frame_header header = {
+            .type = cl->packet.data[0],
+            .flags = 0,
+            .request_id = ++cl->next_request_id,
+            .body_len = cl->packet.len - 1,
+        };
+        return socket_send_frame(cl->serverfd, &header, cl->packet.data + 1);
+    }
+
+    quick_check(socket_send(cl->serverfd, cl->packet.data, cl->packet.len));
+    if (!cl->is_handshake_pending)
+        return true;
+
+    // The server answers the handshake before it answers the request
+    cl->is_handshake_pending = false;
+    bool is_ok = cl_handle_rtn_connect(cl, &cl->srv_profile);
+    if (is_ok && cl->srv_profile.initialised)
+        return true;
+
+    // Otherwise the server replied with an error instead of its profile, in
+    // which case it has either hung up or will refuse everything sent on this
+    // connection. Drop it, so that the next request starts over on a new one
+    if (!is_ok || cl_last_error != RPC_ERROR_MSG_INVALID || cl->is_connect_legacy) {
+        close(cl->serverfd);
+        cl->serverfd = SOCKET_NULL_HANDLE;
+        return false;
+    }
+
+    // Servers older than RPC_MSG_CONNECT_EXT don't know it, and have taken the
+    // rest of the handshake for messages of their own. Start again on a fresh
+    // connection with the plain handshake, in front of the same request
+
+    byte_buffer request;
+    buffer_init(&request);
+    buffer_put_bytes(&request, cl->packet.data + cl->handshake_len, 
+                     cl->packet.len - cl->handshake_len);
+    close(cl->serverfd);
+    cl->serverfd = SOCKET_NULL_HANDLE;
+    cl->is_connect_legacy = true;
+    cl_last_error = RPC_ERROR_NONE;
+
+    bool is_sent = cl_open(cl);
+    if (is_sent) {
+        cl_begin_request(cl);
+        buffer_put_bytes(&cl->packet, request.data, request.len);
+        is_sent = cl_send_request(cl);
+    }
+    buffer_deinit(&request);
+    return is_sent;
+}
+
+static bool cl_recv_rtn(rpc_client* cl, rpc_message* message) {
+    if (!cl->is_reply_framed)
+        return socket_recv(cl->serverfd, message, sizeof(rpc_message));
+
+    // A reply to anything but the last request means we've lost our place
+    uint8_t bytes[RPC_FRAME_HEADER_SIZE];
+    rpc_frame_header header;
+    quick_check(socket_recv(cl->serverfd, bytes, sizeof(bytes)));
+    if (!frame_header_decode(bytes, &header) || header.request_id != cl->next_request_id)
+        return false;
+
+    quick_check(socket_recv_buffer(cl->serverfd, &cl->reply, header.body_len));
+    *message = header.type;
+    return true;
+}
+
+static bool cl_recv(rpc_client* cl, void* buff, size_t nbytes) {
+    if (!cl->is_reply_framed)
+        return socket_recv(cl->serverfd, buff, nbytes);
+    return buffer_get_bytes(&cl->reply, buff, nbytes);
+}
+
+static bool cl_recv_data_into(rpc_client* cl, rpc_response* response, rpc_data_flags* flags) {
+    if (!cl->is_reply_framed) {
+        return socket_recv_data_into(cl->serverfd, &response->data, flags, 
+                                     &response->buffer, &response->capacity, NULL);
+    }
+    return buffer_get_data_into(&cl->reply, &response->data, flags, 
+                                &response->buffer, &response->capacity, NULL);
+}
+
+static bool pool_connect(rpc_pool_backend* backend) {
+    if (backend->cl != NULL)
+        return true;
+
+    // Once connected, let the client replace a dropped connection by itself.
+    // A single immediate attempt is enough, the balancer does the backing off
+    backend->cl = rpc_init_client(backend->addr, backend->port);
+    rpc_client_set_reconnect(backend->cl, 1, 0, 0);
+    return backend->cl != NULL;
+}
+
+static bool pool_is_failure(bool is_ok) {
+
+    // Errors about the request itself say nothing about the health of the
+    // server. Overloaded servers and lost connections do
+    return !is_ok && (cl_last_error == RPC_ERROR_NONE || (cl_last_error & RPC_ERROR_OVERLOADED));
+}
+
+static void pool_disconnect(rpc_pool_backend* backend) {
+    rpc_close_client(backend->cl);
+    backend->cl = NULL;
+}
+
+static bool pool_hedge_delay(rpc_pool* pool, rpc_handle* h, uint64_t* delay_ns) {
+
+    // Only calls that are safe to run twice, with somewhere else to send them
+    if (pool->hedge_percentile == 0 || pool->n_backends < 2 ||
+        !(h->flags & (RPC_FUNC_IDEMPOTENT | RPC_FUNC_PURE)))
+        return false;
+
+    unsigned n_samples = atomic_load_explicit(&h->n_samples, memory_order_relaxed);
+    if (n_samples < HANDLE_MIN_SAMPLES)
+        return false;
+    if (n_samples > HANDLE_NUM_SAMPLES)
+        n_samples = HANDLE_NUM_SAMPLES;
+
+    // Few enough samples that sorting a copy is cheaper than keeping them sorted
+    uint32_t sorted[HANDLE_NUM_SAMPLES];
+    for (unsigned i=0; i<n_samples; i++)
+        sorted[i] = atomic_load_explicit(&h->samples_us[i], memory_order_relaxed);
+    qsort(sorted, n_samples, sizeof(uint32_t), handle_compare_samples);
+
+    *delay_ns = (uint64_t)sorted[(unsigned)(pool->hedge_percentile * (n_samples - 1))] * 1000;
+    if (*delay_ns < pool->hedge_min_delay_ns)
+        *delay_ns = pool->hedge_min_delay_ns;
+    return true;
+}
+
+static rpc_data* pool_call_hedged(rpc_pool* pool, rpc_handle* h, rpc_data* payload, uint64_t delay_ns) {
+    rpc_pool_leg legs[2];
+    rpc_pool_leg* first = &legs[0];
+    rpc_pool_leg* second = &legs[1];
+
+    // Give the first server until the delay to answer
+    first->index = balancer_pick(pool->balancer, BALANCER_NO_BACKEND);
+    first->backend = &pool->backends[first->index];
+    pthread_mutex_lock(&first->backend->mutex);
+    first->is_pending = pool_leg_send(pool, first, h, payload);
+    if (first->is_pending && pool_legs_wait(legs, 1, delay_ns) == 0) {
+        rpc_data* output = pool_leg_recv(pool, first, h);
+        if (!pool_is_failure(output != NULL))
+            return output;
+    }
+
+    // Errors about the call itself would only repeat on the second server
+    if (!first->is_pending && !pool_is_failure(false))
+        return NULL;
+
+    // Hedge to a second server. While the first is still pending, only take
+    // one that's free right away, since waiting for it could deadlock against
+    // another thread hedging the other way
+    second->index = balancer_pick(pool->balancer, first->index);
+    second->backend = &pool->backends[second->index];
+    second->is_pending = false;
+    bool is_locked = first->is_pending ? 
+        second->index != first->index && pthread_mutex_trylock(&second->backend->mutex) == 0 :
+        pthread_mutex_lock(&second->backend->mutex) == 0;
+    if (is_locked)
+        second->is_pending = pool_leg_send(pool, second, h, payload);
+    else
+        balancer_done(pool->balancer, second->index, false);
+
+    // Take whichever answers first, cutting off the other. Its server still
+    // runs the call, but the reply is never waited for
+    while (first->is_pending || second->is_pending) {
+        int ready = pool_legs_wait(legs, 2, -1);
+        if (ready < 0)
+            break;
+
+        rpc_pool_leg* winner = &legs[ready];
+        rpc_pool_leg* loser = &legs[1 - ready];
+        rpc_data* output = pool_leg_recv(pool, winner, h);
+        if (!pool_is_failure(output != NULL)) {
+            pool_leg_abandon(pool, loser);
+            return output;
+        }
     }
-    if (cl_msg_end != RPC_MSG_END)
-        return svr_handle_rtn_error(clientfd, RPC_ERROR_PQT_INVALID);
 
-    // Attempt to find handler using name
-    rpc_handler handler = ht_index(ht_fnc, name);
-    FREE(name);
+    // Polling failed, so neither reply can be waited for
+    pool_leg_abandon(pool, first);
+    pool_leg_abandon(pool, second);
+    return NULL;
+}
 
-    // Check if the handler exists
-    if (handler == NULL)
-        return svr_handle_rtn_error(clientfd, RPC_ERROR_FUNC_NOT_FOUND);
+static bool pool_leg_send(rpc_pool* pool, rpc_pool_leg* leg, rpc_handle* h, rpc_data* payload) {
+    rpc_pool_backend* backend = leg->backend;
+    cl_last_error = RPC_ERROR_NONE;
+    if (pool_connect(backend) && cl_check_payload(backend->cl, h, payload)) {
+        if (cl_send_call(backend->cl, h, payload))
+            return true;
 
-    // Send success message
-    rpc_message message = RPC_RTN_SUCCESS;
-    quick_check(socket_send(clientfd, &message, sizeof(rpc_message)));
+        // Let the connection be replaced the next time the server is picked
+        pool_disconnect(backend);
+    }
 
-    // Send function hash value
-    uint64_t hash_value = ht_retrieve_hash(ht_fnc, handler);
-    hash_value = hton64(hash_value);
-    quick_check(socket_send(clientfd, &hash_value, sizeof(uint64_t)));
+    balancer_done(pool->balancer, leg->index, pool_is_failure(false));
+    pthread_mutex_unlock(&backend->mutex);
+    return false;
+}
 
-    // Comply with protocol
-    rpc_message svr_msg_end = RPC_MSG_END;
-    quick_check(socket_send(clientfd, &svr_msg_end, sizeof(rpc_message)));
+static rpc_data* pool_leg_recv(rpc_pool* pool, rpc_pool_leg* leg, rpc_handle* h) {
+    rpc_pool_backend* backend = leg->backend;
+    rpc_data* output = NULL;
+    cl_last_error = RPC_ERROR_NONE;
+    if (!cl_recv_call(backend->cl, h, &output))
+        pool_disconnect(backend);
 
-    return true;
+    balancer_done(pool->balancer, leg->index, pool_is_failure(output != NULL));
+    pthread_mutex_unlock(&backend->mutex);
+    leg->is_pending = false;
+    return output;
 }
 
-static bool svr_handle_msg_call(int clientfd, hw_profile* cl_profile, hash_table* ht_fnc) {
-    if (cl_profile == NULL || ht_fnc == NULL)
-        return true; 
+static void pool_leg_abandon(rpc_pool* pool, rpc_pool_leg* leg) {
+    if (!leg->is_pending)
+        return;
 
-    // Make sure the client has initialised the connection properly
-    if (!cl_profile->initialised)
-        return svr_handle_rtn_error(clientfd, RPC_ERROR_CXN_INVALID);
+    // The reply would otherwise be read as the answer to the next call
+    pool_disconnect(leg->backend);
+    balancer_done(pool->balancer, leg->index, false);
+    pthread_mutex_unlock(&leg->backend->mutex);
+    leg->is_pending = false;
+}
 
-    // Scan in data
-    rpc_data* input;
-    quick_check(socket_recv_data(clientfd, &input));
+static int pool_legs_wait(rpc_pool_leg* legs, int n_legs, int64_t timeout_ns) {
+    struct pollfd fds[n_legs];
+    for (int i=0; i<n_legs; i++) {
+        fds[i].fd = legs[i].is_pending ? legs[i].backend->cl->serverfd : -1;
+        fds[i].events = POLLIN;
+        fds[i].revents = 0;
+    }
 
-    // Scan in function handle
-    uint64_t hash_value;
-    if (!socket_recv(clientfd, &hash_value, sizeof(uint64_t))) {
-        rpc_data_free(input);
-        return false;
+    // Rounded up, so that a short delay isn't a zero wait
+    int timeout_ms = timeout_ns < 0 ? -1 : (timeout_ns + 999999) / 1000000;
+    int n_ready;
+    while ((n_ready = poll(fds, n_legs, timeout_ms)) < 0 && errno == EINTR);
+    if (n_ready <= 0)
+        return -1;
+
+    // Hang ups and errors count as ready too, the read then fails
+    for (int i=0; i<n_legs; i++) {
+        if (fds[i].revents)
+            return i;
     }
-    hash_value = ntoh64(hash_value);
+    return -1;
+}
 
-    // Validate client packet
-    rpc_message cl_msg_end;
-    if (!socket_recv(clientfd, &cl_msg_end, sizeof(uint8_t))) {
-        rpc_data_free(input);
+static void handle_record_latency(rpc_handle* h, uint64_t latency_ns) {
+    uint64_t latency_us = latency_ns / 1000;
+    if (latency_us > UINT32_MAX)
+        latency_us = UINT32_MAX;
+
+    unsigned slot = atomic_fetch_add_explicit(&h->n_samples, 1, memory_order_relaxed);
+    atomic_store_explicit(&h->samples_us[slot % HANDLE_NUM_SAMPLES], latency_us, memory_order_relaxed);
+}
+
+static int handle_compare_samples(const void* a, const void* b) {
+    uint32_t left = *(uint32_t*)a;
+    uint32_t right = *(uint32_t*)b;
+    return (left > right) - (left < right);
+}
+
+static bool cl_open(rpc_client* cl) {
+
+    // Generate information about local machine
+    char* port_string = int_to_string(cl->port);
+    struct addrinfo* svr_info = NULL; 
+    struct addrinfo hints = {
+        .ai_family = AF_INET6,
+        .ai_socktype = SOCK_STREAM,
+    };
+
+    int ai_error;
+    if ((ai_error = getaddrinfo(cl->addr, port_string, &hints, &svr_info)) != 0) {
+        fprintf(stderr, "%s\n", gai_strerror(ai_error));
+        FREE(port_string);
         return false;
     }
-    if (cl_msg_end != RPC_MSG_END) {
-        rpc_data_free(input);
-        return svr_handle_rtn_error(clientfd, RPC_ERROR_PQT_INVALID);
-    }
+    FREE(port_string);
 
-    // Run the function
-    rpc_handler handler = ht_index_with_hash(ht_fnc, hash_value);
-    if (handler == NULL) {
-        rpc_data_free(input);
-        return svr_handle_rtn_error(clientfd, RPC_ERROR_HNDL_INVALID);
-    }
-    rpc_data* output = handler(input);
-    rpc_data_free(input);
+    // Iterate through results to find correct addrinfo and create socket
+    for (struct addrinfo* curr_info = svr_info; curr_info != NULL; curr_info = curr_info->ai_next) {
+        
+        // Must be IPv6
+        if (curr_info->ai_family != hints.ai_family) 
+            continue;
 
-    // Check for errors in data
-    rpc_error error;
-    if ((error = check_data(cl_profile, output))) {
-        rpc_data_free(output);
-        return svr_handle_rtn_error(clientfd, error);
-    }
+        // If we can't socket we go to the next item in the list
+        if ((cl->serverfd = socket(
+                                curr_info->ai_family, 
+                                curr_info->ai_socktype, 
+                                curr_info->ai_protocol)) < 0) 
+            {
+            continue;
+        }
 
-    // Send success message with output from function call
-    rpc_message message = RPC_RTN_SUCCESS;
-    if (!socket_send(clientfd, &message, sizeof(rpc_message)) ||
-        !socket_send_data(clientfd, output)) {
-        rpc_data_free(output);
-        return false;
+        // Try to connect to the server
+        if (connect(
+                cl->serverfd, 
+                curr_info->ai_addr, 
+                curr_info->ai_addrlen) != -1) 
+            {
+            break;
+        }
+
+        // Go to next info if we can't connect
+        close(cl->serverfd);
+        cl->serverfd = SOCKET_NULL_HANDLE;
     }
+    freeaddrinfo(svr_info);   
 
-    // Comply with protocol
-    rpc_message svr_msg_end = RPC_MSG_END;
-    if(!socket_send(clientfd, &svr_msg_end, sizeof(rpc_message))) {
-        rpc_data_free(output);
+    if (cl->serverfd == SOCKET_NULL_HANDLE)
         return false;
-    }
 
-    rpc_data_free(output);
+    // Requests are always sent in a single write, see above
+    int opt_val = true;
+    setsockopt(cl->serverfd, IPPROTO_TCP, TCP_NODELAY, &opt_val, sizeof(opt_val));
+
+    // Rather than wait a round trip for the handshake, send it along with the
+    // first request. Until then the profile of the server is unknown
+    memset(&cl->srv_profile, 0, sizeof(hw_profile));
+    cl->is_handshake_pending = true;
     return true;
 }
 
-static bool svr_handle_rtn_error(int clientfd, rpc_error error) {
+static bool cl_reconnect(rpc_client* cl) {
+    if (cl->reconnect_attempts == 0)
+        return false;
 
-    // Send error message
-    rpc_message message = RPC_RTN_ERROR;
-    quick_check(socket_send(clientfd, &message, sizeof(rpc_message)));
+    // An overloaded server hangs up on purpose, and coming straight back
+    // would only add to its load
+    if (cl_last_error)
+        return false;
 
-    // Send the error
-    quick_check(socket_send(clientfd, &error, sizeof(rpc_error)));
+    if (cl->serverfd != SOCKET_NULL_HANDLE)
+        close(cl->serverfd);
+    cl->serverfd = SOCKET_NULL_HANDLE;
+
+    // The first attempt is made straight away since the connection may have
+    // been cut by something other than the server going down. After that, wait
+    // twice as long each time, each wait randomised so that clients cut off
+    // together don't all come back together
+    uint64_t delay_ms = cl->reconnect_base_ms;
+    for (unsigned attempt=0; attempt<cl->reconnect_attempts; attempt++) {
+        if (attempt > 0) {
+            uint64_t jittered_ms = delay_ms / 2 + rand() % (delay_ms / 2 + 1);
+            struct timespec wait = {
+                .tv_sec = jittered_ms / 1000,
+                .tv_nsec = (jittered_ms % 1000) * 1000000,
+            };
+            nanosleep(&wait, NULL);
+            delay_ms = delay_ms * 2 > cl->reconnect_max_ms ? cl->reconnect_max_ms : delay_ms * 2;
+        }
 
-    // Comply with protocol
-    rpc_message svr_msg_end = RPC_MSG_END;
-    quick_check(socket_send(clientfd, &svr_msg_end, sizeof(rpc_message)));
-    return true;
+        if (cl_open(cl))
+            return true;
+    }
+    return false;
 }
 
-static bool cl_handle_proc_connect(int serverfd, hw_profile* svr_profile) {
+static bool cl_handle_rtn_connect(rpc_client* cl, hw_profile* svr_profile) {
     if (svr_profile == NULL)
         return true;
 
-    // Send out request
-    rpc_message message = RPC_MSG_CONNECT;
-    quick_check(socket_send(serverfd, &message, sizeof(message)));
-
-    // Send size of int in bytes
-    uint8_t sizeof_int_cl = sizeof(int);
-    quick_check(socket_send(serverfd, &sizeof_int_cl, sizeof(uint8_t)));
-
-    // Send size of size_t in bytes
-    uint8_t sizeof_size_t_cl = sizeof(size_t);
-    quick_check(socket_send(serverfd, &sizeof_size_t_cl, sizeof(uint8_t)));
-
-    // Comply with protocol
-    rpc_message cl_msg_end = RPC_MSG_END;
-    quick_check(socket_send(serverfd, &cl_msg_end, sizeof(rpc_message)));
-
     // Output
     rpc_message return_val;
-    quick_check(socket_recv(serverfd, &return_val, sizeof(rpc_message)));
+    quick_check(cl_recv_rtn(cl, &return_val));
     
-    // Handle the error
-    if (return_val == RPC_RTN_ERROR)
-        return cl_handle_rtn_error(serverfd);
+    // Handle the error. A server that doesn't understand the extended
+    // handshake is expected to say so, which is not worth reporting
+    if (return_val == RPC_RTN_ERROR) {
+        quick_check(cl_recv_rtn_error(cl));
+        if (cl_last_error != RPC_ERROR_MSG_INVALID || cl->is_connect_legacy)
+            cl_print_rtn_error(cl_last_error);
+        return true;
+    }
 
     // Scan in size of int in bytes
     uint8_t sizeof_int_svr;
-    quick_check(socket_recv(serverfd, &sizeof_int_svr, sizeof(uint8_t)));
+    quick_check(cl_recv(cl, &sizeof_int_svr, sizeof(uint8_t)));
     svr_profile->int_max = MAX_SINT(sizeof_int_svr);
     svr_profile->int_min = -svr_profile->int_max - 1;
 
     // Scan in size of size_t in bytes
     uint8_t sizeof_size_t_svr;
-    quick_check(socket_recv(serverfd, &sizeof_size_t_svr, sizeof(uint8_t)));
+    quick_check(cl_recv(cl, &sizeof_size_t_svr, sizeof(uint8_t)));
     svr_profile->size_max = MAX_UINT(sizeof_size_t_svr);
+
+    // Scan in byte order and capabilities, only keeping those we share
+    svr_profile->byte_order = RPC_ORDER_UNKNOWN;
+    svr_profile->capabilities = RPC_CAP_NONE;
+    if (!cl->is_connect_legacy) {
+        rpc_byte_order byte_order_svr;
+        rpc_capabilities be_caps_svr;
+        quick_check(cl_recv(cl, &byte_order_svr, sizeof(rpc_byte_order)));
+        quick_check(cl_recv(cl, &be_caps_svr, sizeof(rpc_capabilities)));
+        svr_profile->byte_order = byte_order_svr;
+        svr_profile->capabilities = ntohl(be_caps_svr) & RPC_CAPS_SUPPORTED;
+    }
     svr_profile->initialised = true;
 
     // Check the server has ended its message
     rpc_message svr_msg_end;
-    quick_check(socket_recv(serverfd, &svr_msg_end, sizeof(rpc_message)));
+    quick_check(cl_recv(cl, &svr_msg_end, sizeof(rpc_message)));
     if (svr_msg_end != RPC_MSG_END)
         return false;
 
     return true;
 }
 
-static bool cl_handle_proc_find(int serverfd, char* char_buff, 
+static bool cl_handle_proc_find(rpc_client* cl, char* char_buff, 
                                 uint16_t length, rpc_handle** output) {
 
-    if (char_buff == NULL || output == NULL)
+    if (cl == NULL || char_buff == NULL || output == NULL)
         return true;
 
     *output = NULL;
 
-    // Send out request
-    rpc_message message = RPC_MSG_FUNC_FIND;
-    quick_check(socket_send(serverfd, &message, sizeof(rpc_message)));
-
-    // Send length of function name followed by the name itself
-    uint16_t be_length = htons(length);
-    quick_check(socket_send(serverfd, &be_length, sizeof(uint16_t)));
-    quick_check(socket_send(serverfd, char_buff, length));
-
-    // End message
-    rpc_message cl_msg_end = RPC_MSG_END;
-    quick_check(socket_send(serverfd, &cl_msg_end, sizeof(rpc_message)));
+    // Send out request with the length of function name followed by the name itself
+    cl_begin_request(cl);
+    buffer_put_u8(&cl->packet, RPC_MSG_FUNC_FIND);
+    buffer_put_u16(&cl->packet, length);
+    buffer_put_bytes(&cl->packet, char_buff, length);
+    buffer_put_u8(&cl->packet, RPC_MSG_END);
+    quick_check(cl_send_request(cl));
 
     // Deal with return value
     rpc_message return_val;
-    quick_check(socket_recv(serverfd, &return_val, sizeof(rpc_message)));
+    quick_check(cl_recv_rtn(cl, &return_val));
 
     // Handle the error
     if (return_val == RPC_RTN_ERROR)
-        return cl_handle_rtn_error(serverfd);
+        return cl_handle_rtn_error(cl);
     
     // Retrieve function handle
     uint64_t be_hash_value;
-    quick_check(socket_recv(serverfd, &be_hash_value, sizeof(uint64_t)));
+    quick_check(cl_recv(cl, &be_hash_value, sizeof(uint64_t)));
+
+    // Servers that understand typed arrays tell us the element width
+    uint8_t elem_width = 0;
+    if (cl->srv_profile.capabilities & RPC_CAP_TYPED_ARRAY)
+        quick_check(cl_recv(cl, &elem_width, sizeof(uint8_t)));
+
+    // And newer ones what else they know about the function
+    uint32_t be_flags = 0;
+    if (cl->srv_profile.capabilities & RPC_CAP_FUNC_FLAGS)
+        quick_check(cl_recv(cl, &be_flags, sizeof(uint32_t)));
     
     // Validate server packet
     rpc_message svr_msg_end;
-    quick_check(socket_recv(serverfd, &svr_msg_end, sizeof(rpc_message)));
+    quick_check(cl_recv(cl, &svr_msg_end, sizeof(rpc_message)));
     if (svr_msg_end != RPC_MSG_END)
         return false;
 
     // Return the handle to the client
     rpc_handle* handle = calloc(1, sizeof(rpc_handle));
     handle->hash_value = ntoh64(be_hash_value);
+    handle->elem_width = elem_width;
+    handle->flags = ntohl(be_flags);
     *output = handle;
 
     return true;
 }
 
-static bool cl_handle_proc_call(int serverfd, rpc_handle* handle, 
+static bool cl_handle_proc_call(rpc_client* cl, rpc_handle* handle, 
                                 rpc_data* input, rpc_data** output) {
-    if (handle == NULL || input == NULL || output == NULL)
+    if (cl == NULL || handle == NULL || input == NULL || output == NULL)
         return true;
 
     *output = NULL;
+    quick_check(cl_send_call(cl, handle, input));
+    return cl_recv_call(cl, handle, output);
+}
 
-    // Send out a request with data
-    rpc_message message = RPC_MSG_FUNC_CALL;
-    quick_check(socket_send(serverfd, &message, sizeof(rpc_message)));
-    quick_check(socket_send_data(serverfd, input));
-    
-    // Send function handle
-    uint64_t hash_value = hton64(handle->hash_value);
-    quick_check(socket_send(serverfd, &hash_value, sizeof(uint64_t)));
+static bool cl_send_call(rpc_client* cl, rpc_handle* handle, rpc_data* input) {
 
-    // Comply with protocol
-    rpc_message cl_msg_end = RPC_MSG_END;
-    quick_check(socket_send(serverfd, &cl_msg_end, sizeof(rpc_message)));
+    // Build a request with data and the function handle, and send it in one go
+    byte_buffer* packet = &cl->packet;
+    cl_begin_request(cl);
+    buffer_put_u8(packet, RPC_MSG_FUNC_CALL);
+    buffer_put_array(packet, input, handle->elem_width, &cl->srv_profile);
+    buffer_put_u64(packet, handle->hash_value);
+    buffer_put_u8(packet, RPC_MSG_END);
+    return cl_send_request(cl);
+}
+
+static bool cl_recv_call(rpc_client* cl, rpc_handle* handle, rpc_data** output) {
+    *output = NULL;
 
     // Deal with output
     rpc_message return_val;
-    quick_check(socket_recv(serverfd, &return_val, sizeof(rpc_message)));
+    quick_check(cl_recv_rtn(cl, &return_val));
 
     // Handle error
     if (return_val == RPC_RTN_ERROR)
-        return cl_handle_rtn_error(serverfd);
+        return cl_handle_rtn_error(cl);
 
-    // Otherwise scan in data
-    rpc_data* data_in;
-    quick_check(socket_recv_data(serverfd, &data_in));
+    return cl_recv_output(cl, handle->elem_width, output);
+}
+
+static bool cl_recv_output(rpc_client* cl, unsigned elem_width, rpc_data** output) {
+    *output = NULL;
+
+    // Read into an empty response, whose buffer is then exactly as big as data2
+    rpc_response response = { 0 };
+    bool has_output;
+    bool is_ok = cl_recv_response(cl, elem_width, &response, &has_output);
+    if (!is_ok || !has_output) {
+        rpc_response_free(&response);
+        return is_ok;
+    }
+
+    *output = malloc(sizeof(rpc_data));
+    **output = response.data;
+
+    return true;
+}
+
+static bool cl_recv_call_into(rpc_client* cl, rpc_handle* handle, 
+                              rpc_response* response, bool* has_output) {
+    *has_output = false;
+
+    rpc_message return_val;
+    quick_check(cl_recv_rtn(cl, &return_val));
+    if (return_val == RPC_RTN_ERROR)
+        return cl_handle_rtn_error(cl);
+
+    return cl_recv_response(cl, handle->elem_width, response, has_output);
+}
+
+static bool cl_recv_response(rpc_client* cl, unsigned elem_width, 
+                             rpc_response* response, bool* has_output) {
+    *has_output = false;
+
+    // Scan in data
+    rpc_data_flags data_flags;
+    quick_check(cl_recv_data_into(cl, response, &data_flags));
+
+    // Validate server packet
+    rpc_message svr_msg_end;
+    quick_check(cl_recv(cl, &svr_msg_end, sizeof(rpc_message)));
+    if (svr_msg_end != RPC_MSG_END)
+        return false;
+
+    // Arrays are handed back in native byte order
+    if (!data_array_to_native(&response->data, data_flags, elem_width, &cl->srv_profile)) {
+        cl_last_error = RPC_ERROR_DATA_INVALID;
+        fprintf(stderr, "Returned array does not hold whole elements!\n");
+        return true;
+    }
+
+    *has_output = true;
+    return true;
+}
+
+static bool cl_send_stream_call(rpc_client* cl, rpc_handle* handle, rpc_data* input, uint32_t window) {
+
+    // Same as a call, along with how far ahead the server may get
+    byte_buffer* packet = &cl->packet;
+    cl_begin_request(cl);
+    buffer_put_u8(packet, RPC_MSG_STREAM_CALL);
+    buffer_put_array(packet, input, handle->elem_width, &cl->srv_profile);
+    buffer_put_u64(packet, handle->hash_value);
+    buffer_put_u32(packet, window);
+    buffer_put_u8(packet, RPC_MSG_END);
+    return cl_send_request(cl);
+}
+
+static bool cl_recv_item(rpc_iter* it, rpc_data** output) {
+    rpc_client* cl = it->cl;
+    *output = NULL;
+
+    rpc_message return_val;
+    quick_check(cl_recv_rtn(cl, &return_val));
+
+    // The stream ends with either an error or an end marker
+    if (return_val == RPC_RTN_ERROR) {
+        it->is_finished = true;
+        return cl_handle_rtn_error(cl);
+    }
+    if (return_val == RPC_RTN_STREAM_END) {
+        it->is_finished = true;
+        rpc_message svr_msg_end;
+        quick_check(cl_recv(cl, &svr_msg_end, sizeof(rpc_message)));
+        return svr_msg_end == RPC_MSG_END;
+    }
+    if (return_val != RPC_RTN_ITEM)
+        return false;
+    quick_check(cl_recv_output(cl, it->elem_width, output));
+
+    // Give credit back in batches of half the window, so the server never has
+    // to wait as long as we keep reading
+    if (it->is_cancelled)
+        return true;
+    if (++it->n_unacked >= (it->window + 1) / 2) {
+        quick_check(cl_send_credit(cl, it->n_unacked));
+        it->n_unacked = 0;
+    }
+    return true;
+}
+
+static bool cl_send_credit(rpc_client* cl, uint32_t credits) {
+    byte_buffer* packet = &cl->packet;
+    buffer_clear(packet);
+    buffer_put_u8(packet, RPC_MSG_STREAM_CREDIT);
+    buffer_put_u32(packet, credits);
+    buffer_put_u8(packet, RPC_MSG_END);
+    if (!cl->is_reply_framed)
+        return socket_send(cl->serverfd, packet->data, packet->len);
+
+    // Credit belongs to the stream, so it's framed with the stream's request ID
+    rpc_frame_header header = {
+        .type = packet->data[0],
+        .flags = 0,
+        .request_id = cl->next_request_id,
+        .body_len = packet->len - 1,
+    };
+    return socket_send_frame(cl->serverfd, &header, packet->data + 1);
+}
+
+static bool cl_check_payload(rpc_client* cl, rpc_handle* h, rpc_data* payload) {
+
+    // Until the handshake is answered, assume the server is like us. It checks
+    // what it receives as well, so nothing can overflow over there regardless
+    hw_profile local_profile;
+    hw_profile* svr_profile = &cl->srv_profile;
+    if (cl->is_handshake_pending) {
+        init_local_profile(&local_profile);
+        svr_profile = &local_profile;
+    }
+
+    // Check that the data will not overflow on the server
+    rpc_error error = check_data(svr_profile, payload) | check_array(payload, h->elem_width);
+    cl_last_error = error;
+    if (error) {
+
+        if (error & RPC_ERROR_DATA_INT_OVF)
+            fprintf(stderr, "Payload.data1 value too large for server!\n");
+
+        if (error & RPC_ERROR_DATA_BUFF_OVF)
+            fprintf(stderr, "Payload.data2 contains too much data for the server!\n");
+
+        if (error & RPC_ERROR_DATA_INVALID)
+            fprintf(stderr, "Payload is invalid!\n");
+
+        return false;
+    }
+    return true;
+}
+
+static bool cl_handle_proc_stats(rpc_client* cl, rpc_stats** output, size_t* count) {
+    if (cl == NULL || output == NULL || count == NULL)
+        return true;
+
+    *output = NULL;
+    *count = 0;
+
+    // Send out request
+    cl_begin_request(cl);
+    buffer_put_u8(&cl->packet, RPC_MSG_STATS);
+    buffer_put_u8(&cl->packet, RPC_MSG_END);
+    quick_check(cl_send_request(cl));
+
+    // Deal with return value
+    rpc_message return_val;
+    quick_check(cl_recv_rtn(cl, &return_val));
+
+    // Handle the error
+    if (return_val == RPC_RTN_ERROR)
+        return cl_handle_rtn_error(cl);
+
+    uint16_t be_n_stats;
+    quick_check(cl_recv(cl, &be_n_stats, sizeof(uint16_t)));
+    uint16_t n_stats = ntohs(be_n_stats);
+
+    // Every entry is a name followed by a fixed number of 64-bit fields
+    rpc_stats* stats = calloc(n_stats, sizeof(rpc_stats));
+    for (uint16_t i=0; i<n_stats; i++) {
+        uint16_t be_len_name;
+        uint64_t be_fields[RPC_STATS_NUM_FIELDS];
+        if (!cl_recv(cl, &be_len_name, sizeof(uint16_t))) {
+            rpc_stats_free(stats, n_stats);
+            return false;
+        }
+
+        uint16_t len_name = ntohs(be_len_name);
+        stats[i].name = malloc(len_name + 1);
+        if (!cl_recv(cl, stats[i].name, len_name) ||
+            !cl_recv(cl, be_fields, sizeof(be_fields))) {
+            rpc_stats_free(stats, n_stats);
+            return false;
+        }
+        stats[i].name[len_name] = 0;
+
+        uint64_t* fields[RPC_STATS_NUM_FIELDS];
+        rpc_stats_fields(&stats[i], fields);
+        for (int j=0; j<RPC_STATS_NUM_FIELDS; j++)
+            *fields[j] = ntoh64(be_fields[j]);
+    }
+
+    // Validate server packet
+    rpc_message svr_msg_end;
+    if (!cl_recv(cl, &svr_msg_end, sizeof(rpc_message)) ||
+        svr_msg_end != RPC_MSG_END) {
+        rpc_stats_free(stats, n_stats);
+        return false;
+    }
+
+    *output = stats;
+    *count = n_stats;
+    return true;
+}
+
+static bool cl_handle_proc_load(rpc_client* cl, rpc_load* output) {
+    if (cl == NULL || output == NULL)
+        return true;
+
+
+    // Send out request
+    cl_begin_request(cl);
+    buffer_put_u8(&cl->packet, RPC_MSG_LOAD);
+    buffer_put_u8(&cl->packet, RPC_MSG_END);
+    quick_check(cl_send_request(cl));
+
+    // Deal with return value
+    rpc_message return_val;
+    quick_check(cl_recv_rtn(cl, &return_val));
+
+    // Handle the error
+    if (return_val == RPC_RTN_ERROR)
+        return cl_handle_rtn_error(cl);
+
+    // Only servers that advertised it report their memory
+    bool has_memory = (cl->srv_profile.capabilities & RPC_CAP_LOAD_MEMORY) != 0;
+    uint64_t be_fields[6];
+    quick_check(cl_recv(cl, be_fields, (has_memory ? 6 : 4) * sizeof(uint64_t)));
+    output->queued_clients = ntoh64(be_fields[0]);
+    output->inflight_calls = ntoh64(be_fields[1]);
+    output->rejected_clients = ntoh64(be_fields[2]);
+    output->rejected_calls = ntoh64(be_fields[3]);
+    if (has_memory) {
+        output->inbound_bytes = ntoh64(be_fields[4]);
+        output->rejected_payloads = ntoh64(be_fields[5]);
+    }
 
     // Validate server packet
     rpc_message svr_msg_end;
-    quick_check(socket_recv(serverfd, &svr_msg_end, sizeof(rpc_message)));
+    quick_check(cl_recv(cl, &svr_msg_end, sizeof(rpc_message)));
     if (svr_msg_end != RPC_MSG_END)
         return false;
 
-    *output = data_in;
+    return true;
+}
 
+static bool cl_handle_rtn_error(rpc_client* cl) {
+    quick_check(cl_recv_rtn_error(cl));
+    cl_print_rtn_error(cl_last_error);
     return true;
 }
 
-static bool cl_handle_rtn_error(int serverfd) {
+static bool cl_recv_rtn_error(rpc_client* cl) {
 
-    // Read in error
+    // Read in error, which only takes two bytes if both ends support it. The
+    // reply to the handshake is always the one byte
     rpc_error error;
-    quick_check(socket_recv(serverfd, &error, sizeof(rpc_error)));
-    cl_print_rtn_error(error);
+    if (cl->srv_profile.capabilities & RPC_CAP_WIDE_ERRORS) {
+        rpc_error be_error;
+        quick_check(cl_recv(cl, &be_error, sizeof(rpc_error)));
+        error = ntohs(be_error);
+    } else {
+        uint8_t legacy_error;
+        quick_check(cl_recv(cl, &legacy_error, sizeof(uint8_t)));
+        error = legacy_error;
+        if (legacy_error == RPC_ERROR_LEGACY_OVERLOADED)
+            error = RPC_ERROR_OVERLOADED;
+    }
+    cl_last_error = error;
 
     // Validate server packet
     rpc_message svr_msg_end;
-    quick_check(socket_recv(serverfd, &svr_msg_end, sizeof(rpc_message)));
+    quick_check(cl_recv(cl, &svr_msg_end, sizeof(rpc_message)));
     if (svr_msg_end != RPC_MSG_END)
         return false;
     
@@ -789,6 +3470,68 @@ static void cl_print_rtn_error(rpc_error error) {
 
     if (error & RPC_ERROR_PQT_INVALID)
         fprintf(stderr, "Packet sent to server was not formatted correctly");
+
+    if (error & RPC_ERROR_OVERLOADED)
+        fprintf(stderr, "Server is overloaded!\n");
+
+    if (error & RPC_ERROR_MEM_BUDGET)
+        fprintf(stderr, "Request too large for the server's memory budget!\n");
+}
+
+static void rpc_stats_fields(rpc_stats* stats, uint64_t* fields[RPC_STATS_NUM_FIELDS]) {
+    int n_fields = 0;
+    fields[n_fields++] = &stats->calls;
+    fields[n_fields++] = &stats->bytes_in;
+    fields[n_fields++] = &stats->bytes_out;
+    for (int i=0; i<RPC_STATS_NUM_ERRORS; i++)
+        fields[n_fields++] = &stats->errors[i];
+    fields[n_fields++] = &stats->cache_hits;
+    fields[n_fields++] = &stats->cache_misses;
+    fields[n_fields++] = &stats->latency_mean_ns;
+    fields[n_fields++] = &stats->latency_p50_ns;
+    fields[n_fields++] = &stats->latency_p90_ns;
+    fields[n_fields++] = &stats->latency_p99_ns;
+    fields[n_fields++] = &stats->latency_p999_ns;
+    fields[n_fields++] = &stats->latency_max_ns;
+    assert(n_fields == RPC_STATS_NUM_FIELDS);
+}
+
+static rpc_server* rpc_create_server(void) {
+
+    // Used to wake up the serving loop when asked to shut down, and then the
+    // workers once it starts draining
+    int wakefd[2];
+    int drainfd[2];
+    if (pipe(wakefd) < 0) {
+        perror("pipe() failed!\n");
+        return NULL;
+    }
+    if (pipe(drainfd) < 0) {
+        perror("pipe() failed!\n");
+        close(wakefd[0]);
+        close(wakefd[1]);
+        return NULL;
+    }
+
+    rpc_server* new_srv = calloc(1, sizeof(rpc_server));
+    new_srv->hash_table = ht_create();
+    new_srv->list_fd = list_create(true);
+    pthread_cond_init(&new_srv->client_cond, NULL);
+    pthread_mutex_init(&new_srv->mutex_list_fd, NULL);
+    new_srv->masterfd = SOCKET_NULL_HANDLE;
+    new_srv->wakefd[0] = wakefd[0];
+    new_srv->wakefd[1] = wakefd[1];
+    new_srv->drainfd[0] = drainfd[0];
+    new_srv->drainfd[1] = drainfd[1];
+    new_srv->handofffd = SOCKET_NULL_HANDLE;
+    atomic_init(&new_srv->is_draining, false);
+    init_local_profile(&new_srv->profile);
+    new_srv->unmatched_stats = stats_create();
+    new_srv->cache_max_entries = CACHE_DEFAULT_MAX_ENTRIES;
+    new_srv->cache_max_bytes = CACHE_DEFAULT_MAX_BYTES;
+    new_srv->offload_max_threads = OFFLOAD_DEFAULT_MAX_THREADS;
+    new_srv->n_node_idle = calloc(1, sizeof(size_t));
+    return new_srv;
 }
 
 static void rpc_destroy_server(rpc_server* srv) {
@@ -798,9 +3541,26 @@ static void rpc_destroy_server(rpc_server* srv) {
     if (srv->masterfd != SOCKET_NULL_HANDLE)
         close(srv->masterfd);
 
+    // Shutdown and hot restart
+    close(srv->wakefd[0]);
+    close(srv->wakefd[1]);
+    close(srv->drainfd[0]);
+    close(srv->drainfd[1]);
+    if (srv->handofffd != SOCKET_NULL_HANDLE) {
+        close(srv->handofffd);
+        unlink(srv->handoff_path);
+    }
+    free(srv->handoff_path);
+
     // Data structures
     ht_destroy(srv->hash_table);
     list_destroy(srv->list_fd);
+    stats_destroy(srv->unmatched_stats);
+    cache_destroy(srv->cache);
+    sched_destroy(srv->scheduler);
+    offload_destroy(srv->offload);
+    topology_destroy(srv->topology);
+    free(srv->n_node_idle);
     
     // Thread state
     pthread_cond_destroy(&srv->client_cond);
@@ -818,6 +3578,9 @@ static void rpc_destroy_client(rpc_client* cl) {
     // Close the socket
     if (cl->serverfd != SOCKET_NULL_HANDLE)
         close(cl->serverfd);
+    buffer_deinit(&cl->packet);
+    buffer_deinit(&cl->reply);
+    FREE(cl->addr);
     
     // Zero state and free
     memset(cl, 0 , sizeof(rpc_client));
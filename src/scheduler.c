@@ -0,0 +1,90 @@
+#include "scheduler.h"
+#include "stats.h"
+
+// A call waiting for a run slot. Lives on the stack of the waiting thread
+typedef struct sched_waiter {
+    uint64_t deadline_ns;
+    pthread_cond_t granted_cond;
+    bool is_granted;
+} sched_waiter;
+
+static const uint64_t sched_slack_ns[SCHED_NUM_CLASSES] = {
+    [SCHED_CLASS_INTERACTIVE] = SCHED_SLACK_INTERACTIVE_NS,
+    [SCHED_CLASS_NORMAL] = SCHED_SLACK_NORMAL_NS,
+    [SCHED_CLASS_BULK] = SCHED_SLACK_BULK_NS,
+};
+
+// Orders waiters by deadline, keeping arrival order between equal deadlines
+static int32_t sched_waiter_cmp(void* a, void* b);
+
+scheduler* sched_create(size_t max_running) {
+    if (max_running == 0)
+        return NULL;
+
+    scheduler* sched = calloc(1, sizeof(scheduler));
+    pthread_mutex_init(&sched->mutex, NULL);
+    sched->max_running = max_running;
+    sched->waiting = list_create(false);
+    return sched;
+}
+
+void sched_destroy(scheduler* sched) {
+    if (sched == NULL)
+        return;
+
+    list_destroy(sched->waiting);
+    pthread_mutex_destroy(&sched->mutex);
+    free(sched);
+}
+
+void sched_enter(scheduler* sched, sched_class class) {
+    if (sched == NULL)
+        return;
+
+    pthread_mutex_lock(&sched->mutex);
+
+    // Only run straight away if nobody is already waiting
+    if (sched->n_running < sched->max_running && sched->waiting->head == NULL) {
+        sched->n_running++;
+        pthread_mutex_unlock(&sched->mutex);
+        return;
+    }
+
+    sched_waiter waiter = {
+        .deadline_ns = stats_now_ns() + sched_slack_ns[class],
+        .is_granted = false,
+    };
+    pthread_cond_init(&waiter.granted_cond, NULL);
+    list_insert_sorted(sched->waiting, &waiter, sched_waiter_cmp);
+
+    // The slot is handed over by sched_leave(), so n_running is already counted
+    while (!waiter.is_granted)
+        pthread_cond_wait(&waiter.granted_cond, &sched->mutex);
+
+    pthread_mutex_unlock(&sched->mutex);
+    pthread_cond_destroy(&waiter.granted_cond);
+}
+
+void sched_leave(scheduler* sched) {
+    if (sched == NULL)
+        return;
+
+    pthread_mutex_lock(&sched->mutex);
+
+    if (sched->waiting->head != NULL) {
+        sched_waiter* waiter = sched->waiting->head->data;
+        list_pop_head(sched->waiting);
+        waiter->is_granted = true;
+        pthread_cond_signal(&waiter->granted_cond);
+    } else {
+        sched->n_running--;
+    }
+
+    pthread_mutex_unlock(&sched->mutex);
+}
+
+static int32_t sched_waiter_cmp(void* a, void* b) {
+    sched_waiter* waiter_a = a;
+    sched_waiter* waiter_b = b;
+    return waiter_a->deadline_ns < waiter_b->deadline_ns ? -1 : 1;
+}
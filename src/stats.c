@@ -0,0 +1,175 @@
+#include "stats.h"
+
+#include <time.h>
+
+// Every thread is given its own shard the first time it records anything
+static atomic_uint next_shard = 0;
+static __thread int thread_shard = -1;
+
+// Retrieves the shard owned by the calling thread
+static stats_shard* stats_local_shard(func_stats* stats);
+
+// Maps a latency onto its histogram bucket and back
+static size_t stats_bucket_index(uint64_t value);
+static uint64_t stats_bucket_value(size_t index);
+
+// Finds the value below which the given fraction of samples fall
+static uint64_t stats_percentile(uint64_t* buckets, uint64_t total, double fraction);
+
+func_stats* stats_create(void) {
+    func_stats* stats = aligned_alloc(64, sizeof(func_stats));
+    assert(stats != NULL);
+    memset(stats, 0, sizeof(func_stats));
+    return stats;
+}
+
+void stats_destroy(func_stats* stats) {
+    free(stats);
+}
+
+uint64_t stats_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void stats_record_call(func_stats* stats, uint64_t latency_ns,
+                       uint64_t bytes_in, uint64_t bytes_out) {
+    if (stats == NULL)
+        return;
+
+    // Shards are effectively single writer, so relaxed ordering is enough
+    stats_shard* shard = stats_local_shard(stats);
+    atomic_fetch_add_explicit(&shard->calls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->bytes_in, bytes_in, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->bytes_out, bytes_out, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->latency_sum, latency_ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->latency_buckets[stats_bucket_index(latency_ns)],
+                              1, memory_order_relaxed);
+
+    uint64_t latency_max = atomic_load_explicit(&shard->latency_max, memory_order_relaxed);
+    while (latency_ns > latency_max &&
+           !atomic_compare_exchange_weak_explicit(&shard->latency_max, &latency_max, latency_ns,
+                                                  memory_order_relaxed, memory_order_relaxed));
+}
+
+void stats_record_error(func_stats* stats, rpc_error error) {
+    if (stats == NULL)
+        return;
+
+    stats_shard* shard = stats_local_shard(stats);
+    for (int i=0; i<RPC_STATS_NUM_ERRORS; i++) {
+        if (error & (1 << i))
+            atomic_fetch_add_explicit(&shard->errors[i], 1, memory_order_relaxed);
+    }
+}
+
+void stats_record_cache(func_stats* stats, bool is_hit) {
+    if (stats == NULL)
+        return;
+
+    stats_shard* shard = stats_local_shard(stats);
+    atomic_fetch_add_explicit(is_hit ? &shard->cache_hits : &shard->cache_misses,
+                              1, memory_order_relaxed);
+}
+
+void stats_snapshot(func_stats* stats, rpc_stats* output) {
+    if (stats == NULL || output == NULL)
+        return;
+
+    uint64_t latency_sum = 0;
+    uint64_t* buckets = calloc(STATS_NUM_BUCKETS, sizeof(uint64_t));
+
+    output->calls = 0;
+    output->bytes_in = 0;
+    output->bytes_out = 0;
+    output->latency_max_ns = 0;
+    output->cache_hits = 0;
+    output->cache_misses = 0;
+    memset(output->errors, 0, sizeof(output->errors));
+
+    // Sum up every shard
+    for (int i=0; i<STATS_NUM_SHARDS; i++) {
+        stats_shard* shard = &stats->shards[i];
+        output->calls += atomic_load_explicit(&shard->calls, memory_order_relaxed);
+        output->bytes_in += atomic_load_explicit(&shard->bytes_in, memory_order_relaxed);
+        output->bytes_out += atomic_load_explicit(&shard->bytes_out, memory_order_relaxed);
+        latency_sum += atomic_load_explicit(&shard->latency_sum, memory_order_relaxed);
+        output->cache_hits += atomic_load_explicit(&shard->cache_hits, memory_order_relaxed);
+        output->cache_misses += atomic_load_explicit(&shard->cache_misses, memory_order_relaxed);
+
+        for (int j=0; j<RPC_STATS_NUM_ERRORS; j++)
+            output->errors[j] += atomic_load_explicit(&shard->errors[j], memory_order_relaxed);
+
+        uint64_t latency_max = atomic_load_explicit(&shard->latency_max, memory_order_relaxed);
+        if (latency_max > output->latency_max_ns)
+            output->latency_max_ns = latency_max;
+
+        for (int j=0; j<STATS_NUM_BUCKETS; j++)
+            buckets[j] += atomic_load_explicit(&shard->latency_buckets[j], memory_order_relaxed);
+    }
+
+    // Buckets are read separately from the counters, so total them up again
+    uint64_t total = 0;
+    for (int i=0; i<STATS_NUM_BUCKETS; i++)
+        total += buckets[i];
+
+    output->latency_mean_ns = total ? latency_sum / total : 0;
+    output->latency_p50_ns = stats_percentile(buckets, total, 0.5);
+    output->latency_p90_ns = stats_percentile(buckets, total, 0.9);
+    output->latency_p99_ns = stats_percentile(buckets, total, 0.99);
+    output->latency_p999_ns = stats_percentile(buckets, total, 0.999);
+
+    // Percentiles are bucket upper bounds, which can overshoot the real maximum
+    if (output->latency_p50_ns > output->latency_max_ns) output->latency_p50_ns = output->latency_max_ns;
+    if (output->latency_p90_ns > output->latency_max_ns) output->latency_p90_ns = output->latency_max_ns;
+    if (output->latency_p99_ns > output->latency_max_ns) output->latency_p99_ns = output->latency_max_ns;
+    if (output->latency_p999_ns > output->latency_max_ns) output->latency_p999_ns = output->latency_max_ns;
+
+    free(buckets);
+}
+
+static stats_shard* stats_local_shard(func_stats* stats) {
+    if (thread_shard < 0)
+        thread_shard = atomic_fetch_add(&next_shard, 1) % STATS_NUM_SHARDS;
+    return &stats->shards[thread_shard];
+}
+
+static size_t stats_bucket_index(uint64_t value) {
+
+    // Small values get a bucket each
+    if (value < STATS_SUB_COUNT)
+        return value;
+
+    // Otherwise keep the top STATS_SUB_BITS bits below the most significant one
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - STATS_SUB_BITS;
+    return (shift + 1) * STATS_SUB_COUNT + ((value >> shift) & (STATS_SUB_COUNT - 1));
+}
+
+static uint64_t stats_bucket_value(size_t index) {
+    if (index < STATS_SUB_COUNT)
+        return index;
+
+    // Highest value that still maps onto this bucket
+    int shift = index / STATS_SUB_COUNT - 1;
+    uint64_t lower = (uint64_t)(STATS_SUB_COUNT + index % STATS_SUB_COUNT) << shift;
+    return lower + ((1ULL << shift) - 1);
+}
+
+static uint64_t stats_percentile(uint64_t* buckets, uint64_t total, double fraction) {
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t)(fraction * total);
+    if (rank >= total)
+        rank = total - 1;
+
+    uint64_t seen = 0;
+    for (size_t i=0; i<STATS_NUM_BUCKETS; i++) {
+        seen += buckets[i];
+        if (seen > rank)
+            return stats_bucket_value(i);
+    }
+    return stats_bucket_value(STATS_NUM_BUCKETS - 1);
+}
@@ -0,0 +1,112 @@
+#include "topology.h"
+
+#include <dirent.h>
+
+#define TOPOLOGY_NODE_DIR "/sys/devices/system/node"
+
+// Marks every CPU in a sysfs cpulist such as "0-3,8-11" that is also in allowed
+static void topology_parse_cpulist(char* cpulist, cpu_set_t* allowed, cpu_set_t* output);
+
+// Adds a node made of the given CPUs, unless none of them can be used
+static void topology_add_node(topology* topo, cpu_set_t* cpus);
+
+topology* topology_create(void) {
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(cpu_set_t), &allowed) != 0)
+        return NULL;
+
+    topology* topo = calloc(1, sizeof(topology));
+    topo->n_cpu_ids = CPU_SETSIZE;
+    topo->cpu_node = malloc(CPU_SETSIZE * sizeof(int));
+    for (int i=0; i<CPU_SETSIZE; i++)
+        topo->cpu_node[i] = -1;
+
+    // Every directory named nodeN is a node, listing its CPUs in cpulist
+    DIR* node_dir = opendir(TOPOLOGY_NODE_DIR);
+    struct dirent* entry;
+    while (node_dir != NULL && (entry = readdir(node_dir)) != NULL) {
+        int node_id;
+        if (sscanf(entry->d_name, "node%d", &node_id) != 1)
+            continue;
+
+        char path[PATH_MAX];
+        snprintf(path, sizeof(path), TOPOLOGY_NODE_DIR "/%s/cpulist", entry->d_name);
+        FILE* file = fopen(path, "r");
+        if (file == NULL)
+            continue;
+
+        char cpulist[4096] = "";
+        if (fgets(cpulist, sizeof(cpulist), file) != NULL) {
+            cpu_set_t cpus;
+            topology_parse_cpulist(cpulist, &allowed, &cpus);
+            topology_add_node(topo, &cpus);
+        }
+        fclose(file);
+    }
+    if (node_dir != NULL)
+        closedir(node_dir);
+
+    // No NUMA information, so treat the machine as a single node
+    if (topo->n_nodes == 0)
+        topology_add_node(topo, &allowed);
+
+    return topo;
+}
+
+void topology_destroy(topology* topo) {
+    if (topo == NULL)
+        return;
+
+    for (size_t i=0; i<topo->n_nodes; i++)
+        free(topo->node_cpus[i]);
+    free(topo->node_cpus);
+    free(topo->n_node_cpus);
+    free(topo->cpu_node);
+    free(topo);
+}
+
+int topology_cpu_node(topology* topo, int cpu) {
+    if (topo == NULL || cpu < 0 || cpu >= topo->n_cpu_ids)
+        return -1;
+    return topo->cpu_node[cpu];
+}
+
+static void topology_parse_cpulist(char* cpulist, cpu_set_t* allowed, cpu_set_t* output) {
+    CPU_ZERO(output);
+
+    char* save = NULL;
+    for (char* range = strtok_r(cpulist, ",\n", &save); range != NULL; 
+         range = strtok_r(NULL, ",\n", &save)) {
+        int first, last;
+        int n_matched = sscanf(range, "%d-%d", &first, &last);
+        if (n_matched < 1)
+            continue;
+        if (n_matched == 1)
+            last = first;
+
+        for (int cpu=first; cpu<=last && cpu<CPU_SETSIZE; cpu++) {
+            if (cpu >= 0 && CPU_ISSET(cpu, allowed))
+                CPU_SET(cpu, output);
+        }
+    }
+}
+
+static void topology_add_node(topology* topo, cpu_set_t* cpus) {
+    size_t n_cpus = CPU_COUNT(cpus);
+    if (n_cpus == 0)
+        return;
+
+    size_t node = topo->n_nodes++;
+    topo->node_cpus = realloc(topo->node_cpus, topo->n_nodes * sizeof(int*));
+    topo->n_node_cpus = realloc(topo->n_node_cpus, topo->n_nodes * sizeof(size_t));
+    topo->node_cpus[node] = malloc(n_cpus * sizeof(int));
+    topo->n_node_cpus[node] = 0;
+
+    for (int cpu=0; cpu<CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, cpus))
+            continue;
+        topo->node_cpus[node][topo->n_node_cpus[node]++] = cpu;
+        topo->cpu_node[cpu] = node;
+    }
+}
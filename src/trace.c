@@ -0,0 +1,162 @@
+#include "trace.h"
+
+#ifdef RPC_TRACE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+
+// Single producer ring, the owning thread is the only one that writes to it.
+// Its thread_id stays with it, and its requests are numbered from 1 on
+typedef struct trace_ring trace_ring;
+struct trace_ring {
+    trace_record records[TRACE_RING_SIZE];
+    atomic_uint_fast64_t head;
+    uint32_t n_requests;
+    uint16_t thread_id;
+    trace_context current;
+    trace_ring* next;
+    trace_ring* next_free;
+};
+
+// Every ring ever created, so that they can be dumped from any thread.
+// Rings are never freed, since they may be dumped at any time. Those of
+// threads that have exited are handed to new threads instead, so there are
+// only ever as many rings as threads that were recording at once
+static trace_ring* all_rings = NULL;
+static trace_ring* free_rings = NULL;
+static uint16_t n_rings = 0;
+static pthread_mutex_t mutex_rings = PTHREAD_MUTEX_INITIALIZER;
+
+static __thread trace_ring* local_ring = NULL;
+
+// Gives a thread's ring back once the thread exits
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+// Hands the calling thread a ring, reusing a free one if there is one
+static trace_ring* trace_local_ring(void);
+static void trace_create_key(void);
+static void trace_release_ring(void* ring);
+
+static trace_ring* trace_local_ring(void) {
+    if (local_ring != NULL)
+        return local_ring;
+    pthread_once(&ring_key_once, trace_create_key);
+
+    // This happens once per thread, so a lock is fine here
+    pthread_mutex_lock(&mutex_rings);
+    trace_ring* ring = free_rings;
+    if (ring != NULL) {
+        free_rings = ring->next_free;
+    } else {
+        ring = calloc(1, sizeof(trace_ring));
+        assert(ring != NULL);
+        ring->thread_id = n_rings++;
+        ring->next = all_rings;
+        all_rings = ring;
+    }
+    pthread_mutex_unlock(&mutex_rings);
+
+    pthread_setspecific(ring_key, ring);
+    local_ring = ring;
+    return ring;
+}
+
+static void trace_create_key(void) {
+    pthread_key_create(&ring_key, trace_release_ring);
+}
+
+static void trace_release_ring(void* ring) {
+    pthread_mutex_lock(&mutex_rings);
+    ((trace_ring*)ring)->next_free = free_rings;
+    free_rings = ring;
+    pthread_mutex_unlock(&mutex_rings);
+}
+
+void trace_request_begin(uint8_t message) {
+    trace_ring* ring = trace_local_ring();
+    ring->current = (trace_context) {
+        .request_id = ++ring->n_requests,
+        .thread_id = ring->thread_id,
+        .message = message,
+    };
+    trace_record_phase(TRACE_PHASE_RECV_HEADER);
+}
+
+trace_context trace_request_current(void) {
+    return trace_local_ring()->current;
+}
+
+void trace_request_swap(trace_context* context) {
+    trace_ring* ring = trace_local_ring();
+    trace_context temp = ring->current;
+    ring->current = *context;
+    *context = temp;
+}
+
+void trace_record_phase(uint8_t phase) {
+    trace_ring* ring = trace_local_ring();
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    trace_record* record = &ring->records[head & (TRACE_RING_SIZE - 1)];
+    record->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    record->request_id = ring->current.request_id;
+    record->thread_id = ring->current.thread_id;
+    record->phase = phase;
+    record->message = ring->current.message;
+
+    // Publish the record only once it has been written out
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+int64_t trace_dump(const char* path) {
+    if (path == NULL)
+        return -1;
+
+    FILE* file = fopen(path, "wb");
+    if (file == NULL)
+        return -1;
+
+    // Count is patched in at the end, once we know how many were written
+    trace_file_header header = {
+        .version = TRACE_FILE_VERSION,
+        .record_size = sizeof(trace_record),
+        .count = 0,
+    };
+    memcpy(header.magic, TRACE_FILE_MAGIC, sizeof(header.magic));
+    fwrite(&header, sizeof(trace_file_header), 1, file);
+
+    pthread_mutex_lock(&mutex_rings);
+    trace_ring* rings = all_rings;
+    pthread_mutex_unlock(&mutex_rings);
+
+    for (trace_ring* ring = rings; ring != NULL; ring = ring->next) {
+        uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint64_t n_records = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+
+        // Oldest records first. Records being overwritten while we copy may
+        // be torn, which is the price of never blocking the recording thread
+        for (uint64_t i=head - n_records; i<head; i++)
+            fwrite(&ring->records[i & (TRACE_RING_SIZE - 1)], sizeof(trace_record), 1, file);
+        header.count += n_records;
+    }
+
+    rewind(file);
+    fwrite(&header, sizeof(trace_file_header), 1, file);
+    bool is_written = !ferror(file);
+    fclose(file);
+
+    return is_written ? (int64_t)header.count : -1;
+}
+
+#else
+
+int64_t trace_dump(const char* path) {
+    return -1;
+}
+
+#endif